@@ -2,6 +2,8 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 typedef void (* lsp_op_t)(void);
 typedef int lsp_fp_t;
@@ -83,6 +85,27 @@ void lsp_shrink_frame(int nargs);
  */
 void lsp_restore_fp(lsp_fp_t fp);
 
+/**
+ * Checks that there is space on the stack for at least `n` more references.
+ *
+ * Will abort if there is not.
+ */
+void lsp_reserve(int n);
+
+/**
+ * Unchecked stack operations
+ * --------------------------
+ * Variants of the stack operations above that skip all bounds checks, for use
+ * in inner loops.  Callers must only pass offsets that are within the current
+ * frame, and must first call `lsp_reserve` to make space for anything that
+ * they push.  Space that has been reserved remains available across calls to
+ * other functions, as long as the stack is returned to the same height.
+ */
+void lsp_dup_unchecked(int offset);
+void lsp_store_unchecked(int offset);
+void lsp_pop_unchecked(void);
+void lsp_swp_unchecked(int offset);
+
 /**
  * Heap operations
  * ===============
@@ -107,14 +130,27 @@ lsp_op_t lsp_read_op(int offset);
 bool lsp_is_truthy(void);
 bool lsp_is_equal(void);
 
+/**
+ * Returns true if the refs at both offsets point to the same object, or hold
+ * the same immediate value.
+ */
+bool lsp_is_identical(int offset_a, int offset_b);
+
 
 /**
  * Integers
  * --------
+ * Integers are stored directly in references, and are 62 bits wide.  Values
+ * outside of that range wrap around when they are pushed.
  */
-void lsp_push_int(int value);
+typedef int64_t lsp_int_t;
+
+#define LSP_INT_MAX (((lsp_int_t) 1 << 61) - 1)
+#define LSP_INT_MIN (-LSP_INT_MAX - 1)
+
+void lsp_push_int(lsp_int_t value);
 bool lsp_is_int(int offset);
-int lsp_read_int(int offset);
+lsp_int_t lsp_read_int(int offset);
 
 void lsp_int_add(void);
 void lsp_int_sub(void);
@@ -124,9 +160,41 @@ void lsp_int_div(void);
 /**
  * Symbols
  * -------
+ * Symbols are interned: every symbol with the same name shares the same small
+ * integer id for the lifetime of the VM, so symbols can be compared by id
+ * without looking at their names.
+ */
+typedef unsigned int lsp_sym_t;
+
+/**
+ * Ids of the symbols naming special forms.  These are interned when the VM is
+ * initialised and so are always the same.
+ */
+enum {
+    LSP_SYM_IF = 0,
+    LSP_SYM_QUOTE,
+    LSP_SYM_DEFINE,
+    LSP_SYM_SET,
+    LSP_SYM_LAMBDA,
+    LSP_SYM_BEGIN,
+};
+
+/**
+ * Returns the id of the symbol with the given name, adding it to the symbol
+ * table if it has not been seen before.
  */
+lsp_sym_t lsp_intern(char const *name);
+
+/**
+ * Like `lsp_intern`, but takes the first `length` bytes of `name` rather than
+ * reading up to a null byte.
+ */
+lsp_sym_t lsp_intern_length(char const *name, size_t length);
+
 void lsp_push_symbol(char const *value);
+void lsp_push_symbol_id(lsp_sym_t sym);
 bool lsp_is_symbol(int offset);
+lsp_sym_t lsp_read_symbol(int offset);
 char const *lsp_borrow_symbol(int offset);
 bool lsp_symbol_matches_literal(char const *value);
 
@@ -227,6 +295,175 @@ void lsp_set_car(void);
 void lsp_set_cdr(void);
 
 
+/**
+ * Vectors
+ * -------
+ * Fixed length arrays of values, stored contiguously so that every element can
+ * be read or replaced in constant time.  Elements are numbered from zero.
+ */
+
+/**
+ * Pushes a new vector with `length` elements, each set to null.
+ */
+void lsp_push_vector(size_t length);
+
+/**
+ * Pushes a new vector containing a copy of each of the `length` integers in
+ * `values`.  The vector is filled in a single allocation.
+ */
+void lsp_push_vector_from_ints(lsp_int_t const *values, size_t length);
+
+/**
+ * Returns true if the ref at offset points to a vector, false otherwise.
+ */
+bool lsp_is_vector(int offset);
+
+/**
+ * Pops every value in the current frame and collects them in a new vector,
+ * with the value at the top of the stack as the first element.
+ *
+ * Returns:
+ *   - The new vector.
+ */
+void lsp_vector(void);
+
+/**
+ * Returns the number of elements in a vector.
+ *
+ * Arguments:
+ *   - vector: The vector to measure.
+ *
+ * Returns:
+ *   - The length of the vector, as an integer.
+ */
+void lsp_vector_length(void);
+
+/**
+ * Returns an element of a vector.
+ *
+ * Arguments:
+ *   - vector: The vector to read from.
+ *   - index: The index of the element.
+ *
+ * Returns:
+ *   - The element at `index`.
+ *
+ * Will abort if `index` is out of range.
+ */
+void lsp_vector_ref(void);
+
+/**
+ * Replaces an element of a vector, and pops the vector, the index and the
+ * replacement value from the stack.
+ *
+ * Arguments:
+ *   - vector: The vector to modify.
+ *   - index: The index of the element.
+ *   - value: The value to replace the element with.
+ *
+ * Will abort if `index` is out of range.
+ */
+void lsp_vector_set(void);
+
+
+/**
+ * Tables
+ * ------
+ * Hash tables mapping keys to values.  Keys are compared by value, and can be
+ * null, integers, symbols or strings.  Looking up, inserting and deleting keys
+ * take constant time on average.
+ */
+
+/**
+ * Pushes a new, empty table.
+ */
+void lsp_push_table(void);
+
+/**
+ * Returns true if the ref at offset points to a table, false otherwise.
+ */
+bool lsp_is_table(int offset);
+
+/**
+ * Returns the number of entries in a table.
+ *
+ * Arguments:
+ *   - table: The table to measure.
+ *
+ * Returns:
+ *   - The number of entries, as an integer.
+ */
+void lsp_table_count(void);
+
+/**
+ * Looks up a key in a table.
+ *
+ * Arguments:
+ *   - table: The table to search.
+ *   - key: The key to look for.
+ *
+ * Returns:
+ *   - The value associated with `key`, or null if it is not in the table.
+ *
+ * Will abort if `key` is not a null, integer, symbol or string.
+ */
+void lsp_table_ref(void);
+
+/**
+ * Associates a value with a key in a table, replacing any existing value, and
+ * pops the table, the key and the value from the stack.
+ *
+ * Arguments:
+ *   - table: The table to modify.
+ *   - key: The key to set.
+ *   - value: The value to associate with the key.
+ *
+ * Will abort if `key` is not a null, integer, symbol or string.
+ */
+void lsp_table_set(void);
+
+/**
+ * Removes a key, and its value, from a table if it is present, and pops the
+ * table and the key from the stack.
+ *
+ * Arguments:
+ *   - table: The table to modify.
+ *   - key: The key to remove.
+ *
+ * Will abort if `key` is not a null, integer, symbol or string.
+ */
+void lsp_table_delete(void);
+
+
+/**
+ * Bytecode
+ * --------
+ * Instructions produced by the compiler.  The heap treats bytecode as an opaque
+ * block of bytes, which cannot be modified once it has been pushed.
+ */
+
+/**
+ * Copies `length` bytes of bytecode onto the heap and pushes a reference to
+ * them onto the stack.
+ */
+void lsp_push_bytecode(unsigned char const *code, size_t length);
+
+/**
+ * Returns true if the ref at offset points to bytecode, false otherwise.
+ */
+bool lsp_is_bytecode(int offset);
+
+/**
+ * Returns a temporary pointer to the bytes of the bytecode at `offset`, which
+ * is not popped.
+ *
+ * Warning:
+ *     Calling any mutating lsp function could trigger a garbage collection
+ *     that would invalidate the pointer.
+ */
+unsigned char const *lsp_borrow_bytecode(int offset);
+
+
 /**
  * Higher Level Helper Functions
  * =============================
@@ -255,6 +492,42 @@ void lsp_map(void);
 void lsp_fold(void);
 void lsp_reverse(void);
 
+/**
+ * Vector Operations
+ * -----------------
+ */
+
+/**
+ * Applies a callable object to each element of a vector and returns a new
+ * vector containing the results.
+ *
+ * Arguments:
+ *   - fn: The operation to apply.
+ *   - vector: The vector of values to apply the operation to.
+ *
+ * Returns:
+ *   - A new vector of the return values.
+ */
+void lsp_vector_map(void);
+
+/**
+ * Equivalent of `lsp_vector_set` for use as a builtin.  Builtins must always
+ * return a value, so this returns null.
+ */
+void lsp_op_vector_set(void);
+
+/**
+ * Table Operations
+ * ----------------
+ */
+
+/**
+ * Equivalents of `lsp_table_set` and `lsp_table_delete` for use as builtins.
+ * Both return null.
+ */
+void lsp_op_table_set(void);
+void lsp_op_table_delete(void);
+
 
 /**
  * Environments
@@ -285,8 +558,48 @@ void lsp_define(void);
  */
 void lsp_lookup(void);
 void lsp_set(void);
+
+/**
+ * Returns the binding cell for a symbol, which is a pair holding the symbol
+ * and its value.  Assigning to the symbol replaces the value in the cell, so
+ * the cell stays valid until the symbol is shadowed by a new definition.
+ *
+ * Arguments:
+ *   - environment: The environment to search.
+ *   - symbol: The symbol to look up.
+ *
+ * Returns:
+ *   - The pair binding the symbol in the innermost scope that has one.
+ *
+ * Will abort if no binding exists.
+ */
+void lsp_lookup_binding(void);
+
+/**
+ * Returns a number that changes every time that a binding is defined, in any
+ * environment.  A cached binding cell remains valid for as long as the version
+ * does not change.
+ */
+unsigned int lsp_env_version(void);
+
 void lsp_push_empty_env(void);
 void lsp_push_default_env(void);
+
+/**
+ * Creates the environment for a closure, holding only the variables that it
+ * refers to.  The innermost binding cell of each symbol is copied into a
+ * vector, which is used as the innermost scope in front of the global part of
+ * the environment.  Cells are shared, so assignments are seen through both
+ * environments.  Symbols that are only bound globally are left to be looked up
+ * when the closure runs.
+ *
+ * Arguments:
+ *   - symbols: A list of the symbols to capture.
+ *   - environment: The environment to capture them from.
+ *
+ * Returns:
+ *   - The new environment.
+ */
 void lsp_capture(void);
 
 /**
@@ -296,14 +609,271 @@ void lsp_capture(void);
  */
 void lsp_abort(void);
 
+/**
+ * Options for configuring a new VM.
+ */
+typedef struct {
+    /**
+     * The number of threads, including the thread running the interpreter,
+     * that should be used to mark the heap during full collections.  Values
+     * less than two disable parallel marking.
+     */
+    int gc_threads;
+
+    /**
+     * The number of cons cells, and of eight byte words of data, that memory
+     * is committed for when the VM starts.  Zero selects a small default.
+     */
+    size_t cons_heap_initial;
+    size_t data_heap_initial;
+
+    /**
+     * The maximum number of cons cells, and of eight byte words of data, that
+     * each heap can grow to.  Address space for the maximum is reserved up
+     * front, but memory is only committed as the heaps grow.  Zero selects a
+     * default of 2^28.  Neither can be more than 2^31.
+     */
+    size_t cons_heap_max;
+    size_t data_heap_max;
+} lsp_vm_config_t;
+
+/**
+ * Initialises the VM with the default configuration.
+ */
 void lsp_vm_init(void);
 
+/**
+ * Initialises the VM using the options in `config`.
+ *
+ * Any helper threads needed by the garbage collector are started immediately.
+ */
+void lsp_vm_init_with_config(lsp_vm_config_t const *config);
+
+/**
+ * Virtual Machines
+ * ----------------
+ * Every function in this header acts on the current VM of the calling thread.
+ * Each thread starts with no current VM.  `lsp_vm_init` and friends create a
+ * VM and make it current, while the functions below allow several VMs to be
+ * managed explicitly, for example so that independent scripts can be run on
+ * separate threads.  A VM must not be current on more than one thread at a
+ * time.
+ */
+typedef struct lsp_vm lsp_vm_t;
+
+/**
+ * Creates a new VM using the options in `config`, without changing the current
+ * VM of the calling thread.
+ */
+lsp_vm_t *lsp_vm_create(lsp_vm_config_t const *config);
+
+/**
+ * Stops the helper threads of `vm` and releases all of its memory.  If `vm` is
+ * current on the calling thread then the thread is left with no current VM.
+ */
+void lsp_vm_destroy(lsp_vm_t *vm);
+
+/**
+ * Makes `vm` the current VM of the calling thread.  Passing `NULL` leaves the
+ * thread without a current VM.
+ */
+void lsp_vm_set_current(lsp_vm_t *vm);
+
+/**
+ * Returns the current VM of the calling thread, or `NULL` if there is none.
+ */
+lsp_vm_t *lsp_vm_get_current(void);
+
+/**
+ * Garbage Collection
+ * ------------------
+ * Collections are triggered automatically once enough data has been allocated
+ * since the previous collection.  These functions allow the schedule to be
+ * tuned, or a collection to be forced.
+ */
+
+/**
+ * Compacts both heaps, discarding everything that is not reachable from the
+ * reference stack.
+ *
+ * Invalidates all borrowed references.
+ */
+void lsp_gc_collect(void);
+
+/**
+ * Compacts only the data that has been allocated since the previous
+ * collection, and promotes everything that survives so that it will not be
+ * scanned again until the next full collection.
+ *
+ * Invalidates all borrowed references.
+ */
+void lsp_gc_collect_nursery(void);
+
+/**
+ * Sets how much data can be allocated between collections, as a multiple of
+ * the amount of data that survived the previous collection.
+ *
+ * Larger values trade memory for fewer collections.  The default is `1.0`,
+ * which allows each heap to double in size before it is collected again.  A
+ * collection is always forced when a heap is full, regardless of this value.
+ *
+ * Will abort if `factor` is negative.
+ */
+void lsp_gc_set_growth_factor(double factor);
+
+/**
+ * Enables incremental marking, with each slice of marking work limited to
+ * roughly `usec` microseconds.
+ *
+ * Slices are run between allocations while a full collection is in progress.
+ * Compaction still happens in a single pause once marking has finished.  A
+ * value of zero, the default, disables incremental marking so that full
+ * collections are run to completion as soon as they are triggered.
+ */
+void lsp_gc_set_pause_budget(unsigned int usec);
+
+/**
+ * Images
+ * ------
+ * Snapshots of the heaps and the reference stack that can be used to start a
+ * new VM without rebuilding its state.
+ */
+
+/**
+ * Registers an op under `name` so that it can be saved in images.  The ops
+ * provided by the interpreter are registered automatically.  Registering a
+ * name that is already in use replaces the op it refers to.
+ */
+void lsp_register_op(char const *name, lsp_op_t op);
+
+/**
+ * Runs a full collection and writes the heaps and the reference stack to the
+ * file at `path`.
+ *
+ * Returns false if the file could not be written, or if the heap contains an
+ * op that has not been registered.
+ */
+bool lsp_vm_save_image(char const *path);
+
+/**
+ * Initialises the VM from an image written by `lsp_vm_save_image`, using the
+ * options in `config`.
+ *
+ * The heaps are mapped from the image copy-on-write, so startup time does not
+ * depend on the size of the image, and pages are only copied as they are
+ * modified.  The only entries written while loading are ops, which are found
+ * through a table saved with the image and pointed back at the functions
+ * registered under their names.  The frame pointer and the reference stack
+ * are restored exactly as they were when the image was saved.
+ *
+ * Returns false, without initialising the VM, if the image could not be read,
+ * is truncated, has sections or tables that do not agree with each other,
+ * does not fit in the configured heaps, or refers to an op that has not been
+ * registered.  The contents of the heaps are not otherwise checked, so images
+ * should only be loaded from trusted sources.
+ */
+bool lsp_vm_init_from_image(char const *path, lsp_vm_config_t const *config);
+
+/**
+ * Creates a new VM from an image, as `lsp_vm_init_from_image` does, but
+ * without changing the current VM of the calling thread.
+ *
+ * Returns `NULL` if the image could not be loaded.
+ */
+lsp_vm_t *lsp_vm_create_from_image(
+    char const *path, lsp_vm_config_t const *config
+);
+
 void lsp_parse(void);
 
 void lsp_call(int nargs);
+
+/**
+ * Evaluates an expression.
+ *
+ * The expression is compiled to bytecode, which is then run by `lsp_exec`.
+ * The bodies of lambdas are compiled the first time that they are called, and
+ * the result is kept so that later calls run the same code.  Their arguments,
+ * and any names defined in their bodies, are bound to slots in the call's
+ * frame on the reference stack rather than in an environment, and are looked
+ * up by position.  Calls allocate nothing except boxes for variables that are
+ * captured by closures and can be assigned.
+ *
+ * Calls to lambdas in tail position reuse the frame of the caller, so loops
+ * written as tail recursion run in constant stack space.
+ *
+ * Arguments:
+ *   - env: The environment to evaluate the expression in.
+ *   - expression: The expression to evaluate.
+ *
+ * Returns:
+ *   - The value of the expression.
+ */
 void lsp_eval(void);
 
+/**
+ * Equivalent of `lsp_eval` that interprets the expression directly, without
+ * compiling it.  Lambdas created by the tree walker are also interpreted when
+ * they are called.  It is much slower than `lsp_eval`, and does not eliminate
+ * tail calls, but is simple enough to serve as a reference when testing the
+ * compiler.
+ */
+void lsp_eval_tree(void);
+
+/**
+ * Compiles an expression to a code object, which is a vector containing the
+ * bytecode, followed by the constants that it refers to.
+ *
+ * Arguments:
+ *   - expression: The expression to compile.
+ *
+ * Returns:
+ *   - The new code object.
+ */
+void lsp_compile(void);
+
+/**
+ * Runs a code object produced by `lsp_compile`.
+ *
+ * Arguments:
+ *   - env: The environment to run the code in.
+ *   - code: The code object to run.
+ *
+ * Returns:
+ *   - The value of the compiled expression.
+ */
+void lsp_exec(void);
+
+/**
+ * Lists the variables that a lambda refers to without binding them itself.
+ *
+ * Arguments:
+ *   - lambda: The `(args . body)` pair for the lambda.
+ *
+ * Returns:
+ *   - A list of the free variables, each listed once.
+ */
+void lsp_free_variables(void);
+
+/**
+ * Lists the names defined by `define` in a lambda body, not counting those
+ * defined in nested lambdas.
+ *
+ * Arguments:
+ *   - body: The list of expressions in the body.
+ *
+ * Returns:
+ *   - A list of the defined names, each listed once.
+ */
+void lsp_defined_variables(void);
+
 void lsp_print(void);
+
+/**
+ * Pops the value at the top of the stack and writes it to `stream`.
+ * `lsp_print` writes to stderr.
+ */
+void lsp_print_to(FILE *stream);
 void lsp_print_stack(void);
 
 /**
@@ -312,5 +882,104 @@ void lsp_print_stack(void);
 size_t lsp_stats_frame_size(void);
 size_t lsp_stats_stack_size(void);
 
+/**
+ * Returns the number of cons cells, or of objects on the data heap, that have
+ * been allocated since the VM was created.  Immediate values such as integers
+ * and symbols are not counted.
+ */
+size_t lsp_stats_cons_allocations(void);
+size_t lsp_stats_data_allocations(void);
+
+/**
+ * Counters and timings maintained by each VM.  Allocation counts and times are
+ * totals since the VM was created, while live sizes are measured at the end of
+ * the most recent collection.
+ */
+typedef struct {
+    // The number of full and nursery collections that have completed.
+    // Incremental collections are counted when they finish.
+    size_t collections;
+    size_t nursery_collections;
+
+    // Cons cells and data objects allocated, and the space taken on the data
+    // heap by the objects, including their headers.
+    size_t cons_allocations;
+    size_t data_allocations;
+    size_t data_bytes_allocated;
+
+    // The number of cons cells and eight byte data words in use after the
+    // most recent collection.
+    size_t live_cells;
+    size_t live_words;
+
+    // The largest number of references that have been on the stack at once.
+    size_t stack_high_water;
+
+    // Time spent in each phase of collection, in nanoseconds.  Marking
+    // includes incremental slices.  The offset cache phase includes
+    // extending the marks on data objects to cover their contents.
+    uint64_t mark_ns;
+    uint64_t cache_ns;
+    uint64_t compact_ns;
+    uint64_t rewrite_ns;
+} lsp_vm_stats_t;
+
+/**
+ * Copies the statistics for the current VM into `stats`.
+ */
+void lsp_stats_get(lsp_vm_stats_t *stats);
+
+/**
+ * Pushes the statistics for the current VM as an association list mapping
+ * symbols named after the fields of `lsp_vm_stats_t`, with underscores
+ * replaced by dashes, to integers.  Timings are given in nanoseconds, as
+ * they are in the struct.  Values that are too large to fit in an integer
+ * are clamped.
+ */
+void lsp_vm_stats(void);
+
+/**
+ * Allocation Profiling
+ * --------------------
+ * Attributes allocations to the form being evaluated, and the builtin that it
+ * is calling, when they are made.
+ */
+
+/**
+ * Samples one in every `interval` allocations made by the current VM.  Zero,
+ * the default, disables sampling.  Samples are kept when sampling is
+ * disabled, and are added to if it is enabled again.
+ */
+void lsp_profile_set_interval(unsigned int interval);
+
+/**
+ * Writes a table of sampled allocations to `stream`, with one tab separated
+ * line for each distinct pair of form and builtin, ordered by the number of
+ * bytes allocated.  Counts are scaled by the sampling interval, so they are
+ * estimates.  Forms are truncated, and are shown as `-` for allocations made
+ * outside of `lsp_eval`.
+ */
+void lsp_profile_write(FILE *stream);
+
+/**
+ * Hooks called by the interpreter to track the current allocation site.
+ *
+ * `lsp_profile_enter_form` makes the value at `offset` the current form until
+ * the matching call to `lsp_profile_leave_form`, and clears the current
+ * builtin.  `lsp_profile_enter_op` makes `op` the current builtin and returns
+ * the previous one, which should be restored by passing it back once `op`
+ * returns.
+ */
+void lsp_profile_enter_form(int offset);
+void lsp_profile_leave_form(void);
+lsp_op_t lsp_profile_enter_op(lsp_op_t op);
+
+/**
+ * Returns true once sampling has been enabled, after which the hooks above
+ * must be called.  Interpreters can use this to skip the work of finding the
+ * current form when nothing will read it.
+ */
+bool lsp_profile_enabled(void);
+
 
 
@@ -5,24 +5,415 @@
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 
-int main(int argc, char **argv) {
-    (void) argc;
-    (void) argv;
+static void usage(void) {
+    fprintf(
+        stderr,
+        "usage: lsp [--profile N]\n"
+        "       lsp --batch [--jobs N] PATH\n"
+        "\n"
+        "Without --batch, evaluates the program read from stdin and prints\n"
+        "the value of its last expression.  With --profile, one in every N\n"
+        "allocations is sampled, and a table of allocations by form is\n"
+        "written to stderr on exit.\n"
+        "\n"
+        "With --batch, evaluates every script in PATH, which can either be a\n"
+        "directory or a manifest file listing one script per line.  Scripts\n"
+        "are run on N worker threads, each with its own VM, and a line is\n"
+        "written to stdout for each script, in input order, containing its\n"
+        "path, wall time in microseconds, cons and data allocations, and\n"
+        "result, separated by tabs.  Every script starts from a fresh copy\n"
+        "of the default environment.\n"
+        "\n"
+        "Errors in the interpreter are fatal, so if a script fails, its path\n"
+        "is written to stderr and the whole batch is aborted.  Results for\n"
+        "earlier scripts may already have been written to stdout.\n"
+    );
+}
+
+
+/**
+ * Reads the whole of `stream` into a nul terminated buffer, which the caller
+ * must free.  Returns NULL on error.
+ */
+static char *read_all(FILE *stream) {
+    size_t size = 0;
+    size_t capacity = 0x1000;
+    char *buffer = (char *) malloc(capacity);
+    assert(buffer != NULL);
+
+    while (true) {
+        size += fread(buffer + size, 1, capacity - size - 1, stream);
+        if (size < capacity - 1) {
+            break;
+        }
+        capacity *= 2;
+        buffer = (char *) realloc(buffer, capacity);
+        assert(buffer != NULL);
+    }
+    if (ferror(stream)) {
+        free(buffer);
+        return NULL;
+    }
+    buffer[size] = '\0';
+    return buffer;
+}
+
+static char *read_file(char const *path) {
+    FILE *stream = fopen(path, "r");
+    if (stream == NULL) {
+        return NULL;
+    }
+    char *buffer = read_all(stream);
+    fclose(stream);
+    return buffer;
+}
+
+
+/**
+ * Evaluates every expression in `source` in a new scope wrapping the
+ * environment at the top of the stack, and replaces the environment with the
+ * value of the last expression.  Definitions made by the program are not
+ * visible in the original environment.
+ */
+static void run(char const *source) {
+    lsp_push_scope();
+
+    lsp_push_string(source);
+    lsp_parse();
+
+    lsp_reserve(3);
+    lsp_push_null();
+    while (!lsp_is_null(1)) {
+        lsp_pop_unchecked();
+        lsp_dup_unchecked(0);
+        lsp_car();
+        lsp_dup_unchecked(2);
+        lsp_eval();
+        lsp_dup_unchecked(1);
+        lsp_cdr();
+        lsp_store_unchecked(2);
+    }
+
+    lsp_store_unchecked(2);
+    lsp_pop_unchecked();
+}
+
+
+static int run_stdin(unsigned int profile_interval) {
+    char *source = read_all(stdin);
+    if (source == NULL) {
+        perror("lsp");
+        return 1;
+    }
 
     lsp_vm_init();
+    lsp_profile_set_interval(profile_interval);
 
-    // Load the default environment.
     lsp_push_default_env();
+    run(source);
+    free(source);
 
-    // Parse a list of expression from stdin.
-    lsp_parse();
+    lsp_print_to(stdout);
+    printf("\n");
+
+    if (profile_interval) {
+        lsp_profile_write(stderr);
+    }
+    return 0;
+}
+
+
+/**
+ * Batch mode.
+ *
+ * Workers claim scripts in order by incrementing `batch_next`, and publish
+ * each result by setting `done` under `batch_lock`.  The main thread writes
+ * results as soon as every script before them has finished, so output is
+ * produced in input order without waiting for the whole batch.
+ *
+ * Errors abort the process, so each worker records the path of the script
+ * that it is running for the abort handler to report.
+ */
+typedef struct {
+    char *path;
+    char *output;
+    size_t output_size;
+    long wall_time;
+    size_t cons_allocations;
+    size_t data_allocations;
+    bool done;
+} batch_script_t;
 
-    // Evaluate the first expression in the list (TODO evaluate everything).
-    lsp_eval();
+static batch_script_t *batch_scripts;
+static size_t batch_count;
+static size_t batch_next;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_done = PTHREAD_COND_INITIALIZER;
+static __thread char const *batch_current_path;
 
-    // Dump the result to stdout.
-    lsp_print();
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
 }
 
+static void batch_add(char *path) {
+    static size_t capacity;
+    if (batch_count == capacity) {
+        capacity = capacity ? 2 * capacity : 64;
+        batch_scripts = (batch_script_t *) realloc(
+            batch_scripts, capacity * sizeof(batch_script_t)
+        );
+        assert(batch_scripts != NULL);
+    }
+    memset(&batch_scripts[batch_count], 0, sizeof(batch_script_t));
+    batch_scripts[batch_count].path = path;
+    batch_count++;
+}
+
+/**
+ * Writes the path of the script that the aborting thread was running to
+ * stderr.  The handler is reset before it runs, so the abort then continues as
+ * normal.
+ */
+static void batch_abort_handler(int number) {
+    (void) number;
+
+    char const *path = batch_current_path;
+    if (path == NULL) {
+        return;
+    }
+    char const prefix[] = "lsp: script failed: ";
+    ssize_t written = write(STDERR_FILENO, prefix, sizeof(prefix) - 1);
+    written = write(STDERR_FILENO, path, strlen(path));
+    written = write(STDERR_FILENO, "\n", 1);
+    (void) written;
+}
+
+static int batch_compare(void const *a, void const *b) {
+    return strcmp(
+        ((batch_script_t const *) a)->path, ((batch_script_t const *) b)->path
+    );
+}
+
+/**
+ * Adds every regular file in `dir`, other than hidden files, in order of name.
+ */
+static bool batch_add_directory(char const *dir) {
+    DIR *handle = opendir(dir);
+    if (handle == NULL) {
+        return false;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(handle)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        size_t size = strlen(dir) + strlen(entry->d_name) + 2;
+        char *path = (char *) malloc(size);
+        assert(path != NULL);
+        snprintf(path, size, "%s/%s", dir, entry->d_name);
+
+        struct stat info;
+        if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+            free(path);
+            continue;
+        }
+        batch_add(path);
+    }
+    closedir(handle);
+
+    qsort(batch_scripts, batch_count, sizeof(batch_script_t), batch_compare);
+    return true;
+}
+
+/**
+ * Adds each non-empty line of the manifest at `path` as a script.
+ */
+static bool batch_add_manifest(char const *path) {
+    char *manifest = read_file(path);
+    if (manifest == NULL) {
+        return false;
+    }
+
+    for (char *line = strtok(manifest, "\n"); line; line = strtok(NULL, "\n")) {
+        size_t length = strlen(line);
+        if (length > 0 && line[length - 1] == '\r') {
+            line[--length] = '\0';
+        }
+        if (length > 0) {
+            batch_add(strdup(line));
+        }
+    }
+    free(manifest);
+    return true;
+}
+
+static void batch_run_script(batch_script_t *script) {
+    FILE *output = open_memstream(&script->output, &script->output_size);
+    assert(output != NULL);
+
+    char *source = read_file(script->path);
+    if (source == NULL) {
+        fprintf(output, "<error: could not read script>");
+        fclose(output);
+        return;
+    }
+
+    // Builtins can be reassigned with `set!`, so sharing one environment
+    // between scripts would let them affect each other.
+    lsp_push_default_env();
+
+    size_t cons_allocations = lsp_stats_cons_allocations();
+    size_t data_allocations = lsp_stats_data_allocations();
+    long start = now_ns();
+
+    batch_current_path = script->path;
+    run(source);
+    batch_current_path = NULL;
+
+    script->wall_time = now_ns() - start;
+    script->cons_allocations = (
+        lsp_stats_cons_allocations() - cons_allocations
+    );
+    script->data_allocations = (
+        lsp_stats_data_allocations() - data_allocations
+    );
+
+    lsp_print_to(output);
+    fclose(output);
+    free(source);
+}
+
+static void *batch_worker(void *arg) {
+    (void) arg;
+
+    lsp_vm_config_t config = {0};
+    lsp_vm_t *vm = lsp_vm_create(&config);
+    lsp_vm_set_current(vm);
+
+    while (true) {
+        size_t index = __atomic_fetch_add(&batch_next, 1, __ATOMIC_RELAXED);
+        if (index >= batch_count) {
+            break;
+        }
+
+        batch_run_script(&batch_scripts[index]);
+        assert(lsp_stats_frame_size() == 0);
+
+        pthread_mutex_lock(&batch_lock);
+        batch_scripts[index].done = true;
+        pthread_cond_broadcast(&batch_done);
+        pthread_mutex_unlock(&batch_lock);
+    }
+
+    lsp_vm_destroy(vm);
+    return NULL;
+}
+
+static int run_batch(char const *path, long jobs) {
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        perror(path);
+        return 1;
+    }
+    bool loaded = S_ISDIR(info.st_mode) ?
+        batch_add_directory(path) : batch_add_manifest(path);
+    if (!loaded) {
+        perror(path);
+        return 1;
+    }
+
+    if (jobs > (long) batch_count) {
+        jobs = (long) batch_count;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = batch_abort_handler;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGABRT, &action, NULL);
+
+    pthread_t *workers = (pthread_t *) malloc(jobs * sizeof(pthread_t));
+    assert(workers != NULL);
+    for (long i = 0; i < jobs; i++) {
+        int error = pthread_create(&workers[i], NULL, batch_worker, NULL);
+        assert(error == 0);
+        (void) error;
+    }
+
+    for (size_t i = 0; i < batch_count; i++) {
+        batch_script_t *script = &batch_scripts[i];
+
+        pthread_mutex_lock(&batch_lock);
+        while (!script->done) {
+            pthread_cond_wait(&batch_done, &batch_lock);
+        }
+        pthread_mutex_unlock(&batch_lock);
+
+        printf(
+            "%s\t%ld\t%zu\t%zu\t%s\n",
+            script->path, script->wall_time / 1000,
+            script->cons_allocations, script->data_allocations,
+            script->output
+        );
+        // A later script can abort the process, so don't leave finished
+        // results sitting in the buffer.
+        fflush(stdout);
+        free(script->path);
+        free(script->output);
+    }
+
+    for (long i = 0; i < jobs; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    free(batch_scripts);
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    long profile_interval = 0;
+    char const *path = NULL;
+    bool batch = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0) {
+            batch = true;
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_interval = strtol(argv[++i], NULL, 10);
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (!batch) {
+        if (path != NULL || profile_interval < 0) {
+            usage();
+            return 2;
+        }
+        return run_stdin((unsigned int) profile_interval);
+    }
+    if (path == NULL || jobs < 1 || profile_interval) {
+        usage();
+        return 2;
+    }
+
+    return run_batch(path, jobs);
+}
@@ -2,6 +2,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <assert.h>
 
 
@@ -9,81 +11,90 @@
  * Integer operations.
  */
 void lsp_int_add(void) {
-    int a = lsp_read_int(0);
-    int b = lsp_read_int(1);
+    lsp_int_t a = lsp_read_int(0);
+    lsp_int_t b = lsp_read_int(1);
     lsp_pop();
     lsp_pop();
     lsp_push_int(a + b);
 }
 
 void lsp_int_sub(void) {
-    int a = lsp_read_int(0);
-    int b = lsp_read_int(1);
+    lsp_int_t a = lsp_read_int(0);
+    lsp_int_t b = lsp_read_int(1);
     lsp_pop();
     lsp_pop();
     lsp_push_int(a - b);
 }
 
 void lsp_int_mul(void) {
-    int a = lsp_read_int(0);
-    int b = lsp_read_int(1);
+    lsp_int_t a = lsp_read_int(0);
+    lsp_int_t b = lsp_read_int(1);
     lsp_pop();
     lsp_pop();
     lsp_push_int(a * b);
 }
 
 void lsp_int_div(void) {
-    int a = lsp_read_int(0);
-    int b = lsp_read_int(1);
+    lsp_int_t a = lsp_read_int(0);
+    lsp_int_t b = lsp_read_int(1);
     lsp_pop();
     lsp_pop();
     lsp_push_int(a / b);
 }
 
+/**
+ * Arguments:
+ * - function
+ * - input
+ */
 void lsp_map(void) {
     lsp_fp_t rp = lsp_get_fp();
     lsp_shrink_frame(2);
+    lsp_reserve(4);
 
     // A cons cell used to track the building of the list.  The cdr points to
     // the root of the list.  The car points to the cons that should be
     // appended to next.  It will initially be set to the tracking cons cell
     // but will be updated to point to the end of the list.
     lsp_push_cons();
-    lsp_dup(-1);
+    lsp_dup_unchecked(0);
+    lsp_dup_unchecked(0);
     lsp_set_car();
 
-    while (lsp_dup(1), !lsp_is_null(0)) {
+    while (!lsp_is_null(2)) {
         // Extract the next value in the input list.
-        lsp_dup(1);
+        lsp_dup_unchecked(2);
         lsp_car();
 
         // Call the function on it.
-        lsp_dup(0);
+        lsp_dup_unchecked(2);
         lsp_call(1);
 
         // Save the result in a new cons cell.
         lsp_push_null();
+        lsp_swp_unchecked(1);
         lsp_cons();
 
-        // Append the new cons cell to the end of the output list.
-        lsp_dup(2);
-        lsp_swp(3);
+        // Append the new cons cell to the end of the output list, and make it
+        // the new end.
+        lsp_dup_unchecked(0);
+        lsp_dup_unchecked(2);
+        lsp_car();
         lsp_set_cdr();
+        lsp_dup_unchecked(1);
+        lsp_set_car();
 
         // Advance to the next cell in the input list.
-        lsp_dup(1);
+        lsp_dup_unchecked(2);
         lsp_cdr();
-        lsp_store(1);
+        lsp_store_unchecked(3);
     }
 
-    // Move the tracking cell to the bottom of the stack.
-    lsp_store(0);
-
-    // Get rid of the input list.
-    lsp_pop();
-
-    // Return the output list.
+    // Return the output list in place of the input list.
     lsp_cdr();
+    lsp_store_unchecked(2);
+    lsp_pop_unchecked();
+
     lsp_restore_fp(rp);
 }
 
@@ -96,34 +107,32 @@ void lsp_map(void) {
 void lsp_fold(void) {
     lsp_fp_t rp = lsp_get_fp();
     lsp_shrink_frame(3);
+    lsp_reserve(3);
 
-    while (lsp_dup(2), !lsp_is_null(0)) {
-        // Read the next item in the list.
-        lsp_dup(2);
+    while (!lsp_is_null(2)) {
+        // Copy the accumulator and read the next item in the list.
+        lsp_dup_unchecked(1);
+        lsp_dup_unchecked(3);
         lsp_car();
 
-        // Copy the accumulator.
-        lsp_dup(1);
-
         // Call the operation on the list value and the previous value of the
         // accumulator.
-        lsp_dup(0);
+        lsp_dup_unchecked(2);
         lsp_call(2);
 
         // Save the result.
-        lsp_store(1);
+        lsp_store_unchecked(2);
 
-        // Advance to the next item in the list cell.
+        // Advance to the next item in the list.
+        lsp_dup_unchecked(2);
         lsp_cdr();
+        lsp_store_unchecked(3);
     }
 
-    // Pop the tail of the list from the stack.
-    lsp_pop();
+    // Drop the op and return the accumulator in place of the input list.
+    lsp_pop_unchecked();
+    lsp_store_unchecked(1);
 
-    // Return the accumulator as the result.
-    lsp_store(0);
-
-    lsp_pop();
     lsp_restore_fp(rp);
 }
 
@@ -153,32 +162,90 @@ void lsp_reverse(void) {
 }
 
 
-void lsp_print(void) {
+/**
+ * Arguments:
+ * - function
+ * - input
+ */
+void lsp_vector_map(void) {
+    lsp_fp_t rp = lsp_get_fp();
+    lsp_shrink_frame(2);
+
+    lsp_dup(1);
+    lsp_vector_length();
+    int length = lsp_read_int(0);
+    lsp_pop();
+
+    // The output vector is allocated up front and filled in place.
+    lsp_push_vector(length);
+    lsp_reserve(3);
+
+    for (int i = 0; i < length; i++) {
+        // Read the next value from the input vector.
+        lsp_push_int(i);
+        lsp_dup_unchecked(3);
+        lsp_vector_ref();
+
+        // Call the function on it.
+        lsp_dup_unchecked(2);
+        lsp_call(1);
+
+        // Save the result in the output vector.
+        lsp_push_int(i);
+        lsp_dup_unchecked(2);
+        lsp_vector_set();
+    }
+
+    // Return the output vector in place of the input vector.
+    lsp_store_unchecked(2);
+    lsp_pop_unchecked();
+
+    lsp_restore_fp(rp);
+}
+
+void lsp_op_vector_set(void) {
+    lsp_vector_set();
+    lsp_push_null();
+}
+
+
+void lsp_op_table_set(void) {
+    lsp_table_set();
+    lsp_push_null();
+}
+
+void lsp_op_table_delete(void) {
+    lsp_table_delete();
+    lsp_push_null();
+}
+
+
+void lsp_print_to(FILE *stream) {
     lsp_fp_t rp = lsp_get_fp();
     lsp_shrink_frame(1);
 
     if (lsp_is_null(0)) {
-        fprintf(stderr, "()");
+        fprintf(stream, "()");
 
         lsp_pop();
 
     } else if (lsp_is_cons(0)) {
-        fprintf(stderr, "(");
+        fprintf(stream, "(");
 
         // Print the first element.
         lsp_dup(0);
         lsp_car();
-        lsp_print();
+        lsp_print_to(stream);
 
         lsp_cdr();
 
         while (lsp_is_cons(0)) {
-            fprintf(stderr, " ");
+            fprintf(stream, " ");
 
             // Print the next element in the array.
             lsp_dup(0);
             lsp_car();
-            lsp_print();
+            lsp_print_to(stream);
 
             // Move to the next element.
             lsp_cdr();
@@ -187,34 +254,68 @@ void lsp_print(void) {
         // If the list is terminated with something other than null, print it
         // after printing a dot.
         if (!lsp_is_null(0)) {
-            fprintf(stderr, " . ");
-            lsp_print();
+            fprintf(stream, " . ");
+            lsp_print_to(stream);
         } else {
             lsp_pop();
         }
 
-        fprintf(stderr, ")");
+        fprintf(stream, ")");
 
     } else if (lsp_is_int(0)) {
-        int value = lsp_read_int(0);
-        fprintf(stderr, "%i", value);
+        lsp_int_t value = lsp_read_int(0);
+        fprintf(stream, "%" PRId64, value);
 
         lsp_pop();
 
     } else if (lsp_is_symbol(0)) {
         char const *str = lsp_borrow_symbol(0);
-        fprintf(stderr, "%s", str);
+        fprintf(stream, "%s", str);
 
         lsp_pop();
 
     } else if (lsp_is_string(0)) {
         char const *str = lsp_borrow_string(0);
-        fprintf(stderr, "\"%s\"", str);  // TODO escape
+        fprintf(stream, "\"%s\"", str);  // TODO escape
 
         lsp_pop();
 
     } else if (lsp_is_op(0)) {
-        fprintf(stderr, "<builtin>");
+        fprintf(stream, "<builtin>");
+
+        lsp_pop();
+
+    } else if (lsp_is_vector(0)) {
+        fprintf(stream, "#(");
+
+        lsp_dup(0);
+        lsp_vector_length();
+        int length = lsp_read_int(0);
+        lsp_pop();
+
+        for (int i = 0; i < length; i++) {
+            if (i > 0) {
+                fprintf(stream, " ");
+            }
+
+            // Print the next element in the vector.
+            lsp_push_int(i);
+            lsp_dup(1);
+            lsp_vector_ref();
+            lsp_print_to(stream);
+        }
+
+        fprintf(stream, ")");
+
+        lsp_pop();
+
+    } else if (lsp_is_table(0)) {
+        fprintf(stream, "<table>");
+
+        lsp_pop();
+
+    } else if (lsp_is_bytecode(0)) {
+        fprintf(stream, "<bytecode>");
 
         lsp_pop();
 
@@ -226,6 +327,55 @@ void lsp_print(void) {
     lsp_restore_fp(rp);
 }
 
+/**
+ * Pushes a `(name . value)` pair, clamping `value` to the range of an integer.
+ */
+static void lsp_push_stat(char const *name, uint64_t value) {
+    if (value > LSP_INT_MAX) {
+        value = LSP_INT_MAX;
+    }
+    lsp_push_int((lsp_int_t) value);
+    lsp_push_symbol(name);
+    lsp_cons();
+}
+
+void lsp_vm_stats(void) {
+    lsp_vm_stats_t stats;
+    lsp_stats_get(&stats);
+
+    struct {
+        char const *name;
+        uint64_t value;
+    } const entries[] = {
+        {"collections", stats.collections},
+        {"nursery-collections", stats.nursery_collections},
+        {"cons-allocations", stats.cons_allocations},
+        {"data-allocations", stats.data_allocations},
+        {"data-bytes-allocated", stats.data_bytes_allocated},
+        {"live-cells", stats.live_cells},
+        {"live-words", stats.live_words},
+        {"stack-high-water", stats.stack_high_water},
+        {"mark-ns", stats.mark_ns},
+        {"cache-ns", stats.cache_ns},
+        {"compact-ns", stats.compact_ns},
+        {"rewrite-ns", stats.rewrite_ns},
+    };
+    size_t count = sizeof(entries) / sizeof(entries[0]);
+
+    // Build the list from the end so that it comes out in the same order as
+    // the table.
+    lsp_push_null();
+    for (size_t i = count; i > 0; i--) {
+        lsp_push_stat(entries[i - 1].name, entries[i - 1].value);
+        lsp_cons();
+    }
+}
+
+
+void lsp_print(void) {
+    lsp_print_to(stderr);
+}
+
 void lsp_print_stack(void) {
     int frame_size = lsp_stats_frame_size();
 
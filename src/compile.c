@@ -0,0 +1,1660 @@
+#include "lsp.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * Bytecode
+ * ========
+ * Expressions are compiled to code objects, which are vectors holding a block
+ * of bytecode followed by the constants that it refers to.  Constants are
+ * numbered by their index in the code object, so the first is number one.
+ * Code for the body of a lambda always has the number of arguments that it
+ * takes as constant one, a vector describing its slots as constant two, and
+ * the number of those slots that hold boxes as constant three.
+ *
+ * The bytecode is run by a stack machine that works directly on the reference
+ * stack.  Each instruction is a single byte, followed by any operands, which
+ * are stored in native byte order.  While code is running, the bottom of its
+ * frame holds the code object, then the environment and then the bytecode
+ * itself.  Code for the body of a lambda follows that with a slot for each
+ * name that the lambda binds, with everything above belonging to the
+ * instructions.  Arguments are bound to the first slots, and names that are
+ * defined in the body take the rest.
+ *
+ * Closures are flat.  Rather than keeping the slots of the call that created
+ * them, they copy the variables that their body refers to into a capture
+ * frame, which is a vector holding the environment, a vector describing the
+ * slots, and then a slot for each captured variable.  A closure that captures
+ * nothing keeps the environment alone.  Variables that are captured and can
+ * be assigned after the closure is created are kept in boxes, which are
+ * `(name . value)` pairs shared by the slot and every closure that captures
+ * them.  Nothing can refer to the slots of a call once it returns, so they
+ * never need to be moved to the heap, and a call only allocates its boxes.
+ *
+ * Variables in capture frames are addressed by their depth, counting outwards
+ * from the environment of the running code, and their index in the frame.
+ * Anything that the compiler cannot resolve is looked up in the environment
+ * behind the frames, which holds top level definitions.
+ *
+ * Instructions that use the environment have an inline cache, which is three
+ * consecutive slots in the code object holding the environment, the binding
+ * cell that the symbol resolved to, and the value of `lsp_env_version` at the
+ * time.  The cell can be reused for as long as the code runs in the same
+ * environment and nothing new has been defined.
+ */
+typedef enum {
+    // Pushes null.
+    LSP_BC_NULL = 0,
+
+    // i64 value: Pushes an integer.
+    LSP_BC_INT,
+
+    // u16 constant: Pushes a constant.
+    LSP_BC_CONST,
+
+    // u16 index: Pushes the contents of a slot of the current call.
+    LSP_BC_SLOT,
+
+    // u16 index: Pops a value and stores it in a slot of the current call,
+    // then pushes null.
+    LSP_BC_SET_SLOT,
+
+    // u16 depth, u16 index: Pushes the contents of a slot in a frame.
+    LSP_BC_LOCAL,
+
+    // u16 depth, u16 index: Pops a value and stores it in a slot in a frame,
+    // then pushes null.
+    LSP_BC_SET_LOCAL,
+
+    // Replaces the box at the top of the stack with its value.
+    LSP_BC_UNBOX,
+
+    // Pops a box and then a value, stores the value in the box, and pushes
+    // null.
+    LSP_BC_SET_BOX,
+
+    // u16 depth, u32 symbol, u16 cache: Pushes the value bound to a symbol in
+    // the environment found by skipping `depth` frames.
+    LSP_BC_LOOKUP,
+
+    // u32 symbol: Pops a value and binds it to a symbol in the environment,
+    // then pushes null.  Only used outside of lambdas, as definitions in
+    // lambda bodies are given slots.
+    LSP_BC_DEFINE,
+
+    // u16 depth, u32 symbol, u16 cache: Pops a value and rebinds a symbol
+    // wherever it is bound in the environment found by skipping `depth`
+    // frames, then pushes null.
+    LSP_BC_SET,
+
+    // Discards the value at the top of the stack.
+    LSP_BC_POP,
+
+    // u32 target: Continues from the instruction at `target`.  The second
+    // form pops a value and only jumps if it is not truthy.
+    LSP_BC_JUMP,
+    LSP_BC_JUMP_IF_FALSE,
+
+    // u16 constant, u16 layout, u16 depth, u16 n, n times u16 index, u16 m,
+    // m times u16 depth and u16 index: Pushes a closure for the
+    // `(args . body)` pair in `constant`.  If `n` and `m` are both zero, the
+    // closure keeps the environment found by skipping `depth` frames.
+    // Otherwise it gets a capture frame, described by `layout`, holding the
+    // contents of `n` slots of the current call followed by `m` slots in
+    // frames.
+    LSP_BC_LAMBDA,
+
+    // u16 nargs, u16 constant: Pops a callable, pushed first, and `nargs`
+    // arguments, pushed in order, and pushes the result of calling it.  The
+    // constant holds the calling form, for the allocation profiler.
+    LSP_BC_CALL,
+
+    // u16 nargs, u16 constant: As `LSP_BC_CALL`, but for calls in tail
+    // position, which must be made with nothing else pushed.  Returns the
+    // result of the call.  Compiled lambdas are run by replacing the current
+    // code and environment, so that loops written as recursion run in constant
+    // space.
+    LSP_BC_TAIL_CALL,
+
+    // Returns the value at the top of the stack.
+    LSP_BC_RETURN,
+} lsp_bc_t;
+
+
+/**
+ * Compiler
+ * ========
+ * The compiler walks the expression using the stack, and writes bytecode to a
+ * buffer that is only copied onto the heap once it is complete.  Constants
+ * are collected, newest first, in a list stored in the compiler's frame.  The
+ * compiler never shrinks the frame, so the list is found by counting from the
+ * bottom of the stack.
+ */
+typedef struct lsp_scope {
+    // The names bound in the frame, in slot order, and whether each slot
+    // holds a box rather than the value itself.
+    lsp_sym_t *names;
+    bool *boxed;
+    size_t nnames;
+    size_t capacity;
+
+    // The number of arguments, which take the first slots, and the index in
+    // the frame of the first slot.
+    size_t nargs;
+    unsigned int base;
+
+    // Set if the slots are kept on the reference stack by the call that binds
+    // them, rather than in a frame.  Only the innermost scope can be.
+    bool stack;
+
+    // The scope of the next frame out, or NULL if this is the outermost.
+    struct lsp_scope *parent;
+} lsp_scope_t;
+
+typedef struct {
+    unsigned char *code;
+    size_t length;
+    size_t capacity;
+
+    // The position of the list of constants from the bottom of the stack, and
+    // the index that the next constant will be given.
+    size_t constants;
+    unsigned int nconstants;
+
+    // The innermost scope that the code will run in, or NULL if it will run
+    // directly in an environment.
+    lsp_scope_t *scope;
+} lsp_compiler_t;
+
+/**
+ * Returns the slot for `sym` in `scope`, or -1 if it is not bound there.
+ */
+static int lsp_scope_find(lsp_scope_t const *scope, lsp_sym_t sym) {
+    for (size_t i = 0; i < scope->nnames; i++) {
+        if (scope->names[i] == sym) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Gives `sym` a slot in `scope`, unless it already has one.
+ */
+static void lsp_scope_add(lsp_scope_t *scope, lsp_sym_t sym) {
+    if (lsp_scope_find(scope, sym) >= 0) {
+        return;
+    }
+    if (scope->nnames == scope->capacity) {
+        scope->capacity = scope->capacity ? 2 * scope->capacity : 8;
+        scope->names = (lsp_sym_t *) realloc(
+            scope->names, scope->capacity * sizeof(lsp_sym_t)
+        );
+        scope->boxed = (bool *) realloc(
+            scope->boxed, scope->capacity * sizeof(bool)
+        );
+        assert(scope->names != NULL && scope->boxed != NULL);
+    }
+    assert(scope->nnames < UINT16_MAX);
+    scope->names[scope->nnames] = sym;
+    scope->boxed[scope->nnames] = false;
+    scope->nnames++;
+}
+
+/**
+ * Frees every scope from `scope` outwards.
+ */
+static void lsp_scope_free(lsp_scope_t *scope) {
+    while (scope != NULL) {
+        lsp_scope_t *parent = scope->parent;
+        free(scope->names);
+        free(scope->boxed);
+        free(scope);
+        scope = parent;
+    }
+}
+
+/**
+ * Returns the symbol at the head of the list at the top of the stack, or -1
+ * if it does not start with a symbol.
+ */
+static lsp_sym_t lsp_compile_head(void) {
+    lsp_dup(0);
+    lsp_car();
+    lsp_sym_t head = lsp_is_symbol(0) ? lsp_read_symbol(0) : (lsp_sym_t) -1;
+    lsp_pop();
+    return head;
+}
+
+/**
+ * Gives a slot in `scope` to every name defined by the expression at the top
+ * of the stack, and pops it.  Quoted expressions are never evaluated, and
+ * lambdas bind names in frames of their own, so neither is searched.
+ */
+static void lsp_compile_scan(lsp_scope_t *scope) {
+    if (!lsp_is_cons(0)) {
+        lsp_pop();
+        return;
+    }
+
+    lsp_sym_t head = lsp_compile_head();
+    if (head == LSP_SYM_QUOTE || head == LSP_SYM_LAMBDA) {
+        lsp_pop();
+        return;
+    }
+    if (head == LSP_SYM_DEFINE) {
+        lsp_dup(0);
+        lsp_cdr();
+        lsp_car();
+        lsp_scope_add(scope, lsp_read_symbol(0));
+        lsp_pop();
+    }
+
+    while (lsp_is_cons(0)) {
+        lsp_dup(0);
+        lsp_car();
+        lsp_compile_scan(scope);
+        lsp_cdr();
+    }
+    lsp_pop();
+}
+
+/**
+ * Creates a scope for the lambda with the `(args . body)` pair at the top of
+ * the stack, which is left in place.  Arguments take the first slots,
+ * followed by anything defined in the body.
+ */
+static lsp_scope_t *lsp_scope_new_lambda(lsp_scope_t *parent) {
+    lsp_scope_t *scope = (lsp_scope_t *) calloc(1, sizeof(lsp_scope_t));
+    assert(scope != NULL);
+    scope->parent = parent;
+    scope->stack = true;
+
+    lsp_dup(0);
+    lsp_car();
+    while (lsp_is_cons(0)) {
+        lsp_dup(0);
+        lsp_car();
+        lsp_scope_add(scope, lsp_read_symbol(0));
+        lsp_pop();
+        lsp_cdr();
+    }
+    lsp_pop();
+    scope->nargs = scope->nnames;
+
+    lsp_dup(0);
+    lsp_cdr();
+    while (lsp_is_cons(0)) {
+        lsp_dup(0);
+        lsp_car();
+        lsp_compile_scan(scope);
+        lsp_cdr();
+    }
+    lsp_pop();
+
+    return scope;
+}
+
+/**
+ * Pushes a list of the names in `scope`, in slot order.
+ */
+static void lsp_scope_push_names(lsp_scope_t const *scope) {
+    lsp_push_null();
+    for (size_t i = scope->nnames; i-- > 0;) {
+        lsp_push_symbol_id(scope->names[i]);
+        lsp_cons();
+    }
+}
+
+/**
+ * Pushes a vector describing the slots in `scope`, which holds a
+ * `(name . boxed)` pair for each, with `boxed` set to one for slots that hold
+ * boxes.
+ */
+static void lsp_scope_push_layout(lsp_scope_t const *scope) {
+    lsp_push_vector(scope->nnames);
+    for (size_t i = 0; i < scope->nnames; i++) {
+        lsp_push_int(scope->boxed[i]);
+        lsp_push_symbol_id(scope->names[i]);
+        lsp_cons();
+        lsp_push_int((int) i);
+        lsp_dup(2);
+        lsp_vector_set();
+    }
+}
+
+/**
+ * Adds every variable that is referenced by the expression at the top of the
+ * stack, and not bound in `bound` or any of the scopes around it, to `found`,
+ * and pops the expression.
+ */
+static void lsp_compile_free(lsp_scope_t *bound, lsp_scope_t *found) {
+    if (lsp_is_symbol(0)) {
+        lsp_sym_t sym = lsp_read_symbol(0);
+        lsp_pop();
+        for (lsp_scope_t *scope = bound; scope; scope = scope->parent) {
+            if (lsp_scope_find(scope, sym) >= 0) {
+                return;
+            }
+        }
+        lsp_scope_add(found, sym);
+        return;
+    }
+
+    if (!lsp_is_cons(0)) {
+        lsp_pop();
+        return;
+    }
+
+    switch (lsp_compile_head()) {
+    case LSP_SYM_QUOTE:
+        lsp_pop();
+        return;
+
+    case LSP_SYM_LAMBDA: {
+        lsp_cdr();
+        lsp_scope_t *scope = lsp_scope_new_lambda(bound);
+        lsp_cdr();
+        while (lsp_is_cons(0)) {
+            lsp_dup(0);
+            lsp_car();
+            lsp_compile_free(scope, found);
+            lsp_cdr();
+        }
+        lsp_pop();
+
+        scope->parent = NULL;
+        lsp_scope_free(scope);
+        return;
+    }
+
+    case LSP_SYM_IF:
+    case LSP_SYM_DEFINE:
+    case LSP_SYM_SET:
+    case LSP_SYM_BEGIN:
+        lsp_cdr();
+        break;
+
+    default:
+        break;
+    }
+
+    while (lsp_is_cons(0)) {
+        lsp_dup(0);
+        lsp_car();
+        lsp_compile_free(bound, found);
+        lsp_cdr();
+    }
+    lsp_pop();
+}
+
+/**
+ * Finds the variables used by the expression at the top of the stack that
+ * might need to be boxed, and pops it.  Every name referenced inside a nested
+ * lambda is added to `captured`, and every name given a value by `define` or
+ * `set!` is added to `assigned`.  Shadowing is ignored, which can only cause
+ * more variables to be boxed than necessary.
+ */
+static void lsp_compile_mark(
+    lsp_scope_t *captured, lsp_scope_t *assigned, bool nested
+) {
+    if (lsp_is_symbol(0)) {
+        if (nested) {
+            lsp_scope_add(captured, lsp_read_symbol(0));
+        }
+        lsp_pop();
+        return;
+    }
+
+    if (!lsp_is_cons(0)) {
+        lsp_pop();
+        return;
+    }
+
+    switch (lsp_compile_head()) {
+    case LSP_SYM_QUOTE:
+        lsp_pop();
+        return;
+
+    case LSP_SYM_LAMBDA:
+        // Skip the argument list.
+        lsp_cdr();
+        lsp_cdr();
+        nested = true;
+        break;
+
+    case LSP_SYM_DEFINE:
+    case LSP_SYM_SET:
+        lsp_cdr();
+        lsp_dup(0);
+        lsp_car();
+        lsp_scope_add(assigned, lsp_read_symbol(0));
+        lsp_pop();
+        break;
+
+    case LSP_SYM_IF:
+    case LSP_SYM_BEGIN:
+        lsp_cdr();
+        break;
+
+    default:
+        break;
+    }
+
+    while (lsp_is_cons(0)) {
+        lsp_dup(0);
+        lsp_car();
+        lsp_compile_mark(captured, assigned, nested);
+        lsp_cdr();
+    }
+    lsp_pop();
+}
+
+void lsp_free_variables(void) {
+    lsp_scope_t *scope = lsp_scope_new_lambda(NULL);
+    lsp_scope_t found = {0};
+
+    lsp_cdr();
+    while (lsp_is_cons(0)) {
+        lsp_dup(0);
+        lsp_car();
+        lsp_compile_free(scope, &found);
+        lsp_cdr();
+    }
+    lsp_pop();
+    lsp_scope_free(scope);
+
+    lsp_scope_push_names(&found);
+    free(found.names);
+    free(found.boxed);
+}
+
+void lsp_defined_variables(void) {
+    lsp_scope_t found = {0};
+
+    while (lsp_is_cons(0)) {
+        lsp_dup(0);
+        lsp_car();
+        lsp_compile_scan(&found);
+        lsp_cdr();
+    }
+    lsp_pop();
+
+    lsp_scope_push_names(&found);
+    free(found.names);
+    free(found.boxed);
+}
+
+
+static void lsp_compiler_emit(
+    lsp_compiler_t *compiler, void const *bytes, size_t size
+) {
+    if (compiler->length + size > compiler->capacity) {
+        compiler->capacity = compiler->capacity ? 2 * compiler->capacity : 64;
+        compiler->code = (unsigned char *) realloc(
+            compiler->code, compiler->capacity
+        );
+        assert(compiler->code != NULL);
+    }
+    memcpy(compiler->code + compiler->length, bytes, size);
+    compiler->length += size;
+}
+
+static void lsp_compiler_emit_op(lsp_compiler_t *compiler, lsp_bc_t op) {
+    unsigned char byte = (unsigned char) op;
+    lsp_compiler_emit(compiler, &byte, sizeof(byte));
+}
+
+static void lsp_compiler_emit_u16(
+    lsp_compiler_t *compiler, unsigned int value
+) {
+    assert(value <= UINT16_MAX);
+    uint16_t operand = (uint16_t) value;
+    lsp_compiler_emit(compiler, &operand, sizeof(operand));
+}
+
+static void lsp_compiler_emit_u32(lsp_compiler_t *compiler, uint32_t value) {
+    lsp_compiler_emit(compiler, &value, sizeof(value));
+}
+
+/**
+ * Emits a jump with a target that will be filled in by `lsp_compiler_patch`,
+ * and returns the position of the target.
+ */
+static size_t lsp_compiler_emit_jump(lsp_compiler_t *compiler, lsp_bc_t op) {
+    lsp_compiler_emit_op(compiler, op);
+    size_t position = compiler->length;
+    lsp_compiler_emit_u32(compiler, 0);
+    return position;
+}
+
+/**
+ * Points the jump with its target at `position` at the next instruction.
+ */
+static void lsp_compiler_patch(lsp_compiler_t *compiler, size_t position) {
+    assert(compiler->length <= UINT32_MAX);
+    uint32_t target = (uint32_t) compiler->length;
+    memcpy(compiler->code + position, &target, sizeof(target));
+}
+
+/**
+ * Pops the value at the top of the stack, adds it to the constants of the
+ * code object, and returns its index.
+ */
+static unsigned int lsp_compiler_add_constant(lsp_compiler_t *compiler) {
+    int offset = (int) (lsp_stats_stack_size() - 1 - compiler->constants);
+    lsp_dup(offset);
+    lsp_swp(1);
+    lsp_cons();
+    lsp_store(offset);
+    return compiler->nconstants++;
+}
+
+/**
+ * Adds the three slots for an inline cache to the code object, and returns the
+ * index of the first.
+ */
+static unsigned int lsp_compiler_add_cache(lsp_compiler_t *compiler) {
+    unsigned int cache = compiler->nconstants;
+    for (int i = 0; i < 3; i++) {
+        lsp_push_null();
+        lsp_compiler_add_constant(compiler);
+    }
+    return cache;
+}
+
+static void lsp_compile_expression(lsp_compiler_t *compiler, bool tail);
+
+/**
+ * Compiles the list of expressions at the top of the stack, and pops it.  The
+ * code will evaluate each expression in turn and keep the value of the last,
+ * or of null if the list is empty.  The last expression is in tail position
+ * if `tail` is set.
+ */
+static void lsp_compile_sequence(lsp_compiler_t *compiler, bool tail) {
+    if (lsp_is_null(0)) {
+        lsp_pop();
+        lsp_compiler_emit_op(compiler, LSP_BC_NULL);
+        return;
+    }
+
+    while (true) {
+        lsp_dup(0);
+        lsp_cdr();
+        bool last = lsp_is_null(0);
+        lsp_pop();
+
+        lsp_dup(0);
+        lsp_car();
+        lsp_compile_expression(compiler, tail && last);
+
+        lsp_cdr();
+        if (last) {
+            break;
+        }
+        lsp_compiler_emit_op(compiler, LSP_BC_POP);
+    }
+    lsp_pop();
+}
+
+/**
+ * Finds the variable that `sym` refers to.  Returns true, and sets `index`
+ * and `boxed`, if it is bound in a slot of the current call or in a frame.
+ * Slots of the current call are flagged by `slot`.  For anything else, `depth`
+ * is set to the number of frames to skip to reach it, or to reach the
+ * environment if the function returns false.
+ */
+static bool lsp_compiler_resolve(
+    lsp_compiler_t *compiler, lsp_sym_t sym, bool *slot,
+    unsigned int *depth, unsigned int *index, bool *boxed
+) {
+    *depth = 0;
+    for (lsp_scope_t *scope = compiler->scope; scope; scope = scope->parent) {
+        int found = lsp_scope_find(scope, sym);
+        if (found >= 0) {
+            *slot = scope->stack;
+            *index = scope->base + (unsigned int) found;
+            *boxed = scope->boxed[found];
+            return true;
+        }
+        if (!scope->stack) {
+            *depth += 1;
+        }
+    }
+    return false;
+}
+
+/**
+ * Emits the instruction that pushes the contents of a variable that was
+ * resolved by `lsp_compiler_resolve`.  Boxes are pushed as they are.
+ */
+static void lsp_compiler_emit_local(
+    lsp_compiler_t *compiler, bool slot, unsigned int depth, unsigned int index
+) {
+    if (slot) {
+        lsp_compiler_emit_op(compiler, LSP_BC_SLOT);
+    } else {
+        lsp_compiler_emit_op(compiler, LSP_BC_LOCAL);
+        lsp_compiler_emit_u16(compiler, depth);
+    }
+    lsp_compiler_emit_u16(compiler, index);
+}
+
+/**
+ * Compiles the body of a special form that binds a value to a symbol, with the
+ * rest of the form, after the name of the special form, at the top of the
+ * stack.  `define` is set for definitions, and clear for `set!`.
+ */
+static void lsp_compile_binding(lsp_compiler_t *compiler, bool define) {
+    lsp_dup(0);
+    lsp_car();
+    lsp_sym_t sym = lsp_read_symbol(0);
+    lsp_pop();
+
+    lsp_cdr();
+    lsp_dup(0);
+    lsp_car();
+    lsp_compile_expression(compiler, false);
+
+    lsp_cdr();
+    assert(lsp_is_null(0));
+    lsp_pop();
+
+    // Names defined in a lambda body were given slots before it was compiled,
+    // so only definitions outside of any lambda go to the environment.  Slots
+    // that hold boxes are updated through the box.
+    bool slot;
+    unsigned int depth;
+    unsigned int index;
+    bool boxed;
+    bool local = lsp_compiler_resolve(
+        compiler, sym, &slot, &depth, &index, &boxed
+    );
+    if (local && boxed) {
+        lsp_compiler_emit_local(compiler, slot, depth, index);
+        lsp_compiler_emit_op(compiler, LSP_BC_SET_BOX);
+    } else if (local && slot) {
+        lsp_compiler_emit_op(compiler, LSP_BC_SET_SLOT);
+        lsp_compiler_emit_u16(compiler, index);
+    } else if (local) {
+        lsp_compiler_emit_op(compiler, LSP_BC_SET_LOCAL);
+        lsp_compiler_emit_u16(compiler, depth);
+        lsp_compiler_emit_u16(compiler, index);
+    } else if (define) {
+        assert(compiler->scope == NULL);
+        lsp_compiler_emit_op(compiler, LSP_BC_DEFINE);
+        lsp_compiler_emit_u32(compiler, sym);
+    } else {
+        unsigned int cache = lsp_compiler_add_cache(compiler);
+        lsp_compiler_emit_op(compiler, LSP_BC_SET);
+        lsp_compiler_emit_u16(compiler, depth);
+        lsp_compiler_emit_u32(compiler, sym);
+        lsp_compiler_emit_u16(compiler, cache);
+    }
+}
+
+/**
+ * Compiles the creation of a closure for the `(args . body)` pair at the top
+ * of the stack, and pops it.  Every variable that the body refers to, and
+ * that is bound in a slot of the current call or in a capture frame, is
+ * copied into the closure's capture frame.  Boxes are copied as they are, so
+ * that the closure shares them with the slot.
+ */
+static void lsp_compile_closure(lsp_compiler_t *compiler) {
+    // Copy the `(args . body)` pair so that the body can be replaced by code
+    // when the lambda is first called, without modifying the expression that
+    // is being compiled.
+    lsp_dup(0);
+    lsp_cdr();
+    lsp_dup(1);
+    lsp_car();
+    lsp_cons();
+    unsigned int desc = lsp_compiler_add_constant(compiler);
+
+    lsp_free_variables();
+
+    unsigned int global = 0;
+    for (lsp_scope_t *scope = compiler->scope; scope; scope = scope->parent) {
+        global += !scope->stack;
+    }
+
+    // Variables in slots of the current call are captured first, followed by
+    // those in frames, so that each can be listed without its depth.
+    lsp_scope_t captured = {0};
+    captured.base = 2;
+    unsigned int *operands = NULL;
+    size_t noperands = 0;
+    size_t ncaptured[2] = {0, 0};
+    for (int pass = 0; pass < 2; pass++) {
+        lsp_dup(0);
+        while (lsp_is_cons(0)) {
+            lsp_dup(0);
+            lsp_car();
+            lsp_sym_t sym = lsp_read_symbol(0);
+            lsp_pop();
+            lsp_cdr();
+
+            bool slot;
+            unsigned int depth;
+            unsigned int index;
+            bool boxed;
+            if (
+                !lsp_compiler_resolve(
+                    compiler, sym, &slot, &depth, &index, &boxed
+                ) ||
+                slot != (pass == 0)
+            ) {
+                continue;
+            }
+
+            lsp_scope_add(&captured, sym);
+            captured.boxed[captured.nnames - 1] = boxed;
+            ncaptured[pass]++;
+
+            operands = (unsigned int *) realloc(
+                operands, (noperands + 2) * sizeof(unsigned int)
+            );
+            assert(operands != NULL);
+            if (!slot) {
+                operands[noperands++] = depth;
+            }
+            operands[noperands++] = index;
+        }
+        lsp_pop();
+    }
+    lsp_pop();
+
+    unsigned int layout = 0;
+    if (captured.nnames) {
+        lsp_scope_push_layout(&captured);
+        layout = lsp_compiler_add_constant(compiler);
+    }
+
+    lsp_compiler_emit_op(compiler, LSP_BC_LAMBDA);
+    lsp_compiler_emit_u16(compiler, desc);
+    lsp_compiler_emit_u16(compiler, layout);
+    lsp_compiler_emit_u16(compiler, global);
+    lsp_compiler_emit_u16(compiler, (unsigned int) ncaptured[0]);
+    for (size_t i = 0; i < ncaptured[0]; i++) {
+        lsp_compiler_emit_u16(compiler, operands[i]);
+    }
+    lsp_compiler_emit_u16(compiler, (unsigned int) ncaptured[1]);
+    for (size_t i = ncaptured[0]; i < noperands; i++) {
+        lsp_compiler_emit_u16(compiler, operands[i]);
+    }
+
+    free(operands);
+    free(captured.names);
+    free(captured.boxed);
+}
+
+/**
+ * Compiles the expression at the top of the stack, and pops it.  Expressions
+ * in tail position are the last thing evaluated before the code returns.
+ */
+static void lsp_compile_expression(lsp_compiler_t *compiler, bool tail) {
+    if (lsp_is_symbol(0)) {
+        lsp_sym_t sym = lsp_read_symbol(0);
+        lsp_pop();
+
+        bool slot;
+        unsigned int depth;
+        unsigned int index;
+        bool boxed;
+        if (lsp_compiler_resolve(
+            compiler, sym, &slot, &depth, &index, &boxed
+        )) {
+            lsp_compiler_emit_local(compiler, slot, depth, index);
+            if (boxed) {
+                lsp_compiler_emit_op(compiler, LSP_BC_UNBOX);
+            }
+        } else {
+            unsigned int cache = lsp_compiler_add_cache(compiler);
+            lsp_compiler_emit_op(compiler, LSP_BC_LOOKUP);
+            lsp_compiler_emit_u16(compiler, depth);
+            lsp_compiler_emit_u32(compiler, sym);
+            lsp_compiler_emit_u16(compiler, cache);
+        }
+        return;
+    }
+
+    if (lsp_is_int(0)) {
+        lsp_int_t value = lsp_read_int(0);
+        lsp_compiler_emit_op(compiler, LSP_BC_INT);
+        lsp_compiler_emit(compiler, &value, sizeof(value));
+        lsp_pop();
+        return;
+    }
+
+    if (lsp_is_null(0)) {
+        lsp_compiler_emit_op(compiler, LSP_BC_NULL);
+        lsp_pop();
+        return;
+    }
+
+    if (!lsp_is_cons(0)) {
+        // Any other literal is kept as a constant, so that it evaluates to
+        // the same object every time.
+        lsp_compiler_emit_op(compiler, LSP_BC_CONST);
+        lsp_compiler_emit_u16(compiler, lsp_compiler_add_constant(compiler));
+        return;
+    }
+
+    // The expression is a list, which is either a special form or a call.
+    // Special forms are recognised by name, even if the name is bound.
+    lsp_sym_t head = lsp_compile_head();
+
+    size_t alternate;
+    size_t end;
+    switch (head) {
+    case LSP_SYM_IF:
+        lsp_cdr();
+
+        // Predicate.
+        lsp_dup(0);
+        lsp_car();
+        lsp_compile_expression(compiler, false);
+        alternate = lsp_compiler_emit_jump(compiler, LSP_BC_JUMP_IF_FALSE);
+
+        // Subsequent.
+        lsp_cdr();
+        lsp_dup(0);
+        lsp_car();
+        lsp_compile_expression(compiler, tail);
+        end = lsp_compiler_emit_jump(compiler, LSP_BC_JUMP);
+
+        // Alternate.
+        lsp_compiler_patch(compiler, alternate);
+        lsp_cdr();
+        lsp_dup(0);
+        lsp_car();
+        lsp_compile_expression(compiler, tail);
+        lsp_compiler_patch(compiler, end);
+
+        lsp_cdr();
+        assert(lsp_is_null(0));
+        lsp_pop();
+        return;
+
+    case LSP_SYM_QUOTE:
+        lsp_cdr();
+        lsp_dup(0);
+        lsp_car();
+        lsp_compiler_emit_op(compiler, LSP_BC_CONST);
+        lsp_compiler_emit_u16(compiler, lsp_compiler_add_constant(compiler));
+
+        lsp_cdr();
+        assert(lsp_is_null(0));
+        lsp_pop();
+        return;
+
+    case LSP_SYM_DEFINE:
+        lsp_cdr();
+        lsp_compile_binding(compiler, true);
+        return;
+
+    case LSP_SYM_SET:
+        lsp_cdr();
+        lsp_compile_binding(compiler, false);
+        return;
+
+    case LSP_SYM_LAMBDA:
+        lsp_cdr();
+        lsp_compile_closure(compiler);
+        return;
+
+    case LSP_SYM_BEGIN:
+        lsp_cdr();
+        lsp_compile_sequence(compiler, tail);
+        return;
+
+    default:
+        break;
+    }
+
+    // Evaluate the callable and then each of the arguments, in order.
+    int nargs = -1;
+    lsp_dup(0);
+    while (!lsp_is_null(0)) {
+        lsp_dup(0);
+        lsp_car();
+        lsp_compile_expression(compiler, false);
+        lsp_cdr();
+        nargs++;
+    }
+    lsp_pop();
+
+    unsigned int form = lsp_compiler_add_constant(compiler);
+    lsp_compiler_emit_op(compiler, tail ? LSP_BC_TAIL_CALL : LSP_BC_CALL);
+    lsp_compiler_emit_u16(compiler, (unsigned int) nargs);
+    lsp_compiler_emit_u16(compiler, form);
+}
+
+/**
+ * Starts compiling code that will run in `scope`, by pushing the list that
+ * constants will be collected in.
+ */
+static void lsp_compiler_init(lsp_compiler_t *compiler, lsp_scope_t *scope) {
+    memset(compiler, 0, sizeof(lsp_compiler_t));
+    lsp_push_null();
+    compiler->constants = lsp_stats_stack_size() - 1;
+    compiler->nconstants = 1;
+    compiler->scope = scope;
+}
+
+/**
+ * Replaces the list of constants at the top of the stack with a code object
+ * holding the compiled bytecode followed by the constants.
+ */
+static void lsp_compiler_finish(lsp_compiler_t *compiler) {
+    assert(compiler->constants == lsp_stats_stack_size() - 1);
+
+    // Constants are listed newest first.
+    lsp_push_vector(compiler->nconstants);
+
+    lsp_push_bytecode(compiler->code, compiler->length);
+    free(compiler->code);
+    lsp_push_int(0);
+    lsp_dup(2);
+    lsp_vector_set();
+
+    for (unsigned int i = compiler->nconstants - 1; i > 0; i--) {
+        lsp_dup(1);
+        lsp_car();
+        lsp_push_int((int) i);
+        lsp_dup(2);
+        lsp_vector_set();
+
+        lsp_dup(1);
+        lsp_cdr();
+        lsp_store(2);
+    }
+
+    lsp_store(1);
+}
+
+/**
+ * Compiles the body of a lambda.
+ *
+ * Arguments:
+ *   - 0: (args . body)
+ *   - 1: The environment of the closure.
+ *
+ * Returns:
+ *   - The code object for the body.
+ *
+ * If the closure has a capture frame then the names of the captured variables
+ * are read back from it, so that the body can refer to them by their slots.
+ */
+static void lsp_compile_lambda(void) {
+    lsp_fp_t rp = lsp_get_fp();
+    lsp_shrink_frame(2);
+
+    lsp_scope_t *parent = NULL;
+    if (lsp_is_vector(1)) {
+        parent = (lsp_scope_t *) calloc(1, sizeof(lsp_scope_t));
+        assert(parent != NULL);
+        parent->base = 2;
+
+        lsp_push_int(1);
+        lsp_dup(2);
+        lsp_vector_ref();
+        lsp_dup(0);
+        lsp_vector_length();
+        int ncaptured = lsp_read_int(0);
+        lsp_pop();
+        for (int i = 0; i < ncaptured; i++) {
+            lsp_push_int(i);
+            lsp_dup(1);
+            lsp_vector_ref();
+            lsp_dup(0);
+            lsp_car();
+            lsp_scope_add(parent, lsp_read_symbol(0));
+            lsp_pop();
+            lsp_cdr();
+            parent->boxed[i] = lsp_read_int(0);
+            lsp_pop();
+        }
+        lsp_pop();
+    }
+
+    lsp_scope_t *scope = lsp_scope_new_lambda(parent);
+
+    // A slot only needs a box if a closure could see it change.  Arguments
+    // that are never assigned can be copied instead.
+    lsp_scope_t captured = {0};
+    lsp_scope_t assigned = {0};
+    lsp_dup(0);
+    lsp_cdr();
+    while (lsp_is_cons(0)) {
+        lsp_dup(0);
+        lsp_car();
+        lsp_compile_mark(&captured, &assigned, false);
+        lsp_cdr();
+    }
+    lsp_pop();
+
+    unsigned int nboxed = 0;
+    for (size_t i = 0; i < scope->nnames; i++) {
+        scope->boxed[i] = (
+            lsp_scope_find(&captured, scope->names[i]) >= 0 &&
+            lsp_scope_find(&assigned, scope->names[i]) >= 0
+        );
+        nboxed += scope->boxed[i];
+    }
+    free(captured.names);
+    free(captured.boxed);
+    free(assigned.names);
+    free(assigned.boxed);
+
+    lsp_compiler_t compiler;
+    lsp_compiler_init(&compiler, scope);
+
+    lsp_push_int((int) scope->nargs);
+    lsp_compiler_add_constant(&compiler);
+
+    lsp_scope_push_layout(scope);
+    lsp_compiler_add_constant(&compiler);
+
+    lsp_push_int((int) nboxed);
+    lsp_compiler_add_constant(&compiler);
+
+    lsp_dup(1);
+    lsp_cdr();
+    lsp_compile_sequence(&compiler, true);
+    lsp_compiler_emit_op(&compiler, LSP_BC_RETURN);
+    lsp_compiler_finish(&compiler);
+
+    lsp_scope_free(scope);
+
+    lsp_store(-1);
+    lsp_pop();
+
+    lsp_restore_fp(rp);
+}
+
+void lsp_compile(void) {
+    lsp_fp_t rp = lsp_get_fp();
+    lsp_shrink_frame(1);
+
+    lsp_compiler_t compiler;
+    lsp_compiler_init(&compiler, NULL);
+
+    lsp_dup(1);
+    lsp_compile_expression(&compiler, true);
+    lsp_compiler_emit_op(&compiler, LSP_BC_RETURN);
+    lsp_compiler_finish(&compiler);
+
+    // Replace the expression with the code object.
+    lsp_store(1);
+
+    lsp_restore_fp(rp);
+}
+
+
+/**
+ * Interpreter
+ * ===========
+ */
+
+static inline uint16_t lsp_exec_read_u16(
+    unsigned char const *code, size_t *ip
+) {
+    uint16_t value;
+    memcpy(&value, code + *ip, sizeof(value));
+    *ip += sizeof(value);
+    return value;
+}
+
+static inline uint32_t lsp_exec_read_u32(
+    unsigned char const *code, size_t *ip
+) {
+    uint32_t value;
+    memcpy(&value, code + *ip, sizeof(value));
+    *ip += sizeof(value);
+    return value;
+}
+
+void lsp_op_eval_lambda(void);
+
+/**
+ * Reverses the callable and the `nargs` arguments at the top of the stack.
+ * The callable is pushed first, but must be at the top of the stack with the
+ * first argument below it.
+ */
+static void lsp_exec_reverse(int nargs) {
+    lsp_reserve(2);
+    for (int i = 0, j = nargs; i < j; i++, j--) {
+        lsp_dup_unchecked(i);
+        lsp_dup_unchecked(j + 1);
+        lsp_store_unchecked(i + 2);
+        lsp_store_unchecked(j + 1);
+    }
+}
+
+/**
+ * Calls the callable at the top of the stack, with the `nargs` arguments
+ * below it, and attributes any allocations to the form in constant `form`.
+ */
+static void lsp_exec_call(int nargs, int form) {
+    if (lsp_profile_enabled()) {
+        lsp_push_int(form);
+        lsp_dup(-1);
+        lsp_vector_ref();
+        lsp_profile_enter_form(0);
+        lsp_pop();
+        lsp_call(nargs);
+        lsp_profile_leave_form();
+    } else {
+        lsp_call(nargs);
+    }
+}
+
+/**
+ * Replaces the code object at the bottom of the frame with the value at the
+ * top, and pops everything else.
+ */
+static void lsp_exec_return(void) {
+    lsp_store(-1);
+    while (lsp_stats_frame_size() > 1) {
+        lsp_pop();
+    }
+}
+
+/**
+ * Compiles the body of a lambda if it has not been compiled already, and
+ * replaces everything in the current frame with the frame that the body runs
+ * in.
+ *
+ * Arguments:
+ *   - 0: (args . body), where the body is replaced by a code object once it
+ *     has been compiled
+ *   - 1: env
+ *   - ...: the `nargs` arguments
+ *
+ * Leaves the code object, the environment and the bytecode at the bottom of
+ * the frame, followed by the slots, and returns the number of slots.
+ */
+static int lsp_exec_enter_lambda(int nargs) {
+    // The pair is shared by every closure created from the same lambda
+    // expression, so they will all use the same code.  Closures created by
+    // the same expression always have capture frames with the same layout.
+    lsp_dup(0);
+    lsp_cdr();
+    if (!lsp_is_vector(0)) {
+        lsp_pop();
+        lsp_dup(1);
+        lsp_dup(1);
+        lsp_compile_lambda();
+
+        lsp_dup(0);
+        lsp_dup(2);
+        lsp_set_cdr();
+    }
+
+    lsp_push_int(1);
+    lsp_dup(1);
+    lsp_vector_ref();
+    assert(nargs <= lsp_read_int(0));  // Too many arguments.
+    lsp_pop();
+
+    lsp_push_int(2);
+    lsp_dup(1);
+    lsp_vector_ref();
+    lsp_vector_length();
+    int nslots = lsp_read_int(0);
+    lsp_pop();
+
+    lsp_push_int(3);
+    lsp_dup(1);
+    lsp_vector_ref();
+    bool boxes = lsp_read_int(0) > 0;
+    lsp_pop();
+
+    // Build the new frame on top of the stack, and then move it down.  The
+    // arguments are found from the bottom of the frame, as the new frame
+    // grows over them.
+    int top = (int) lsp_stats_frame_size();
+    lsp_reserve(3 + (size_t) nslots);
+    lsp_dup_unchecked(0);
+    lsp_dup_unchecked(3);
+    lsp_push_int(0);
+    lsp_dup_unchecked(2);
+    lsp_vector_ref();
+    for (int i = 0; i < nslots; i++) {
+        if (i < nargs) {
+            lsp_dup_unchecked(-(top - 3 - i));
+        } else {
+            lsp_push_null();
+        }
+    }
+
+    // Put anything that a closure could see change in a box.
+    for (int i = 0; boxes && i < nslots; i++) {
+        lsp_push_int(2);
+        lsp_dup(-(top + 1));
+        lsp_vector_ref();
+        lsp_push_int(i);
+        lsp_swp(1);
+        lsp_vector_ref();
+        lsp_dup(0);
+        lsp_cdr();
+        bool boxed = lsp_read_int(0);
+        lsp_pop();
+        lsp_car();
+        if (!boxed) {
+            lsp_pop();
+            continue;
+        }
+
+        lsp_dup(-(top + 4 + i));
+        lsp_swp(1);
+        lsp_cons();
+        lsp_store(-(top + 4 + i));
+    }
+
+    lsp_reserve(1);
+    for (int i = 0; i < 3 + nslots; i++) {
+        lsp_dup_unchecked(-(top + 1 + i));
+        lsp_store_unchecked(-(1 + i));
+    }
+    while ((int) lsp_stats_frame_size() > 3 + nslots) {
+        lsp_pop_unchecked();
+    }
+
+    return nslots;
+}
+
+/**
+ * Pushes the capture frame or environment found by skipping `depth` frames
+ * outwards from the environment of the running code.
+ */
+static inline void lsp_exec_frame(unsigned int depth) {
+    lsp_dup(-2);
+    for (unsigned int i = 0; i < depth; i++) {
+        lsp_push_int(0);
+        lsp_swp(1);
+        lsp_vector_ref();
+    }
+}
+
+/**
+ * Replaces the environment at the top of the stack with the binding cell for
+ * `sym`, using the inline cache starting at slot `cache` of the code object.
+ */
+static void lsp_exec_binding(unsigned int cache, lsp_sym_t sym) {
+    unsigned int version = lsp_env_version();
+
+    lsp_push_int((int) cache + 2);
+    lsp_dup(-1);
+    lsp_vector_ref();
+    bool hit = lsp_is_int(0) && (unsigned int) lsp_read_int(0) == version;
+    lsp_pop();
+
+    if (hit) {
+        lsp_push_int((int) cache);
+        lsp_dup(-1);
+        lsp_vector_ref();
+        hit = lsp_is_identical(0, 1);
+        lsp_pop();
+    }
+
+    if (hit) {
+        lsp_pop();
+        lsp_push_int((int) cache + 1);
+        lsp_dup(-1);
+        lsp_vector_ref();
+        return;
+    }
+
+    // Miss.  Resolve the symbol, and remember the environment and the cell.
+    lsp_dup(0);
+    lsp_push_int((int) cache);
+    lsp_dup(-1);
+    lsp_vector_set();
+
+    lsp_push_symbol_id(sym);
+    lsp_swp(1);
+    lsp_lookup_binding();
+
+    lsp_dup(0);
+    lsp_push_int((int) cache + 1);
+    lsp_dup(-1);
+    lsp_vector_set();
+
+    lsp_push_int((int) version);
+    lsp_push_int((int) cache + 2);
+    lsp_dup(-1);
+    lsp_vector_set();
+}
+
+// Dispatch uses computed gotos where they are available, which lets every
+// instruction jump straight to the next handler.  Otherwise it falls back to
+// a switch.  Both are GNU extensions, so pedantic warnings about them are
+// suppressed.
+#if defined(__GNUC__)
+#define LSP_EXEC_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+/**
+ * Runs the code at the bottom of the current frame, which must hold the code
+ * object, the environment and the bytecode, followed by `nslots` slots.
+ * Leaves the result alone in the frame.  Instructions that can allocate must
+ * reload `code` afterwards, as the bytecode can be moved by the collector.
+ */
+static void lsp_exec_run(int nslots) {
+    unsigned char const *code = lsp_borrow_bytecode(-3);
+    size_t ip = 0;
+
+#ifdef LSP_EXEC_COMPUTED_GOTO
+    static void *const targets[] = {
+        [LSP_BC_NULL] = &&target_LSP_BC_NULL,
+        [LSP_BC_INT] = &&target_LSP_BC_INT,
+        [LSP_BC_CONST] = &&target_LSP_BC_CONST,
+        [LSP_BC_SLOT] = &&target_LSP_BC_SLOT,
+        [LSP_BC_SET_SLOT] = &&target_LSP_BC_SET_SLOT,
+        [LSP_BC_LOCAL] = &&target_LSP_BC_LOCAL,
+        [LSP_BC_SET_LOCAL] = &&target_LSP_BC_SET_LOCAL,
+        [LSP_BC_UNBOX] = &&target_LSP_BC_UNBOX,
+        [LSP_BC_SET_BOX] = &&target_LSP_BC_SET_BOX,
+        [LSP_BC_LOOKUP] = &&target_LSP_BC_LOOKUP,
+        [LSP_BC_DEFINE] = &&target_LSP_BC_DEFINE,
+        [LSP_BC_SET] = &&target_LSP_BC_SET,
+        [LSP_BC_POP] = &&target_LSP_BC_POP,
+        [LSP_BC_JUMP] = &&target_LSP_BC_JUMP,
+        [LSP_BC_JUMP_IF_FALSE] = &&target_LSP_BC_JUMP_IF_FALSE,
+        [LSP_BC_LAMBDA] = &&target_LSP_BC_LAMBDA,
+        [LSP_BC_CALL] = &&target_LSP_BC_CALL,
+        [LSP_BC_TAIL_CALL] = &&target_LSP_BC_TAIL_CALL,
+        [LSP_BC_RETURN] = &&target_LSP_BC_RETURN,
+    };
+#define TARGET(op) target_##op:
+#define DISPATCH() goto *targets[code[ip++]]
+#else
+#define TARGET(op) case op:
+#define DISPATCH() goto dispatch
+#endif
+
+    DISPATCH();
+
+#ifndef LSP_EXEC_COMPUTED_GOTO
+dispatch:
+    switch ((lsp_bc_t) code[ip++]) {
+#endif
+
+    TARGET(LSP_BC_NULL) {
+        lsp_push_null();
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_INT) {
+        lsp_int_t value;
+        memcpy(&value, code + ip, sizeof(value));
+        ip += sizeof(value);
+        lsp_push_int(value);
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_CONST) {
+        lsp_push_int(lsp_exec_read_u16(code, &ip));
+        lsp_dup(-1);
+        lsp_vector_ref();
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_SLOT) {
+        lsp_dup(-4 - (int) lsp_exec_read_u16(code, &ip));
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_SET_SLOT) {
+        lsp_store(-4 - (int) lsp_exec_read_u16(code, &ip));
+        lsp_push_null();
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_LOCAL) {
+        unsigned int depth = lsp_exec_read_u16(code, &ip);
+        unsigned int index = lsp_exec_read_u16(code, &ip);
+        lsp_exec_frame(depth);
+        lsp_push_int((int) index);
+        lsp_swp(1);
+        lsp_vector_ref();
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_SET_LOCAL) {
+        unsigned int depth = lsp_exec_read_u16(code, &ip);
+        unsigned int index = lsp_exec_read_u16(code, &ip);
+        lsp_exec_frame(depth);
+        lsp_push_int((int) index);
+        lsp_swp(1);
+        lsp_vector_set();
+        lsp_push_null();
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_UNBOX) {
+        lsp_cdr();
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_SET_BOX) {
+        lsp_set_cdr();
+        lsp_push_null();
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_LOOKUP) {
+        unsigned int depth = lsp_exec_read_u16(code, &ip);
+        lsp_sym_t sym = lsp_exec_read_u32(code, &ip);
+        unsigned int cache = lsp_exec_read_u16(code, &ip);
+        lsp_exec_frame(depth);
+        lsp_exec_binding(cache, sym);
+        lsp_cdr();
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_DEFINE) {
+        lsp_push_symbol_id(lsp_exec_read_u32(code, &ip));
+        lsp_dup(-2);
+        lsp_define();
+        lsp_push_null();
+        code = lsp_borrow_bytecode(-3);
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_SET) {
+        unsigned int depth = lsp_exec_read_u16(code, &ip);
+        lsp_sym_t sym = lsp_exec_read_u32(code, &ip);
+        unsigned int cache = lsp_exec_read_u16(code, &ip);
+        lsp_exec_frame(depth);
+        lsp_exec_binding(cache, sym);
+        lsp_set_cdr();
+        lsp_push_null();
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_POP) {
+        lsp_pop();
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_JUMP) {
+        ip = lsp_exec_read_u32(code, &ip);
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_JUMP_IF_FALSE) {
+        uint32_t target = lsp_exec_read_u32(code, &ip);
+        if (!lsp_is_truthy()) {
+            ip = target;
+        }
+        lsp_pop();
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_LAMBDA) {
+        int desc = lsp_exec_read_u16(code, &ip);
+        int layout = lsp_exec_read_u16(code, &ip);
+        unsigned int depth = lsp_exec_read_u16(code, &ip);
+        int nslots_captured = lsp_exec_read_u16(code, &ip);
+        size_t slots = ip;
+        ip += nslots_captured * sizeof(uint16_t);
+        int nlocals_captured = lsp_exec_read_u16(code, &ip);
+        int ncaptured = nslots_captured + nlocals_captured;
+
+        if (ncaptured == 0) {
+            lsp_exec_frame(depth);
+        } else {
+            lsp_push_vector(2 + (size_t) ncaptured);
+            code = lsp_borrow_bytecode(-3);
+
+            lsp_exec_frame(depth);
+            lsp_push_int(0);
+            lsp_dup(2);
+            lsp_vector_set();
+
+            lsp_push_int(layout);
+            lsp_dup(-1);
+            lsp_vector_ref();
+            lsp_push_int(1);
+            lsp_dup(2);
+            lsp_vector_set();
+
+            for (int i = 0; i < ncaptured; i++) {
+                if (i < nslots_captured) {
+                    lsp_dup(-4 - (int) lsp_exec_read_u16(code, &slots));
+                } else {
+                    lsp_exec_frame(lsp_exec_read_u16(code, &ip));
+                    lsp_push_int(lsp_exec_read_u16(code, &ip));
+                    lsp_swp(1);
+                    lsp_vector_ref();
+                }
+                lsp_push_int(2 + i);
+                lsp_dup(2);
+                lsp_vector_set();
+            }
+        }
+
+        lsp_push_int(desc);
+        lsp_dup(-1);
+        lsp_vector_ref();
+        lsp_push_op(lsp_op_eval_lambda);
+        lsp_cons();
+        lsp_cons();
+        code = lsp_borrow_bytecode(-3);
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_CALL) {
+        int nargs = lsp_exec_read_u16(code, &ip);
+        int form = lsp_exec_read_u16(code, &ip);
+
+        lsp_exec_reverse(nargs);
+        lsp_exec_call(nargs, form);
+
+        code = lsp_borrow_bytecode(-3);
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_TAIL_CALL) {
+        int nargs = lsp_exec_read_u16(code, &ip);
+        int form = lsp_exec_read_u16(code, &ip);
+
+        lsp_exec_reverse(nargs);
+
+        // Expand the callable, as `lsp_call_inner` would, until it is an op.
+        // Everything above the bytecode now belongs to the call.
+        lsp_reserve(1);
+        while (!lsp_is_op(0)) {
+            lsp_dup_unchecked(0);
+            lsp_cdr();
+            lsp_swp_unchecked(1);
+            lsp_car();
+        }
+
+        if (lsp_read_op(0) != lsp_op_eval_lambda) {
+            // Anything other than a compiled lambda is called as normal.
+            lsp_exec_call((int) lsp_stats_frame_size() - 4 - nslots, form);
+            lsp_exec_return();
+            return;
+        }
+
+        // Replace the frame with that of the lambda, discarding everything
+        // else, and start again from the beginning.
+        lsp_pop();
+        nslots = lsp_exec_enter_lambda(
+            (int) lsp_stats_frame_size() - 5 - nslots
+        );
+
+        code = lsp_borrow_bytecode(-3);
+        ip = 0;
+        DISPATCH();
+    }
+
+    TARGET(LSP_BC_RETURN) {
+        lsp_exec_return();
+        return;
+    }
+
+#ifndef LSP_EXEC_COMPUTED_GOTO
+    }
+    assert(false);
+#endif
+
+#undef TARGET
+#undef DISPATCH
+}
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+void lsp_exec(void) {
+    lsp_fp_t rp = lsp_get_fp();
+    lsp_shrink_frame(2);
+
+    // Unpack the bytecode into the frame, below anything that the code
+    // pushes.
+    lsp_push_int(0);
+    lsp_dup(-1);
+    lsp_vector_ref();
+
+    lsp_exec_run(0);
+
+    lsp_restore_fp(rp);
+}
+
+
+void lsp_op_eval_lambda(void) {
+    // Arguments:
+    //   - 0: (args . body), or (args . code) once compiled
+    //   - 1: env
+    //   - ...: arguments
+    lsp_exec_run(lsp_exec_enter_lambda((int) lsp_stats_frame_size() - 2));
+}
+
+
+void lsp_eval(void) {
+    lsp_fp_t rp = lsp_get_fp();
+    lsp_shrink_frame(2);
+
+    lsp_profile_enter_form(1);
+
+    // Replace the expression with its code and run it.
+    lsp_dup(1);
+    lsp_compile();
+    lsp_store(2);
+    lsp_exec();
+
+    lsp_profile_leave_form();
+
+    lsp_restore_fp(rp);
+}
@@ -1,8 +1,8 @@
 #include "lsp.h"
+#include "lsp_internal.h"
 
 #include <stdlib.h>
 #include <assert.h>
-#include <string.h>
 
 
 void lsp_push_empty_env(void) {
@@ -25,6 +25,124 @@ void lsp_push_scope(void) {
 }
 
 
+/**
+ * The number of bindings that the outermost scope of an environment can hold
+ * in a list before they are moved to a table.
+ */
+#define LSP_ENV_TABLE_MIN 8
+
+/**
+ * Replaces the list of bindings at the top of the stack with a table mapping
+ * each symbol to its innermost binding cell.
+ */
+static void lsp_env_index(void) {
+    lsp_push_table();
+    lsp_swp(1);
+
+    while (lsp_is_cons(0)) {
+        lsp_dup(0);
+        lsp_car();
+
+        // Bindings are listed newest first, so skip any that are shadowed.
+        lsp_dup(0);
+        lsp_car();
+        lsp_dup(3);
+        lsp_table_ref();
+        bool shadowed = !lsp_is_null(0);
+        lsp_pop();
+
+        if (shadowed) {
+            lsp_pop();
+        } else {
+            lsp_dup(0);
+            lsp_car();
+            lsp_dup(3);
+            lsp_table_set();
+        }
+
+        lsp_cdr();
+    }
+    lsp_pop();
+}
+
+/**
+ * Searches a single scope for the binding cell for a symbol.
+ *
+ * Arguments:
+ *   - The bindings of the scope, which are either a list of cells, a table
+ *     mapping symbols to cells, or a vector of cells captured by a closure.
+ *   - symbol
+ *
+ * Returns:
+ *   - The binding cell, or null if the scope does not bind the symbol.
+ */
+static void lsp_scope_binding(void) {
+    lsp_fp_t rp = lsp_get_fp();
+    lsp_shrink_frame(2);
+
+    if (lsp_is_table(0)) {
+        lsp_table_ref();
+        lsp_restore_fp(rp);
+        return;
+    }
+
+    if (lsp_is_vector(0)) {
+        lsp_dup(0);
+        lsp_vector_length();
+        int length = lsp_read_int(0);
+        lsp_pop();
+
+        for (int i = 0; i < length; i++) {
+            lsp_push_int(i);
+            lsp_dup(1);
+            lsp_vector_ref();
+            lsp_dup(0);
+            lsp_car();
+            bool found = lsp_read_symbol(0) == lsp_read_symbol(-1);
+            lsp_pop();
+            if (found) {
+                lsp_store(-1);
+                lsp_pop();
+                lsp_restore_fp(rp);
+                return;
+            }
+            lsp_pop();
+        }
+
+        lsp_pop();
+        lsp_pop();
+        lsp_push_null();
+        lsp_restore_fp(rp);
+        return;
+    }
+
+    // Search the list for the symbol.
+    while (lsp_is_cons(0)) {
+        // Read the symbol from the first entry.
+        lsp_dup(0);
+        lsp_car();  // The first binding in the list.
+        lsp_car();  // The key for the binding.
+
+        // Compare it to the symbol we are interested in.
+        bool found = lsp_read_symbol(0) == lsp_read_symbol(-1);
+        lsp_pop();
+
+        if (found) {
+            lsp_car();
+            break;
+        }
+
+        // Advance to the next entry in the list.
+        lsp_cdr();
+    }
+
+    // Replace the symbol with the binding, or with the null at the end of
+    // the list.
+    lsp_store(-1);
+
+    lsp_restore_fp(rp);
+}
+
 /**
  * Arguments:
  *   - environment
@@ -35,10 +153,53 @@ void lsp_define(void) {
     lsp_fp_t rp = lsp_get_fp();
     lsp_shrink_frame(3);
 
+    // The new binding could shadow one that has been cached.
+    lsp_env_changed();
+
     // Extract the current locals from the environment.
     lsp_dup(-3);
     lsp_car();
 
+    // Scopes captured by closures are fixed when they are created.
+    assert(!lsp_is_vector(0));
+
+    // Redefinitions update the existing cell, so that anything holding on to
+    // it sees the new value.
+    lsp_dup(-2);
+    lsp_dup(1);
+    lsp_scope_binding();
+    if (lsp_is_cons(0)) {
+        lsp_dup(-1);
+        lsp_swp(1);
+        lsp_set_cdr();
+
+        lsp_pop();
+        lsp_pop();
+        lsp_pop();
+        lsp_pop();
+
+        lsp_restore_fp(rp);
+        return;
+    }
+    lsp_pop();
+
+    if (lsp_is_table(0)) {
+        lsp_dup(-1);
+        lsp_dup(-2);
+        lsp_cons();
+        lsp_dup(-2);
+        lsp_dup(2);
+        lsp_table_set();
+
+        lsp_pop();
+        lsp_pop();
+        lsp_pop();
+        lsp_pop();
+
+        lsp_restore_fp(rp);
+        return;
+    }
+
     // Wrap the symbol and value in a new cons cell.
     lsp_dup(-1);
     lsp_dup(-2);
@@ -47,6 +208,26 @@ void lsp_define(void) {
     // Add the binding to the list of locals.
     lsp_cons();
 
+    // The outermost scope holds every top level binding, including builtins,
+    // so once it has more than a few they are moved to a table.
+    lsp_dup(-3);
+    lsp_cdr();
+    bool outermost = lsp_is_null(0);
+    lsp_pop();
+    if (outermost) {
+        size_t length = 0;
+        lsp_dup(0);
+        while (lsp_is_cons(0)) {
+            length++;
+            lsp_cdr();
+        }
+        lsp_pop();
+
+        if (length > LSP_ENV_TABLE_MIN) {
+            lsp_env_index();
+        }
+    }
+
     // Replace the list of locals stored in the environment with the new list.
     lsp_swp(1);
     lsp_set_car();
@@ -64,7 +245,7 @@ void lsp_define(void) {
  *   - environment
  *   - symbol
  */
-void lsp_lookup(void) {
+void lsp_lookup_binding(void) {
     lsp_fp_t rp = lsp_get_fp();
     lsp_shrink_frame(2);
 
@@ -74,10 +255,24 @@ void lsp_lookup(void) {
         // lsp_abort("undefined variable");
     }
 
-    // Extract the list of local bindings and save at the top of the stack.
+    // Extract the local bindings and save at the top of the stack.
     lsp_dup(0);
     lsp_car();
 
+    if (lsp_is_table(0) || lsp_is_vector(0)) {
+        lsp_dup(-1);
+        lsp_swp(1);
+        lsp_scope_binding();
+        if (lsp_is_cons(0)) {
+            lsp_store(-1);
+            lsp_pop();
+
+            lsp_restore_fp(rp);
+
+            return;
+        }
+    }
+
     // Search the list for the symbol.
     while (lsp_is_cons(0)) {
         assert(lsp_stats_frame_size() == 3);
@@ -88,17 +283,13 @@ void lsp_lookup(void) {
         lsp_car();  // The key for the binding.
 
         // Compare it to the symbol we are interested in.
-        char const *target = lsp_borrow_symbol(-1);
-        char const *current = lsp_borrow_symbol(0);
-        int cmp_result = strcmp(current, target);
+        bool found = lsp_read_symbol(0) == lsp_read_symbol(-1);
         lsp_pop();
 
-        if (cmp_result == 0) {
-            // If equal then we have found what we are looking for.  Extract
-            // the value from the corresponding entry in the scope and return
-            // it.
+        if (found) {
+            // If equal then we have found what we are looking for.  Return
+            // the corresponding entry in the scope.
             lsp_car();  // The first binding in the list.
-            lsp_cdr();  // The value from the binding.
 
             lsp_store(-1);
             lsp_pop();
@@ -119,11 +310,21 @@ void lsp_lookup(void) {
     lsp_cdr();
 
     // Search for the symbol in the parent environment.
-    lsp_lookup();
+    lsp_lookup_binding();
 
     lsp_restore_fp(rp);
 }
 
+/**
+ * Arguments:
+ *   - environment
+ *   - symbol
+ */
+void lsp_lookup(void) {
+    lsp_lookup_binding();
+    lsp_cdr();
+}
+
 /**
  * Arguments:
  *   - environment
@@ -131,74 +332,109 @@ void lsp_lookup(void) {
  *   - value
  */
 void lsp_set(void) {
+    // Replace the value in the binding, wherever it was found.
+    lsp_lookup_binding();
+    lsp_set_cdr();
+}
+
+/**
+ * Copies the innermost binding cell for each of the requested variables into
+ * the vector at the head of a new env, in front of the global part of the
+ * environment.  The cells are shared, so assignments through the new env are
+ * seen by the old one.
+ *
+ * Arguments:
+ *   - A list of symbols to capture.
+ *   - The environment to capture them from.
+ */
+void lsp_capture(void) {
     lsp_fp_t rp = lsp_get_fp();
-    lsp_shrink_frame(3);
+    lsp_shrink_frame(2);
 
-    // Check that the current environment is not NULL.
-    if (lsp_is_null(0)) {
-        assert(false);
-        // lsp_abort("undefined variable");
-    }
+    // Scopes up to and including the first that was captured by a closure
+    // belong to lambdas that are still being evaluated.  Anything further out
+    // is global, and is left for the closure to look up when it runs.
+    int nlocal = 0;
+    lsp_dup(-1);
+    while (true) {
+        if (!lsp_is_cons(0)) {
+            nlocal = 0;
+            lsp_pop();
+            lsp_dup(-1);
+            break;
+        }
+        nlocal++;
 
-    // Extract the list of local bindings and save at the top of the stack.
-    lsp_dup(0);
-    lsp_car();
+        lsp_dup(0);
+        lsp_car();
+        bool captured = lsp_is_vector(0);
+        lsp_pop();
 
-    // Search the list for the symbol.
-    while (lsp_is_cons(0)) {
-        assert(lsp_stats_frame_size() == 4);
+        lsp_cdr();
+        if (captured) {
+            break;
+        }
+    }
 
-        // Read the symbol from the first entry.
+    // Collect the cells, newest first.  Variables that are not bound in a
+    // local scope are skipped.
+    int ncells = 0;
+    lsp_push_null();
+    lsp_dup(2);
+    while (lsp_is_cons(0)) {
         lsp_dup(0);
-        lsp_car();  // The first binding in the list.
-        lsp_car();  // The key for the binding.
-
-        // Compare it to the symbol we are interested in.
-        char const *target = lsp_borrow_symbol(-2);
-        char const *current = lsp_borrow_symbol(0);
-        int cmp_result = strcmp(current, target);
-        lsp_pop();
+        lsp_car();
 
-        if (cmp_result == 0) {
-            // Load a reference to the binding and replace its cdr with the new
-            // value.
+        lsp_dup(-1);
+        bool found = false;
+        for (int i = 0; i < nlocal && !found; i++) {
+            lsp_dup(1);
+            lsp_dup(1);
             lsp_car();
+            lsp_scope_binding();
+            found = lsp_is_cons(0);
+            if (found) {
+                lsp_store(1);
+            } else {
+                lsp_pop();
+                lsp_cdr();
+            }
+        }
+        lsp_store(1);
+
+        if (found) {
+            lsp_dup(2);
+            lsp_swp(1);
+            lsp_cons();
             lsp_store(2);
+            ncells++;
+        } else {
             lsp_pop();
-
-            lsp_set_cdr();
-
-            lsp_restore_fp(rp);
-
-            return;
         }
 
-        // Advance to the next entry in the list.
         lsp_cdr();
     }
-
-    // Remove the empty inner scope from the stack.
     lsp_pop();
 
-    // Replace the current environment with the parent environment.
-    lsp_cdr();
+    lsp_push_vector((size_t) ncells);
+    for (int i = ncells - 1; i >= 0; i--) {
+        lsp_dup(1);
+        lsp_car();
+        lsp_push_int(i);
+        lsp_dup(2);
+        lsp_vector_set();
 
-    // Search for the symbol in the parent environment.
-    lsp_lookup();
+        lsp_dup(1);
+        lsp_cdr();
+        lsp_store(2);
+    }
+    lsp_store(1);
+    lsp_cons();
 
-    lsp_restore_fp(rp);
-}
+    lsp_store(-1);
+    lsp_pop();
 
-/**
- * Extracts the innermost binding for each of the requested variables into the
- * inner scope of a new env.
- *
- * Arguments:
- *   - A list of symbols to capture.
- *   - The environment to capture them from.
- */
-void lsp_capture(void) {
-    abort();
+    lsp_restore_fp(rp);
 }
 
 
@@ -224,5 +460,16 @@ void lsp_push_default_env(void) {
     lsp_bind("set-cdr!", &lsp_set_cdr);
     lsp_bind("map", &lsp_map);
     lsp_bind("fold", &lsp_fold);
+    lsp_bind("vector", &lsp_vector);
+    lsp_bind("vector-ref", &lsp_vector_ref);
+    lsp_bind("vector-set!", &lsp_op_vector_set);
+    lsp_bind("vector-length", &lsp_vector_length);
+    lsp_bind("vector-map", &lsp_vector_map);
+    lsp_bind("make-table", &lsp_push_table);
+    lsp_bind("table-ref", &lsp_table_ref);
+    lsp_bind("table-set!", &lsp_op_table_set);
+    lsp_bind("table-delete!", &lsp_op_table_delete);
+    lsp_bind("table-count", &lsp_table_count);
+    lsp_bind("vm-stats", &lsp_vm_stats);
 }
 
@@ -1,16 +1,16 @@
 #include "lsp.h"
 
-#include <string.h>
 #include <assert.h>
 
 
-void lsp_op_eval_lambda(void) {
+void lsp_op_walk_lambda(void) {
     // Push new scope onto closure.
-    // Bind arguments to local variables.
-    // Call `lsp_eval`.
+    // Bind names defined in the body, then arguments, to local variables.
+    // Call `lsp_eval_tree`.
     //
     // Arguments:
-    //   - 0: (args body)
+    //   - 0: (names args . body), where `names` lists the names defined in
+    //     the body
     //   - 1: env
     //   - ...: arguments
     //
@@ -30,18 +30,33 @@ void lsp_op_eval_lambda(void) {
     //   - ...
     int nargs = lsp_stats_frame_size() - 2;
 
+    // Push an empty scope onto the closure and then save it back in its
+    // original place on the stack.
+    lsp_dup(1);
+    lsp_push_scope();
+    lsp_store(2);
+
+    // Bind every name defined in the body before running it, so that closures
+    // created in the body capture the cell that the definition will fill in.
+    lsp_dup(0);
+    lsp_car();
+    while (lsp_is_cons(0)) {
+        lsp_push_null();
+        lsp_dup(1);
+        lsp_car();
+        lsp_dup(4);
+        lsp_define();
+        lsp_cdr();
+    }
+    lsp_pop();
+
     // Unpack body and argument list.
+    lsp_cdr();
     lsp_dup(0);
     lsp_cdr();
     lsp_swp(1);
     lsp_car();
 
-    // Push an empty scope onto the closure and then save it back in its
-    // original place on the stack.
-    lsp_dup(2);
-    lsp_push_scope();
-    lsp_store(3);
-
     // Bind arguments to local variables.
     for (int i = 0; i < nargs; i++) {
         // Push next argument to the top of the stack.
@@ -72,36 +87,40 @@ void lsp_op_eval_lambda(void) {
         lsp_pop();
     }
 
+    lsp_reserve(3);
     lsp_push_null();
     while (!lsp_is_null(1)) {
-        lsp_pop();
-        lsp_dup(0);
+        lsp_pop_unchecked();
+        lsp_dup_unchecked(0);
         lsp_car();
-        lsp_dup(2);
-        lsp_eval();
-        lsp_dup(1);
+        lsp_dup_unchecked(2);
+        lsp_eval_tree();
+        lsp_dup_unchecked(1);
         lsp_cdr();
-        lsp_store(2);
+        lsp_store_unchecked(2);
     }
 
-    lsp_store(2);
-    lsp_pop();
+    lsp_store_unchecked(2);
+    lsp_pop_unchecked();
 }
 
 
 void lsp_call_inner(void) {
     // Expand the callable until the top of the stack contains an op.
+    lsp_reserve(1);
     while (!lsp_is_op(0)) {
-        lsp_dup(0);
+        lsp_dup_unchecked(0);
         lsp_cdr();
-        lsp_swp(1);
+        lsp_swp_unchecked(1);
         lsp_car();
     }
 
     // Call the op.
     lsp_op_t op = lsp_read_op(0);
     lsp_pop();
+    lsp_op_t caller = lsp_profile_enter_op(op);
     op();
+    lsp_profile_enter_op(caller);
 }
 
 
@@ -152,9 +171,8 @@ static void lsp_eval_inner(void) {
             // The first item in the list is a symbol.  We first check if it
             // represents a special form and if that doesn't work fall through
             // to evaluating as an expression.
-            char const *sym = lsp_borrow_symbol(0);
-
-            if (strcmp(sym, "if") == 0) {
+            switch (lsp_read_symbol(0)) {
+            case LSP_SYM_IF:
                 lsp_pop();
 
                 // Duplicate the expression, and strip the leading `if`.
@@ -172,25 +190,24 @@ static void lsp_eval_inner(void) {
                 // Evaluate and check the predicate.
                 lsp_dup(-3);  // The predicate expression.
                 lsp_dup(-2);  // The environment.
-                lsp_eval();
+                lsp_eval_tree();
 
                 if (lsp_is_truthy()) {
                     lsp_pop();  // The result.
                     lsp_pop();  // The alternate.
                     lsp_store(-1);  // The subsequent.
                     lsp_pop();  // The predicate.
-                    lsp_eval();
+                    lsp_eval_tree();
                 } else {
                     lsp_pop();  // The result.
                     lsp_store(-1);  // The alternate.
                     lsp_pop();  // The subsequent.
                     lsp_pop();  // The predicate.
-                    lsp_eval();
+                    lsp_eval_tree();
                 }
 
                 return;
-            }
-            if (strcmp(sym, "quote") == 0) {
+            case LSP_SYM_QUOTE:
                 // Pop the `quote` and the environment from the top of the
                 // stack.
                 lsp_pop();
@@ -208,8 +225,7 @@ static void lsp_eval_inner(void) {
 
                 // Return the quoted expression.
                 return;
-            }
-            if (strcmp(sym, "define") == 0) {
+            case LSP_SYM_DEFINE:
                 // Strip the `define` from the top of the stack
                 lsp_pop();
 
@@ -224,6 +240,10 @@ static void lsp_eval_inner(void) {
                 assert(lsp_is_null(0));
                 lsp_pop();
 
+                // Evaluate the value.
+                lsp_dup(2);
+                lsp_eval_tree();
+
                 // Rearrange the stack so that the environment is at the top,
                 // followed by the symbol and then the value.
                 lsp_store(3);
@@ -235,8 +255,7 @@ static void lsp_eval_inner(void) {
                 // Return NULL.
                 lsp_push_null();
                 return;
-            }
-            if (strcmp(sym, "set!") == 0) {
+            case LSP_SYM_SET:
                 // Strip the `set!` from the top of the stack
                 lsp_pop();
 
@@ -251,6 +270,10 @@ static void lsp_eval_inner(void) {
                 assert(lsp_is_null(0));
                 lsp_pop();
 
+                // Evaluate the value.
+                lsp_dup(2);
+                lsp_eval_tree();
+
                 // Rearrange the stack so that the environment is at the top,
                 // followed by the symbol and then the value.
                 lsp_store(3);
@@ -262,8 +285,7 @@ static void lsp_eval_inner(void) {
                 // Return NULL.
                 lsp_push_null();
                 return;
-            }
-            if (strcmp(sym, "lambda") == 0) {
+            case LSP_SYM_LAMBDA:
                 // Strip the `lambda` from the top of the stack.
                 lsp_pop();
 
@@ -274,40 +296,56 @@ static void lsp_eval_inner(void) {
                 // the stack.
                 lsp_cdr();
 
-                // TODO Find free variables.
-                // TODO Capture free variables from the environment.
+                // Copy the bindings of the free variables out of the
+                // environment, so that the closure does not keep anything
+                // else alive.
+                lsp_dup(0);
+                lsp_free_variables();
+                lsp_dup(2);
+                lsp_swp(1);
+                lsp_capture();
+                lsp_store(2);
+
+                // Find the names defined in the body once, rather than every
+                // time that the closure is called.
+                lsp_dup(0);
+                lsp_cdr();
+                lsp_defined_variables();
+                lsp_cons();
 
                 // Bind the function description closure.
-                lsp_push_op(lsp_op_eval_lambda);
+                lsp_push_op(lsp_op_walk_lambda);
                 lsp_cons();
 
                 // Bind the environment to create the runtime closure.
                 lsp_cons();
                 return;
-            }
-            if (strcmp(sym, "begin") == 0) {
+            case LSP_SYM_BEGIN:
                 // Strip the `begin` from the top of the stack and the
                 // beginning of the current expression.
                 lsp_pop();
                 lsp_swp(1);
                 lsp_cdr();
 
+                lsp_reserve(3);
                 lsp_push_null();
                 while (!lsp_is_null(1)) {
-                    lsp_pop();
-                    lsp_dup(0);
+                    lsp_pop_unchecked();
+                    lsp_dup_unchecked(0);
                     lsp_car();
-                    lsp_dup(2);
-                    lsp_eval();
-                    lsp_dup(1);
+                    lsp_dup_unchecked(2);
+                    lsp_eval_tree();
+                    lsp_dup_unchecked(1);
                     lsp_cdr();
-                    lsp_store(2);
+                    lsp_store_unchecked(2);
                 }
 
-                lsp_store(2);
-                lsp_pop();
+                lsp_store_unchecked(2);
+                lsp_pop_unchecked();
 
                 return;
+            default:
+                break;
             }
         }
         // Strip the unrecognised symbol from the top of the stack.
@@ -318,31 +356,36 @@ static void lsp_eval_inner(void) {
         while (!lsp_is_null(-1)) {
             length += 1;
 
+            // Each iteration leaves one more result on the stack, and needs
+            // space for two more references while it runs.
+            lsp_reserve(3);
+
             // Read the next item in the list.
-            lsp_dup(-1);
+            lsp_dup_unchecked(-1);
             lsp_car();
 
             // Remove it from the list.
-            lsp_dup(-1);
+            lsp_dup_unchecked(-1);
             lsp_cdr();
-            lsp_store(-1);
+            lsp_store_unchecked(-1);
 
             // Evaluate it in the current environment.
-            lsp_dup(-2);
-            lsp_eval();
+            lsp_dup_unchecked(-2);
+            lsp_eval_tree();
         }
 
         // Reverse the results on the stack, including the env and the empty
         // expression list.
+        lsp_reserve(1);
         for (int i = 0; i < (length + 2) / 2; i++) {
-            lsp_dup(-1 - i);
-            lsp_swp(i + 1);
-            lsp_store(-1 - i);
+            lsp_dup_unchecked(-1 - i);
+            lsp_swp_unchecked(i + 1);
+            lsp_store_unchecked(-1 - i);
         }
 
         // Pop the empty expression list and the env.
-        lsp_pop();
-        lsp_pop();
+        lsp_pop_unchecked();
+        lsp_pop_unchecked();
 
         lsp_call_inner();
     } else {
@@ -353,11 +396,13 @@ static void lsp_eval_inner(void) {
 }
 
 
-void lsp_eval(void) {
+void lsp_eval_tree(void) {
     lsp_fp_t rp = lsp_get_fp();
     lsp_shrink_frame(2);
 
+    lsp_profile_enter_form(1);
     lsp_eval_inner();
+    lsp_profile_leave_form();
 
     lsp_restore_fp(rp);
 }
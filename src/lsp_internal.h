@@ -0,0 +1,12 @@
+#pragma once
+
+/**
+ * Functions shared between the files that make up the library, which are not
+ * part of its public interface.
+ */
+
+/**
+ * Changes the version returned by `lsp_env_version`, invalidating every cached
+ * binding.  Must only be called by `lsp_define`.
+ */
+void lsp_env_changed(void);
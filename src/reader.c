@@ -1,310 +1,256 @@
 #include "lsp.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 #include <assert.h>
 
-static void lsp_parse_one(void);
 
+/**
+ * State of a parse in progress.  The source string stays on the stack at the
+ * bottom of the frame of `lsp_parse`, so that it is kept alive and can be
+ * found again if a collection moves it.
+ */
+typedef struct {
+    char const *source;
+    size_t cursor;
+} lsp_parser_t;
 
-static char lsp_parser_next(void) {
-    lsp_dup(0);
-    lsp_cdr();
-    int cursor = lsp_read_int(0);
-    lsp_pop();
+static void lsp_parse_one(lsp_parser_t *parser);
 
-    lsp_dup(0);
-    lsp_car();
-    const char *buffer = lsp_borrow_string(0);
-    char character = buffer[cursor];
-    lsp_pop();
 
-    return character;
+/**
+ * Character classes, used to decide what sort of token starts at a character
+ * without a chain of comparisons.
+ */
+enum {
+    LSP_CHAR_WHITESPACE = 1 << 0,
+    LSP_CHAR_DIGIT = 1 << 1,
+    LSP_CHAR_SYMBOL = 1 << 2,
+};
+
+#define _ 0
+#define W LSP_CHAR_WHITESPACE
+#define D LSP_CHAR_DIGIT
+#define S LSP_CHAR_SYMBOL
+
+static unsigned char const lsp_char_classes[256] = {
+    _, _, _, _, _, _, _, _, _, W, W, _, _, _, _, _,  // 0x00
+    _, _, _, _, _, _, _, _, _, _, _, _, _, _, _, _,  // 0x10
+    W, S, _, _, S, S, S, _, _, _, S, S, _, S, _, S,  // 0x20
+    D, D, D, D, D, D, D, D, D, D, S, _, S, S, S, S,  // 0x30
+    S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,  // 0x40
+    S, S, S, S, S, S, S, S, S, S, S, _, _, _, S, S,  // 0x50
+    _, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,  // 0x60
+    S, S, S, S, S, S, S, S, S, S, S, _, S, _, S, _,  // 0x70
+    // Everything from 0x80 up is zero.
+};
+
+#undef _
+#undef W
+#undef D
+#undef S
+
+static bool lsp_char_is(char character, unsigned char classes) {
+    return (lsp_char_classes[(unsigned char) character] & classes) != 0;
 }
 
 
-static char lsp_parser_lookahead(void) {
-    lsp_dup(0);
-    lsp_cdr();
-    int cursor = lsp_read_int(0);
-    lsp_pop();
-
-    lsp_dup(0);
-    lsp_car();
-    const char *buffer = lsp_borrow_string(0);
-    char character = buffer[cursor] == '\0' ? '\0': buffer[cursor + 1];
-    lsp_pop();
-
-    return character;
+/**
+ * Fetches the source string again after anything that could have triggered a
+ * garbage collection.
+ */
+static void lsp_parser_refresh(lsp_parser_t *parser) {
+    parser->source = lsp_borrow_string(-1);
 }
 
-
-static void lsp_parser_advance(void) {
-    lsp_dup(0);
-    lsp_cdr();
-    int cursor = lsp_read_int(0);
-    lsp_pop();
-
-    lsp_dup(0);
-    lsp_car();
-    const char *buffer = lsp_borrow_string(0);
-    char character = buffer[cursor];
-    lsp_pop();
-
-    if (character != '\0') {
-        lsp_push_int(cursor + 1);
-        lsp_swp(1);
-        lsp_set_cdr();
-    }
+static char lsp_parser_next(lsp_parser_t *parser) {
+    return parser->source[parser->cursor];
 }
 
-
-static void lsp_consume_whitespace(void) {
-    char next = lsp_parser_next();
-
-    while (next == ' ' || next == '\n' || next == '\t') {
-        lsp_dup(0);
-        lsp_parser_advance();
-
-        next = lsp_parser_next();
+static void lsp_parser_expect(lsp_parser_t *parser, char expected) {
+    if (parser->source[parser->cursor] != expected) {
+        abort();
     }
-
-    lsp_pop();
-}
-
-
-static bool lsp_is_symbol_character(char next) {
-    return (
-        (next >= 'a' && next <= 'z') ||
-        (next >= 'A' && next <= 'Z') ||
-        next == '+' || next == '-' || next == '*' ||
-        next == '/' || next == '%' ||
-        next == '<' || next == '=' || next == '>' ||
-        next == '~' || next == '!' ||
-        next == '$' || next == '@' ||
-        next == '&' || next == '|' || next == '^' ||
-        next == '?' ||
-        next == ':' || next == '_'
-    );
+    parser->cursor++;
 }
 
-
-static void lsp_parse_symbol(void) {
-    size_t buffer_size = 256;
-    char *buffer = (char *) malloc(buffer_size);
-    if (buffer == NULL) {
-        abort();
+static void lsp_consume_whitespace(lsp_parser_t *parser) {
+    char const *source = parser->source;
+    size_t cursor = parser->cursor;
+    while (lsp_char_is(source[cursor], LSP_CHAR_WHITESPACE)) {
+        cursor++;
     }
-    size_t cursor = 0;
+    parser->cursor = cursor;
+}
 
-    char next = lsp_parser_next();
 
-    while (lsp_is_symbol_character(next)) {
-        if (cursor == buffer_size - 2) {
-            buffer_size += buffer_size / 2;
-            buffer = realloc(buffer, buffer_size);
-            if (buffer == NULL) {
-                abort();
-            }
-        }
-
-        buffer[cursor] = next;
+static void lsp_parse_symbol(lsp_parser_t *parser) {
+    char const *source = parser->source;
+    size_t start = parser->cursor;
+    size_t cursor = start;
+    while (lsp_char_is(source[cursor], LSP_CHAR_SYMBOL)) {
         cursor++;
-
-        lsp_dup(-1);
-        lsp_parser_advance();
-
-        lsp_dup(-1);
-        next = lsp_parser_next();
-        lsp_pop();
     }
-    lsp_pop();
-
-    buffer[cursor] = '\0';
+    parser->cursor = cursor;
 
-    lsp_push_symbol(buffer);
-
-    free(buffer);
+    // Interning does not touch the heap, so the name can be read straight out
+    // of the source.
+    lsp_push_symbol_id(lsp_intern_length(source + start, cursor - start));
 }
 
 
-static void lsp_parse_string(void) {
-    size_t buffer_size = 256;
-    char * buffer = (char *) malloc(buffer_size);
-    if (buffer == NULL) {
-        abort();
+/**
+ * Strings shorter than this are unescaped into a buffer on the C stack rather
+ * than one allocated for them.
+ */
+#define LSP_PARSER_BUFFER_SIZE 256
+
+static char lsp_parse_escape(char escaped) {
+    switch (escaped) {
+        case 'a':
+            return '\a';
+        case 'f':
+            return '\f';
+        case 'n':
+            return '\n';
+        case 'r':
+            return '\r';
+        case 't':
+            return '\t';
+        case '\\':
+            return '\\';
+        case '\'':
+            return '\'';
+        case '\"':
+            return '\"';
+        case 'x':
+            abort();  // Not implemented.
+        default:
+            abort();  // Not supported.
     }
-    size_t cursor = 0;
-
-    lsp_dup(0);
-    lsp_parser_advance();
+}
 
-    while (true) {
-        char next = lsp_parser_next();
+static void lsp_parse_string(lsp_parser_t *parser) {
+    lsp_parser_expect(parser, '"');
 
-        if (next == '\0') {
+    // Find the closing quote first so that the unescaped string can be
+    // written into a buffer of the right size in one pass.
+    char const *source = parser->source;
+    size_t start = parser->cursor;
+    size_t end = start;
+    while (source[end] != '"') {
+        if (source[end] == '\0') {
             // Unexpected end of string.
             abort();
         }
-
-        if (cursor == buffer_size - 2) {
-            buffer_size += buffer_size / 2;
-            buffer = realloc(buffer, buffer_size);
-            if (buffer == NULL) {
+        if (source[end] == '\\') {
+            end++;
+            if (source[end] == '\0') {
                 abort();
             }
         }
+        end++;
+    }
 
-        if (next == '"') {
-            buffer[cursor] = '\0';
-
-            lsp_dup(0);
-            lsp_parser_advance();
-            break;
+    char small[LSP_PARSER_BUFFER_SIZE];
+    char *buffer = small;
+    if (end - start >= LSP_PARSER_BUFFER_SIZE) {
+        buffer = (char *) malloc(end - start + 1);
+        if (buffer == NULL) {
+            abort();
         }
+    }
 
+    size_t length = 0;
+    for (size_t cursor = start; cursor < end; cursor++) {
+        char next = source[cursor];
         if (next == '\\') {
-            lsp_dup(0);
-            lsp_parser_advance();
-
-            next = lsp_parser_next();
-
-            switch (next) {
-                case 'a':
-                    next = '\a';
-                    break;
-                case 'f':
-                    next = '\f';
-                    break;
-                case 'n':
-                    next = '\n';
-                    break;
-                case 'r':
-                    next = '\r';
-                    break;
-                case 't':
-                    next = '\t';
-                    break;
-                case '\\':
-                    next = '\\';
-                    break;
-                case '\'':
-                    next = '\'';
-                    break;
-                case '\"':
-                    next = '\"';
-                    break;
-                case 'x':
-                    abort();  // Not implemented.
-                default:
-                    abort();  // Not supported.
-            }
+            cursor++;
+            next = lsp_parse_escape(source[cursor]);
         }
-
-        buffer[cursor] = next;
-        cursor++;
-
-        lsp_dup(0);
-        lsp_parser_advance();
+        buffer[length] = next;
+        length++;
     }
-    lsp_pop();
+    buffer[length] = '\0';
+    parser->cursor = end + 1;
 
     lsp_push_string(buffer);
+    lsp_parser_refresh(parser);
 
-    free(buffer);
+    if (buffer != small) {
+        free(buffer);
+    }
 }
 
 
-static void lsp_parse_number(void) {
-    bool negative = false;
-    int accumulator = 0;
+static void lsp_parse_number(lsp_parser_t *parser) {
+    char const *source = parser->source;
+    size_t cursor = parser->cursor;
 
-    char next = lsp_parser_next();
-    if (next == '-') {
+    bool negative = false;
+    if (source[cursor] == '-') {
         negative = true;
-
-        lsp_dup(0);
-        lsp_parser_advance();
-
-        next = lsp_parser_next();
+        cursor++;
     }
 
-    while (next >= '0' && next <= '9') {
+    lsp_int_t accumulator = 0;
+    while (lsp_char_is(source[cursor], LSP_CHAR_DIGIT)) {
         accumulator *= 10;
-        accumulator += (int) (next - '0');
-
-        lsp_dup(0);
-        lsp_parser_advance();
-
-        next = lsp_parser_next();
+        accumulator += (lsp_int_t) (source[cursor] - '0');
+        cursor++;
     }
-    lsp_pop();
+    parser->cursor = cursor;
 
     lsp_push_int(negative ? -accumulator : accumulator);
 }
 
 
-static void lsp_parse_list(void) {
+static void lsp_parse_list(lsp_parser_t *parser) {
     // Cons cell where the cdr points to the head of the list, and the car is
     // ignored.
     lsp_push_cons();
+    lsp_parser_refresh(parser);
 
     // Reference to the tail of the list.
     lsp_dup(0);
 
     // Consume the leading '('.
-    lsp_dup(-1);
-    char next = lsp_parser_next();
-    assert(next == '(');
-    lsp_parser_advance();
+    lsp_parser_expect(parser, '(');
 
     while (true) {
-        lsp_dup(-1);
-        lsp_consume_whitespace();
+        lsp_consume_whitespace(parser);
 
-        lsp_dup(-1);
-        char next = lsp_parser_next();
-        lsp_pop();
+        char next = lsp_parser_next(parser);
 
         if (next == ')') {
-            lsp_dup(-1);
-            lsp_parser_advance();
-
+            parser->cursor++;
             break;
         }
 
         if (next == '.') {
-            lsp_dup(-1);
-            lsp_parser_advance();
+            parser->cursor++;
+            lsp_consume_whitespace(parser);
 
-            lsp_dup(-1);
-            lsp_consume_whitespace();
-
-            lsp_dup(-1);
-            lsp_parse_one();
+            lsp_parse_one(parser);
 
             // Insert the value following the dot as the cdr of the tail.
             lsp_dup(1);
             lsp_set_cdr();
 
-            lsp_dup(-1);
-            lsp_consume_whitespace();
-
-            lsp_dup(-1);
-            assert(lsp_parser_next() == ')');
-            lsp_parser_advance();
-
+            lsp_consume_whitespace(parser);
+            lsp_parser_expect(parser, ')');
             break;
         }
 
-        lsp_dup(-1);
-        lsp_parse_one();
+        lsp_parse_one(parser);
 
         // Create a new tail pair.
         lsp_push_null();
         lsp_swp(1);
 
         lsp_cons();
+        lsp_parser_refresh(parser);
 
         // Insert it as the cdr of the current tail.
         lsp_dup(1);
@@ -317,26 +263,27 @@ static void lsp_parse_list(void) {
     // Discard the tail reference.
     lsp_pop();
 
-    // Strip the dummy head and save the rest of the list.
+    // Strip the dummy head.
     lsp_cdr();
-    lsp_store(1);
 }
 
-static void lsp_parse_one(void) {
-    char next = lsp_parser_next();
-    char lookahead = lsp_parser_lookahead();
+static void lsp_parse_one(lsp_parser_t *parser) {
+    char next = lsp_parser_next(parser);
 
     if (next == '(') {
-        lsp_parse_list();
+        lsp_parse_list(parser);
     } else if (
-        (next >= '0' && next <= '9') ||
-        (next == '-' && lookahead >= '0' && lookahead <= '9')
+        lsp_char_is(next, LSP_CHAR_DIGIT) ||
+        (
+            next == '-' &&
+            lsp_char_is(parser->source[parser->cursor + 1], LSP_CHAR_DIGIT)
+        )
     ) {
-        lsp_parse_number();
+        lsp_parse_number(parser);
     } else if (next == '"') {
-        lsp_parse_string();
-    } else if (lsp_is_symbol_character(next)) {
-        lsp_parse_symbol();
+        lsp_parse_string(parser);
+    } else if (lsp_char_is(next, LSP_CHAR_SYMBOL)) {
+        lsp_parse_symbol(parser);
     } else {
         assert(false);
     }
@@ -351,47 +298,29 @@ void lsp_parse(void) {
     lsp_fp_t rp = lsp_get_fp();
     lsp_shrink_frame(1);
 
-    lsp_push_int(0);
-    lsp_swp(1);
-    lsp_cons();
-
-    // The next item on the stack, after the cursor, is a list, ordered inner
-    // to outer, of pointers to the last cons cell in each list body.  This is
-    // the parser stack.
-    lsp_push_null();
+    // The parser scans the source directly, and only goes through the stack
+    // to build the objects that it reads.
+    lsp_parser_t parser = {.source = lsp_borrow_string(-1), .cursor = 0};
 
-    // The second item on the stack is a reversed list of elements in the
-    // body of the current list in the parse stack.
+    // Reversed list of the expressions read so far.
     lsp_push_null();
 
-    // At the beginning of parsing there are no parent contexts so the parse
-    // stack is empty.  If an opening bracket is encountered, the current body
-    // is pushed on to the parse stack and a new body is started to parse the
-    // nested list.  On hitting the closing bracket, the body list will be
-    // reversed and added to the containing list in the parse stack.
-
     while (true) {
-        lsp_dup(2);
-        lsp_consume_whitespace();
-
-        lsp_dup(2);
-        char next = lsp_parser_next();
-        lsp_pop();
+        lsp_consume_whitespace(&parser);
 
-        if (next == '\0') {
+        if (lsp_parser_next(&parser) == '\0') {
             // Put the body list back in the right order and return it.
             lsp_reverse();
             lsp_store(-1);
-            lsp_pop();
             lsp_restore_fp(rp);
             return;
         }
 
-        lsp_dup(-1);
-        lsp_parse_one();
+        lsp_parse_one(&parser);
 
         // Replace the body with a new list containing the new expression as
         // its first element.
         lsp_cons();
+        lsp_parser_refresh(&parser);
     }
 }
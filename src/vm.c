@@ -1,8 +1,18 @@
 #include "lsp.h"
+#include "lsp_internal.h"
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <assert.h>
 
 typedef enum {
@@ -12,6 +22,9 @@ typedef enum {
     LSP_TYPE_SYM,
     LSP_TYPE_STR,
     LSP_TYPE_OP,
+    LSP_TYPE_VEC,
+    LSP_TYPE_TABLE,
+    LSP_TYPE_CODE,
 } lsp_type_t;
 
 
@@ -21,14 +34,57 @@ typedef enum {
 typedef unsigned int lsp_offset_t;
 
 /**
+ * Identifies what a reference points to.  Integers and symbols are stored
+ * directly in the reference and do not point into either heap.
+ */
+typedef enum {
+    LSP_REF_DATA = 0,
+    LSP_REF_CONS,
+    LSP_REF_INT,
+    LSP_REF_SYM,
+} lsp_ref_tag_t;
+
+/**
+ * A reference to either a cons cell, a block of memory, or an immediate
+ * integer or symbol, packed into a single 64 bit word.  The tag is kept in the
+ * bottom two bits and the payload in the rest, so integers are 62 bits wide.
  *
- * A reference to either a cons cell or block of memory.
+ * A reference is the same size as a word on the data heap, so vectors and
+ * tables hold one reference per word, and a cons cell takes 16 bytes.
  */
 typedef struct {
-    bool is_cons : 1;
-    lsp_offset_t offset : 31;
+    uint64_t bits;
 } lsp_ref_t;
 
+#define LSP_REF_TAG_BITS 2
+#define LSP_REF_TAG_MASK ((uint64_t) 0x3)
+
+static inline lsp_ref_t lsp_ref_make(lsp_ref_tag_t tag, uint64_t payload) {
+    lsp_ref_t ref = {(payload << LSP_REF_TAG_BITS) | (uint64_t) tag};
+    return ref;
+}
+
+static inline lsp_ref_t lsp_ref_make_int(lsp_int_t value) {
+    return lsp_ref_make(LSP_REF_INT, (uint64_t) value);
+}
+
+static inline lsp_ref_tag_t lsp_ref_tag(lsp_ref_t ref) {
+    return (lsp_ref_tag_t) (ref.bits & LSP_REF_TAG_MASK);
+}
+
+static inline lsp_offset_t lsp_ref_offset(lsp_ref_t ref) {
+    return (lsp_offset_t) (ref.bits >> LSP_REF_TAG_BITS);
+}
+
+static inline lsp_int_t lsp_ref_int(lsp_ref_t ref) {
+    // Relies on right shifts of negative numbers being arithmetic.
+    return (lsp_int_t) ref.bits >> LSP_REF_TAG_BITS;
+}
+
+static inline lsp_sym_t lsp_ref_sym(lsp_ref_t ref) {
+    return (lsp_sym_t) (ref.bits >> LSP_REF_TAG_BITS);
+}
+
 
 /**
  * Pair structure that is stored on the cons heap and is used for building
@@ -50,10 +106,20 @@ typedef struct {
 } lsp_header_t;
 
 
-static const lsp_ref_t LSP_NULL = {
-    .is_cons = false,
-    .offset = 0,
-};
+/**
+ * Returns true if objects of `type` on the data heap consist of nothing but
+ * references, which the collector must trace.
+ */
+static inline bool lsp_type_has_refs(lsp_type_t type) {
+    return type == LSP_TYPE_VEC || type == LSP_TYPE_TABLE;
+}
+
+
+/**
+ * Null is a reference to offset zero of the data heap, which is reserved, and
+ * so is represented by a word of zeros.
+ */
+static const lsp_ref_t LSP_NULL = {0};
 
 
 /**
@@ -61,25 +127,33 @@ static const lsp_ref_t LSP_NULL = {
  *
  * `cons_heap` is a pointer to the root of the heap.  `cons_heap_ptr` is the
  * offset of the next unused cons cell.
+ *
+ * Address space for `cons_heap_max` cells is reserved when the VM is
+ * initialised, but only the first `cons_heap_size` cells are backed by memory.
+ * The committed range is grown, along with the bookkeeping arrays that are
+ * sized to match it, as `cons_heap_ptr` advances.
  */
-#define CONS_HEAP_MAX 1048576  // 0x80000000;
-static lsp_cons_t *cons_heap;
-static lsp_offset_t cons_heap_ptr;
+#define CONS_HEAP_MAX 0x80000000u
+#define CONS_HEAP_INITIAL_DEFAULT 0x10000
+#define CONS_HEAP_MAX_DEFAULT 0x10000000
 
 
 /**
  * The data heap contains up to 2^31 eight byte blocks for storing arbitrary
  * plain data.
  *
- * References to this data must only be stored on either the reference stack or
- * the cons heap.
+ * References to this data must only be stored on the reference stack, the cons
+ * heap, or in a vector or table.  Vectors and tables are the only objects on
+ * the data heap that contain references, and they contain nothing else.  Each
+ * reference takes up exactly one block, so the size in the header of a vector
+ * is also its length.
  *
  * `data_heap` is a pointer to the root of the heap.  `data_heap_ptr` is equal
  * to the number of 8 byte blocks before the next available blocks.
  */
-#define DATA_HEAP_MAX 1048576  //  0x80000000;
-static char *data_heap;
-static lsp_offset_t data_heap_ptr;
+#define DATA_HEAP_MAX 0x80000000u
+#define DATA_HEAP_INITIAL_DEFAULT 0x10000
+#define DATA_HEAP_MAX_DEFAULT 0x10000000
 
 
 /**
@@ -87,62 +161,399 @@ static lsp_offset_t data_heap_ptr;
  * that is used as working memory for the process.
  */
 #define REF_STACK_MAX 0x100000
-static lsp_ref_t *ref_stack;
-static int ref_stack_ptr;
-static int ref_frame_ptr;
 
 
 /**
- * Arrays used for bookkeeping during garbage collection.
+ * Arrays with one entry for each cons cell or data word are reserved for the
+ * maximum size of the heap, and committed as the heap grows.  Bitsets have one
+ * extra word so that a completely full heap can be scanned a word at a time.
+ * The stacks used to trace the heap have one entry for each cons cell and each
+ * data word, as every vector takes up at least one word.
+ */
+#define LSP_BITSET_WORDS(size) ((size) / 32 + 1)
+#define LSP_TRACE_STACK_SIZE(ncells, nwords) \
+    (((size_t) (ncells) + (nwords)) * sizeof(lsp_ref_t))
+
+/**
+ * Generations.
+ *
+ * Both heaps are split into an old generation, below `cons_heap_old_ptr` and
+ * `data_heap_old_ptr`, and a nursery containing everything allocated since the
+ * last collection.  Nursery collections only mark and compact the nursery, and
+ * promote everything that survives into the old generation.
+ *
+ * References from old cons cells and vectors into the nursery are recorded in
+ * the remembered set by the write barrier in `lsp_set_car`, `lsp_set_cdr` and
+ * `lsp_vector_set` so that they can be treated as roots.
+ * `cons_heap_remembered_bitset` and `data_heap_remembered_bitset` have one bit
+ * for each cons cell and data word, set if the object starting there is
+ * already in the remembered set.  If the remembered set fills up, the next
+ * collection is upgraded to a full collection, which doesn't need it.
+ */
+#define CONS_NURSERY_SIZE 0x10000
+#define DATA_NURSERY_SIZE 0x10000
+
+#define REMEMBERED_SET_MAX 0x10000
+
+/**
+ * Incremental marking.
+ *
+ * If a pause budget has been set, full collections are split into a marking
+ * phase that is run in slices between allocations, and a final pause in which
+ * the heaps are compacted.  Each slice runs for at most `gc_pause_budget`
+ * nanoseconds, and a slice is run once every `GC_SLICE_INTERVAL` allocations.
+ *
+ * Marking traces a snapshot of the heap taken when it started.  Everything
+ * at or above `cons_heap_mark_ptr` and `data_heap_mark_ptr` was allocated after
+ * the snapshot and is implicitly live.  The write barrier shades the value
+ * being overwritten so that nothing reachable in the snapshot can be hidden
+ * from the marker.
+ *
+ * Cells and vectors waiting to be traced are kept on `grey_stack`, which is
+ * separate from `mark_stack` so that nursery collections can run while marking
+ * is in progress.  Neither the grey stack nor the mark bits below the mark
+ * pointers refer to anything in the nursery, so they are not disturbed.
+ */
+#define GC_SLICE_INTERVAL 256
+
+/**
+ * Parallel marking.
+ *
+ * If the VM was initialised with more than one GC thread then full
+ * collections are marked in parallel by a pool of helper threads and the
+ * thread that triggered the collection.  Each worker traces cells and vectors
+ * from its own mark stack, which no other thread touches, so pushing and
+ * popping take no locks.  Whenever its shared buffer is empty and it has work
+ * to spare, a worker moves the oldest entries on its stack into the buffer,
+ * and workers that run dry steal half of another worker's buffer.  Only the
+ * buffer is protected by the lock.  Mark bits are set with atomic operations
+ * so that each object is pushed exactly once.  Marking finishes when all
+ * workers are idle at the same time.
+ *
+ * Each worker's stack is large enough to hold every cell and vector in the
+ * heaps, so it can never overflow.  Entries below `stack_base` have been
+ * moved to the shared buffer, and the stack is rewound once it is empty.
+ */
+#define GC_SHARED_SIZE 256
+
+typedef struct {
+    lsp_ref_t *stack;
+    size_t stack_base;
+    size_t stack_ptr;
+
+    pthread_mutex_t lock;
+    lsp_ref_t shared[GC_SHARED_SIZE];
+    size_t shared_ptr;
+
+    // The VM that the worker belongs to, and for helpers, the thread that
+    // runs it.
+    lsp_vm_t *vm;
+    pthread_t thread;
+} lsp_gc_worker_t;
+
+/**
+ * Parallel compaction.
+ *
+ * Full collections with more than one GC thread split each step of compaction
+ * between the workers in the pool.  The offset caches are built with a two
+ * pass prefix sum: each worker first counts the marked bits in an equal share
+ * of the bitset, and then fills in the cache for its share starting from the
+ * sum of the counts before it.
+ *
+ * Both heaps are then split into blocks of `GC_BLOCK_SIZE` entries, which are
+ * claimed by workers in order.  Because the destination of every entry is
+ * below its source, a block can only overwrite entries in itself or in earlier
+ * blocks, and so can be moved as soon as every earlier block that overlaps its
+ * destination has been moved.  Finally, the references in both heaps and on
+ * the reference stack are rewritten in equal shares.  Each worker finds the
+ * first object in its share of the data heap from a table of the first header
+ * in each block, which is recorded when the marks are expanded, and so only
+ * walks the headers in its own share.
+ *
+ * Each entry ends up in exactly the same place as it would if compacted
+ * serially.
+ */
+#define GC_BLOCK_SIZE 0x1000
+#define GC_BLOCK_COUNT(size) ((size) / GC_BLOCK_SIZE + 1)
+
+/**
+ * Collection scheduling.
+ *
+ * Rather than collecting on every allocation, each heap is given an allocation
+ * budget after every collection.  The budget is proportional to the amount of
+ * data that survived the collection, scaled by `gc_growth_factor`, so that the
+ * cost of each collection is amortised over a number of allocations that grows
+ * with the size of the live set.  It never drops below the `*_BUDGET_MIN`
+ * constants so that small heaps are not collected constantly.
+ *
+ * `cons_heap_limit` and `data_heap_limit` are the values of the heap pointers
+ * at which the next collection will be triggered.  They are clamped to the size
+ * of the heap, so the last collection before running out of memory is always
+ * forced.
+ */
+#define CONS_HEAP_BUDGET_MIN 0x10000
+#define DATA_HEAP_BUDGET_MIN 0x10000
+#define GC_GROWTH_FACTOR_DEFAULT 1.0
+
+/**
+ * Symbol table.
+ *
+ * Every symbol is interned when it is first pushed and is afterwards
+ * represented by its index in `symbol_names`, so symbols with the same name
+ * always compare equal by id.  Names are owned by the table rather than by
+ * either heap and are only freed along with the VM, which makes the table a
+ * permanent root that the collector never needs to visit.
+ *
+ * `symbol_index` is an open addressed hash table, with linear probing, that
+ * maps names to one plus their id.  Empty slots are zero.  It is kept at most
+ * half full.
  */
+#define SYMBOL_INDEX_MIN 0x100
 
 /**
- * A stack of offsets into the cons heap.  This is used to keep track of cons
- * cells that need to be visited by the garbage collector.
+ * Allocation profiling.
+ *
+ * When profiling is enabled, every `profile_interval`th allocation is
+ * attributed to the innermost form being evaluated and the builtin that it is
+ * calling.  The forms are kept on `profile_forms`, which the collector treats
+ * as a root so that a form can still be rendered after it has been moved.
+ * Builtins are identified by op pointer, which collections don't affect.  The
+ * op that was current when each form was entered is kept in
+ * `profile_saved_ops` so that it can be restored when the form is left.
+ *
+ * Samples are aggregated in `profile_sites`, keyed by the rendered form and
+ * the op.  Each sample stands for `profile_interval` allocations.
  */
-// TODO Work out real limit.  Should be approximately half CONS_HEAP_MAX;
-#define MARK_STACK_MAX CONS_HEAP_MAX
-static lsp_ref_t *mark_stack;
-static size_t mark_stack_ptr;
+#define PROFILE_FORM_MAX 72
+#define PROFILE_RENDER_DEPTH 3
+
+typedef struct {
+    char *form;
+    lsp_op_t op;
+    size_t allocations;
+    size_t bytes;
+} lsp_profile_site_t;
 
 /**
- * A bitset with one bit for each pair in the cons heap.  Will be updated by
- * the garbage collector, which will set the corresponding bit for each
- * reachable cons cell.
+ * All of the state belonging to a single VM.  The sections above describe how
+ * each group of fields is used.
  */
-#define CONS_HEAP_MARK_BITSET_MAX (CONS_HEAP_MAX / 32)
-static uint32_t *cons_heap_mark_bitset;
+struct lsp_vm {
+    // The heaps and the reference stack.
+    lsp_cons_t *cons_heap;
+    lsp_offset_t cons_heap_ptr;
+    lsp_offset_t cons_heap_size;
+    lsp_offset_t cons_heap_max;
+    char *data_heap;
+    lsp_offset_t data_heap_ptr;
+    lsp_offset_t data_heap_size;
+    lsp_offset_t data_heap_max;
+    lsp_ref_t *ref_stack;
+    int ref_stack_ptr;
+    int ref_frame_ptr;
+
+    /**
+     * A stack of references to cons cells and vectors.  This is used to keep
+     * track of objects that need to be visited by the garbage collector.
+     * Objects are only pushed when they are first marked, so it never needs to
+     * hold more entries than there are cells and vectors in the heaps.
+     */
+    lsp_ref_t *mark_stack;
+    size_t mark_stack_ptr;
+
+    /**
+     * A bitset with one bit for each pair in the cons heap.  Will be updated
+     * by the garbage collector, which will set the corresponding bit for each
+     * reachable cons cell.
+     */
+    uint32_t *cons_heap_mark_bitset;
+
+    /**
+     * A bitset with one bit for each word in the data heap.  The garbage
+     * collector marks each reachable object by setting only the bit for its
+     * header, so that marking costs the same for every object regardless of
+     * its size.  Before compacting, the marks are extended to cover every word
+     * in each object using the sizes stored in the headers.
+     */
+    uint32_t *data_heap_mark_bitset;
+
+    /**
+     * For each word in the `cons_heap_mark_bitset`, contains a cache of the
+     * sum of the popcount of all preceding words.  The offset of a cons cell
+     * in the heap after compaction is equal to the number of the bits that are
+     * set before it.
+     */
+    uint32_t *cons_heap_offset_cache;
+
+    /**
+     * For each word in the `data_heap_mark_bitset`, contains a cache of the
+     * sum of the popcount of all preceding words.  The offset of a word in the
+     * data heap after compaction is equal to the number of the bits that are
+     * set before it.
+     */
+    uint32_t *data_heap_offset_cache;
+
+    // Generations.
+    lsp_offset_t cons_heap_old_ptr;
+    lsp_offset_t data_heap_old_ptr;
+    lsp_offset_t cons_nursery_limit;
+    lsp_offset_t data_nursery_limit;
+    lsp_ref_t *remembered_set;
+    size_t remembered_set_ptr;
+    bool remembered_set_overflow;
+    uint32_t *cons_heap_remembered_bitset;
+    uint32_t *data_heap_remembered_bitset;
+
+    // Incremental marking.
+    bool gc_marking;
+    long gc_pause_budget;
+    unsigned int gc_slice_countdown;
+    lsp_offset_t cons_heap_mark_ptr;
+    lsp_offset_t data_heap_mark_ptr;
+    lsp_ref_t *grey_stack;
+    size_t grey_stack_ptr;
+
+    // Parallel marking and compaction.
+    unsigned int gc_threads;
+    lsp_gc_worker_t *gc_workers;
+    unsigned int gc_idle_workers;
+    uint32_t *gc_cons_chunk_sums;
+    uint32_t *gc_data_chunk_sums;
+    unsigned int gc_next_block;
+    unsigned char *cons_heap_block_done;
+    unsigned char *data_heap_block_done;
+
+    /**
+     * For each block of `GC_BLOCK_SIZE` words in the data heap, the offset
+     * that the first object starting in or after the block will have once the
+     * heap has been compacted.  Filled in when the marks are expanded, so that
+     * the references in a share of the compacted heap can be rewritten without
+     * walking the objects before it.
+     */
+    lsp_offset_t *data_heap_first_header;
+
+    /**
+     * The pool of helper threads.  `gc_pool_generation` is incremented each
+     * time a new task is started, and `gc_pool_running` counts the helpers
+     * that have yet to finish it.  Helpers exit once `gc_pool_stopping` is
+     * set.
+     */
+    pthread_mutex_t gc_pool_lock;
+    pthread_cond_t gc_pool_start;
+    pthread_cond_t gc_pool_done;
+    void (*gc_pool_task)(unsigned int worker);
+    unsigned long gc_pool_generation;
+    unsigned int gc_pool_running;
+    bool gc_pool_stopping;
+
+    // Collection scheduling.
+    double gc_growth_factor;
+    lsp_offset_t cons_heap_limit;
+    lsp_offset_t data_heap_limit;
+
+    // Symbol table.
+    char **symbol_names;
+    lsp_sym_t symbol_count;
+    lsp_sym_t symbol_capacity;
+    lsp_sym_t *symbol_index;
+    lsp_sym_t symbol_index_capacity;
+
+    // Counters and timings reported by `lsp_stats_get`.
+    lsp_vm_stats_t stats;
+
+    // Incremented by every definition, to invalidate cached bindings.
+    unsigned int env_version;
+
+    // Allocation profiling.
+    unsigned int profile_interval;
+    unsigned int profile_countdown;
+    lsp_ref_t *profile_forms;
+    lsp_op_t *profile_saved_ops;
+    int profile_depth;
+    lsp_op_t profile_op;
+    lsp_profile_site_t *profile_sites;
+    size_t profile_site_count;
+    size_t profile_site_capacity;
+};
 
 /**
- * A bitset with one bit for each word in the data heap.  Bits corresponding to
- * reachable words will be set to one by the garbage collector.
+ * The VM that the calling thread is currently running.  Every function in the
+ * public API operates on this VM, so separate threads can run independent VMs
+ * without any locking.
  */
-#define DATA_HEAP_MARK_BITSET_MAX (DATA_HEAP_MAX / 32)
-static uint32_t *data_heap_mark_bitset;
+static _Thread_local lsp_vm_t *vm;
 
 /**
- * For each block of 8 bytes in the `cons_heap_mark_bitset`, contains a cache
- * of the sum of the popcount of all preceding bytes.  The offset of a cons
- * cell in the heap after compaction is equal to the number of the bits that
- * are set before it.
+ * Names of the symbols that are interned when the VM is initialised, in the
+ * order of their ids.
  */
-#define CONS_HEAP_OFFSET_CACHE_MAX CONS_HEAP_MARK_BITSET_MAX
-static uint32_t *cons_heap_offset_cache;
+static char const *const symbol_builtin_names[] = {
+    [LSP_SYM_IF] = "if",
+    [LSP_SYM_QUOTE] = "quote",
+    [LSP_SYM_DEFINE] = "define",
+    [LSP_SYM_SET] = "set!",
+    [LSP_SYM_LAMBDA] = "lambda",
+    [LSP_SYM_BEGIN] = "begin",
+};
 
 /**
- * For each block of ??? bytes in the `data_heap_mark_bitset`, contains a cache
- * of the sum of the popcount of all preceding bytes.  The offset of a word in
- * the data heap after compaction is equal to the number of the bits that are
- * set before it.
+ * Op registry.
+ *
+ * Ops are stored on the data heap as raw function pointers, which are only
+ * meaningful within a single process.  Images replace each pointer with the
+ * name it was registered under so that it can be resolved again when the image
+ * is loaded.  `op_builtins` covers the ops provided by the interpreter itself;
+ * anything else has to be added with `lsp_register_op`.  The registry belongs
+ * to the process rather than to any one VM, so it is shared between threads
+ * and guarded by `op_registry_lock`.
  */
-#define DATA_HEAP_OFFSET_CACHE_MAX DATA_HEAP_MARK_BITSET_MAX
-static uint32_t *data_heap_offset_cache;
+typedef struct {
+    char const *name;
+    lsp_op_t op;
+} lsp_op_entry_t;
+
+void lsp_op_eval_lambda(void);
+void lsp_op_walk_lambda(void);
+
+static lsp_op_entry_t const op_builtins[] = {
+    {"int-add", lsp_int_add},
+    {"int-sub", lsp_int_sub},
+    {"int-mul", lsp_int_mul},
+    {"int-div", lsp_int_div},
+    {"cons", lsp_cons},
+    {"car", lsp_car},
+    {"cdr", lsp_cdr},
+    {"set-car!", lsp_set_car},
+    {"set-cdr!", lsp_set_cdr},
+    {"map", lsp_map},
+    {"fold", lsp_fold},
+    {"reverse", lsp_reverse},
+    {"eval-lambda", lsp_op_eval_lambda},
+    {"walk-lambda", lsp_op_walk_lambda},
+    {"vector", lsp_vector},
+    {"vector-ref", lsp_vector_ref},
+    {"vector-set!", lsp_op_vector_set},
+    {"vector-length", lsp_vector_length},
+    {"vector-map", lsp_vector_map},
+    {"make-table", lsp_push_table},
+    {"table-ref", lsp_table_ref},
+    {"table-set!", lsp_op_table_set},
+    {"table-delete!", lsp_op_table_delete},
+    {"table-count", lsp_table_count},
+    {"vm-stats", lsp_vm_stats},
+};
+
+static pthread_mutex_t op_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static lsp_op_entry_t *op_registry;
+static size_t op_registry_count;
+static size_t op_registry_capacity;
 
 /**
  * Internal forward declarations.
  */
 static lsp_cons_t *lsp_heap_get_cons(lsp_ref_t ref);
 static lsp_header_t *lsp_heap_get_header(lsp_ref_t ref);
+static lsp_header_t *lsp_heap_get_header_at(lsp_offset_t offset);
 static lsp_type_t lsp_heap_get_type(lsp_ref_t ref);
 static char *lsp_heap_get_data(lsp_ref_t ref);
 static lsp_ref_t lsp_heap_alloc_null(void);
@@ -152,289 +563,2830 @@ static void lsp_push_ref(lsp_ref_t expr);
 static lsp_ref_t lsp_get_at_offset(int offset);
 static void lsp_put_at_offset(lsp_ref_t value, int offset);
 static void lsp_push_null_terminated(lsp_type_t type, char const *value);
+static uint32_t lsp_symbol_hash(char const *name, size_t length);
 
 
 static int lsp_popcount(uint32_t x) {
+#ifdef __POPCNT__
     return __builtin_popcount(x);
+#else
+    // Without a popcount instruction the builtin becomes a library call, which
+    // prevents the loops that build the offset caches from being vectorised.
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0f0f0f0f;
+    x = x + (x >> 8);
+    x = x + (x >> 16);
+    return x & 0x3f;
+#endif
 }
 
-void lsp_vm_init(void) {
-    // TODO This doesn't work if overcommit is disabled.
-    // Block size times maximum index.
-    cons_heap = (lsp_cons_t *) malloc(CONS_HEAP_MAX * sizeof(lsp_cons_t));
-    assert(cons_heap != NULL);
-    cons_heap_ptr = 0;
-
-    data_heap = (char *) malloc(DATA_HEAP_MAX * 8);
-    assert(data_heap != NULL);
-    data_heap_ptr = 0;
+static int lsp_ctz(uint32_t x) {
+    return __builtin_ctz(x);
+}
 
-    ref_stack = (lsp_ref_t *) malloc(REF_STACK_MAX * sizeof(lsp_ref_t));
-    assert(ref_stack != NULL);
-    ref_stack_ptr = 0;
-    ref_frame_ptr = 0;
+static void *lsp_gc_internal_helper(void *arg);
 
-    mark_stack = (lsp_ref_t *) malloc(MARK_STACK_MAX * sizeof(lsp_ref_t));
-    assert(mark_stack != NULL);
-    mark_stack_ptr = 0;
+void lsp_vm_init(void) {
+    lsp_vm_config_t config = {
+        .gc_threads = 1,
+    };
+    lsp_vm_init_with_config(&config);
+}
 
-    cons_heap_offset_cache = (uint32_t *) malloc(
-        CONS_HEAP_OFFSET_CACHE_MAX * sizeof(uint32_t)
+/**
+ * Reserves address space for `size` bytes without committing any memory to
+ * back it.  Touching the range will fault until it has been committed using
+ * `lsp_vm_internal_commit`.
+ */
+static void *lsp_vm_internal_reserve(size_t size) {
+    void *base = mmap(
+        NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1, 0
     );
-    assert(cons_heap_offset_cache != NULL);
+    assert(base != MAP_FAILED);
+    return base;
+}
 
-    data_heap_offset_cache = (uint32_t *) malloc(
-        DATA_HEAP_OFFSET_CACHE_MAX * sizeof(uint32_t)
-    );
-    assert(data_heap_offset_cache != NULL);
+/**
+ * Commits memory for the first `size` bytes of a range returned by
+ * `lsp_vm_internal_reserve`, given that the first `committed` bytes have
+ * already been committed.  Newly committed memory is zeroed.
+ */
+static void lsp_vm_internal_commit(void *base, size_t committed, size_t size) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    committed = (committed + page - 1) & ~(page - 1);
+    size = (size + page - 1) & ~(page - 1);
+    if (size <= committed) {
+        return;
+    }
 
-    cons_heap_mark_bitset = (uint32_t *) malloc(
-        CONS_HEAP_MARK_BITSET_MAX * sizeof(uint32_t)
+    int result = mprotect(
+        (char *) base + committed, size - committed, PROT_READ | PROT_WRITE
     );
-    assert(cons_heap_mark_bitset != NULL);
+    assert(result == 0);
+    (void) result;
+}
+
+/**
+ * Grows the committed part of each heap, and of the bookkeeping arrays sized
+ * to match it, to hold at least `ncells` cons cells and `nwords` words of data.
+ */
+static void lsp_vm_internal_grow(lsp_offset_t ncells, lsp_offset_t nwords) {
+    assert(ncells <= vm->cons_heap_max);
+    assert(nwords <= vm->data_heap_max);
 
-    data_heap_mark_bitset = (uint32_t *) malloc(
-        DATA_HEAP_MARK_BITSET_MAX * sizeof(uint32_t)
+    size_t old_stack = LSP_TRACE_STACK_SIZE(
+        vm->cons_heap_size, vm->data_heap_size
     );
-    assert(data_heap_mark_bitset != NULL);
 
-    // The first object allocated on the data stack must always be the null
-    // singleton.
-    lsp_heap_alloc_null();
-}
+    if (ncells > vm->cons_heap_size) {
+        lsp_offset_t old = vm->cons_heap_size;
 
-static void lsp_gc_internal_mark_ref(lsp_ref_t ref) {
-    if (ref.is_cons) {
-        off_t word = ref.offset >> 5;
-        int bit = ref.offset & 0x1f;
-        uint32_t bitmask = 0x01 << bit;
+        lsp_vm_internal_commit(
+            vm->cons_heap, old * sizeof(lsp_cons_t), ncells * sizeof(lsp_cons_t)
+        );
 
-        if (cons_heap_mark_bitset[word] & bitmask) {
-            return;
+        size_t old_bitset = 0;
+        if (old) {
+            old_bitset = LSP_BITSET_WORDS(old) * sizeof(uint32_t);
         }
+        size_t new_bitset = LSP_BITSET_WORDS(ncells) * sizeof(uint32_t);
+        lsp_vm_internal_commit(
+            vm->cons_heap_mark_bitset, old_bitset, new_bitset
+        );
+        lsp_vm_internal_commit(
+            vm->cons_heap_offset_cache, old_bitset, new_bitset
+        );
+        lsp_vm_internal_commit(
+            vm->cons_heap_remembered_bitset, old_bitset, new_bitset
+        );
 
-        cons_heap_mark_bitset[word] |= bitmask;
+        vm->cons_heap_size = ncells;
+    }
 
-        mark_stack[mark_stack_ptr++] = ref;
-    } else {
-        size_t size = lsp_heap_get_header(ref)->size;
+    if (nwords > vm->data_heap_size) {
+        lsp_offset_t old = vm->data_heap_size;
 
-        for (
-            uint32_t offset = ref.offset;
-            offset < ref.offset + 1 + size;
-            offset++
-        ) {
-            off_t word = offset >> 5;
-            int bit = offset & 0x1f;
-            uint32_t bitmask = 0x01 << bit;
+        lsp_vm_internal_commit(
+            vm->data_heap, (size_t) old * 8, (size_t) nwords * 8
+        );
+
+        size_t old_bitset = 0;
+        if (old) {
+            old_bitset = LSP_BITSET_WORDS(old) * sizeof(uint32_t);
+        }
+        size_t new_bitset = LSP_BITSET_WORDS(nwords) * sizeof(uint32_t);
+        lsp_vm_internal_commit(
+            vm->data_heap_mark_bitset, old_bitset, new_bitset
+        );
+        lsp_vm_internal_commit(
+            vm->data_heap_offset_cache, old_bitset, new_bitset
+        );
+        lsp_vm_internal_commit(
+            vm->data_heap_remembered_bitset, old_bitset, new_bitset
+        );
+
+        vm->data_heap_size = nwords;
+    }
 
-            data_heap_mark_bitset[word] |= bitmask;
+    size_t new_stack = LSP_TRACE_STACK_SIZE(
+        vm->cons_heap_size, vm->data_heap_size
+    );
+    if (new_stack > old_stack) {
+        lsp_vm_internal_commit(vm->mark_stack, old_stack, new_stack);
+        lsp_vm_internal_commit(vm->grey_stack, old_stack, new_stack);
+        for (unsigned int i = 0; i < vm->gc_threads; i++) {
+            if (vm->gc_workers[i].stack != NULL) {
+                lsp_vm_internal_commit(
+                    vm->gc_workers[i].stack, old_stack, new_stack
+                );
+            }
         }
     }
 }
 
-static lsp_ref_t lsp_gc_internal_rewrite_ref(lsp_ref_t old) {
-    lsp_ref_t new;
+/**
+ * Picks the new committed size for a heap that needs to hold at least `needed`
+ * entries.  Heaps at least double each time they grow so that the cost of
+ * committing memory is amortised.
+ */
+static lsp_offset_t lsp_vm_internal_grown_size(
+    lsp_offset_t size, size_t needed, lsp_offset_t max
+) {
+    size_t grown = 2 * (size_t) size;
+    if (grown < needed) {
+        grown = needed;
+    }
+    if (grown > max) {
+        grown = max;
+    }
+    return (lsp_offset_t) grown;
+}
 
-    off_t bitset_word = old.offset >> 5;
-    int bitset_bit = old.offset & 0x1f;
+/**
+ * Commits more memory if allocating `ncells` cons cells and `nwords` words of
+ * data would not fit in what is already committed.  Must be called after
+ * `lsp_gc_maybe_collect` has made sure that the allocation fits in the heap.
+ */
+static void lsp_vm_internal_ensure_committed(size_t ncells, size_t nwords) {
+    if (
+        vm->cons_heap_ptr + ncells <= vm->cons_heap_size &&
+        vm->data_heap_ptr + nwords <= vm->data_heap_size
+    ) {
+        return;
+    }
 
-    uint32_t offset_bitmask = 0;
-    if (bitset_bit != 0) {
-        offset_bitmask = 0xffffffff >> (32 - bitset_bit);
+    lsp_vm_internal_grow(
+        lsp_vm_internal_grown_size(
+            vm->cons_heap_size, vm->cons_heap_ptr + ncells, vm->cons_heap_max
+        ),
+        lsp_vm_internal_grown_size(
+            vm->data_heap_size, vm->data_heap_ptr + nwords, vm->data_heap_max
+        )
+    );
+}
+
+lsp_vm_t *lsp_vm_create(lsp_vm_config_t const *config) {
+    // Everything below operates on the current VM, so the new VM is made
+    // current while it is set up.
+    lsp_vm_t *previous = vm;
+    vm = (lsp_vm_t *) calloc(1, sizeof(lsp_vm_t));
+    assert(vm != NULL);
+
+    vm->cons_heap_max = CONS_HEAP_MAX_DEFAULT;
+    if (config->cons_heap_max) {
+        assert(config->cons_heap_max <= CONS_HEAP_MAX);
+        vm->cons_heap_max = config->cons_heap_max;
+    }
+    vm->data_heap_max = DATA_HEAP_MAX_DEFAULT;
+    if (config->data_heap_max) {
+        assert(config->data_heap_max <= DATA_HEAP_MAX);
+        vm->data_heap_max = config->data_heap_max;
     }
 
-    if (old.is_cons) {
-        uint32_t base_offset = cons_heap_offset_cache[bitset_word];
+    // Reserve space for every array that grows with the heaps.  Nothing is
+    // committed until `lsp_vm_internal_grow` is called below.
+    vm->cons_heap = (lsp_cons_t *) lsp_vm_internal_reserve(
+        vm->cons_heap_max * sizeof(lsp_cons_t)
+    );
+    vm->cons_heap_ptr = 0;
+    vm->cons_heap_size = 0;
 
-        uint32_t bit_offset = lsp_popcount(
-            cons_heap_mark_bitset[bitset_word] & offset_bitmask
-        );
+    vm->data_heap = (char *) lsp_vm_internal_reserve(
+        (size_t) vm->data_heap_max * 8
+    );
+    vm->data_heap_ptr = 0;
+    vm->data_heap_size = 0;
 
-        new.is_cons = true;
-        new.offset = base_offset + bit_offset;
+    vm->ref_stack = (lsp_ref_t *) malloc(REF_STACK_MAX * sizeof(lsp_ref_t));
+    assert(vm->ref_stack != NULL);
+    vm->ref_stack_ptr = 0;
+    vm->ref_frame_ptr = 0;
 
-        assert(new.offset < cons_heap_ptr);
-        assert(new.offset <= old.offset);
-    } else {
-        uint32_t base_offset = data_heap_offset_cache[bitset_word];
+    vm->mark_stack = (lsp_ref_t *) lsp_vm_internal_reserve(
+        LSP_TRACE_STACK_SIZE(vm->cons_heap_max, vm->data_heap_max)
+    );
+    vm->mark_stack_ptr = 0;
 
-        uint32_t bit_offset = lsp_popcount(
-            data_heap_mark_bitset[bitset_word] & offset_bitmask
-        );
+    vm->cons_heap_offset_cache = (uint32_t *) lsp_vm_internal_reserve(
+        LSP_BITSET_WORDS(vm->cons_heap_max) * sizeof(uint32_t)
+    );
+
+    vm->data_heap_offset_cache = (uint32_t *) lsp_vm_internal_reserve(
+        LSP_BITSET_WORDS(vm->data_heap_max) * sizeof(uint32_t)
+    );
+
+    vm->cons_heap_mark_bitset = (uint32_t *) lsp_vm_internal_reserve(
+        LSP_BITSET_WORDS(vm->cons_heap_max) * sizeof(uint32_t)
+    );
 
-        new.is_cons = false;
-        new.offset = base_offset + bit_offset;
+    vm->data_heap_mark_bitset = (uint32_t *) lsp_vm_internal_reserve(
+        LSP_BITSET_WORDS(vm->data_heap_max) * sizeof(uint32_t)
+    );
+
+    vm->cons_heap_remembered_bitset = (uint32_t *) lsp_vm_internal_reserve(
+        LSP_BITSET_WORDS(vm->cons_heap_max) * sizeof(uint32_t)
+    );
+
+    vm->data_heap_remembered_bitset = (uint32_t *) lsp_vm_internal_reserve(
+        LSP_BITSET_WORDS(vm->data_heap_max) * sizeof(uint32_t)
+    );
+
+    vm->remembered_set = (lsp_ref_t *) malloc(
+        REMEMBERED_SET_MAX * sizeof(lsp_ref_t)
+    );
+    assert(vm->remembered_set != NULL);
+    vm->remembered_set_ptr = 0;
+    vm->remembered_set_overflow = false;
+
+    vm->cons_heap_old_ptr = 0;
+    vm->data_heap_old_ptr = 0;
+    vm->cons_nursery_limit = CONS_NURSERY_SIZE;
+    vm->data_nursery_limit = DATA_NURSERY_SIZE;
 
-        assert(new.offset < data_heap_ptr);
-        assert(new.offset <= old.offset);
+    vm->grey_stack = (lsp_ref_t *) lsp_vm_internal_reserve(
+        LSP_TRACE_STACK_SIZE(vm->cons_heap_max, vm->data_heap_max)
+    );
+    vm->grey_stack_ptr = 0;
+
+    vm->gc_marking = false;
+    vm->gc_pause_budget = 0;
+    vm->gc_slice_countdown = GC_SLICE_INTERVAL;
+
+    vm->gc_threads = config->gc_threads > 1 ? config->gc_threads : 1;
+    vm->gc_workers = (lsp_gc_worker_t *) malloc(
+        vm->gc_threads * sizeof(lsp_gc_worker_t)
+    );
+    assert(vm->gc_workers != NULL);
+    for (unsigned int i = 0; i < vm->gc_threads; i++) {
+        pthread_mutex_init(&vm->gc_workers[i].lock, NULL);
+        vm->gc_workers[i].stack_base = 0;
+        vm->gc_workers[i].stack_ptr = 0;
+        vm->gc_workers[i].shared_ptr = 0;
+        vm->gc_workers[i].stack = NULL;
+        vm->gc_workers[i].vm = vm;
+        if (vm->gc_threads > 1) {
+            vm->gc_workers[i].stack = (lsp_ref_t *) lsp_vm_internal_reserve(
+                LSP_TRACE_STACK_SIZE(vm->cons_heap_max, vm->data_heap_max)
+            );
+        }
+    }
+    vm->gc_cons_chunk_sums = (uint32_t *) malloc(
+        vm->gc_threads * sizeof(uint32_t)
+    );
+    assert(vm->gc_cons_chunk_sums != NULL);
+    vm->gc_data_chunk_sums = (uint32_t *) malloc(
+        vm->gc_threads * sizeof(uint32_t)
+    );
+    assert(vm->gc_data_chunk_sums != NULL);
+    vm->cons_heap_block_done = (unsigned char *) malloc(
+        GC_BLOCK_COUNT(vm->cons_heap_max)
+    );
+    assert(vm->cons_heap_block_done != NULL);
+    vm->data_heap_block_done = (unsigned char *) malloc(
+        GC_BLOCK_COUNT(vm->data_heap_max)
+    );
+    assert(vm->data_heap_block_done != NULL);
+    vm->data_heap_first_header = (lsp_offset_t *) malloc(
+        GC_BLOCK_COUNT(vm->data_heap_max) * sizeof(lsp_offset_t)
+    );
+    assert(vm->data_heap_first_header != NULL);
+
+    pthread_mutex_init(&vm->gc_pool_lock, NULL);
+    pthread_cond_init(&vm->gc_pool_start, NULL);
+    pthread_cond_init(&vm->gc_pool_done, NULL);
+    vm->gc_pool_generation = 0;
+    vm->gc_pool_running = 0;
+    vm->gc_pool_stopping = false;
+    for (unsigned int i = 1; i < vm->gc_threads; i++) {
+        int result = pthread_create(
+            &vm->gc_workers[i].thread, NULL, lsp_gc_internal_helper,
+            &vm->gc_workers[i]
+        );
+        assert(result == 0);
+        (void) result;
     }
 
-    return new;
-}
+    lsp_offset_t cons_heap_initial = CONS_HEAP_INITIAL_DEFAULT;
+    if (config->cons_heap_initial) {
+        cons_heap_initial = config->cons_heap_initial;
+    }
+    if (cons_heap_initial > vm->cons_heap_max) {
+        cons_heap_initial = vm->cons_heap_max;
+    }
+    lsp_offset_t data_heap_initial = DATA_HEAP_INITIAL_DEFAULT;
+    if (config->data_heap_initial) {
+        data_heap_initial = config->data_heap_initial;
+    }
+    if (data_heap_initial > vm->data_heap_max) {
+        data_heap_initial = vm->data_heap_max;
+    }
+    lsp_vm_internal_grow(cons_heap_initial, data_heap_initial);
 
+    vm->gc_growth_factor = GC_GROWTH_FACTOR_DEFAULT;
+    vm->cons_heap_limit = CONS_HEAP_BUDGET_MIN;
+    if (vm->cons_heap_limit > vm->cons_heap_max) {
+        vm->cons_heap_limit = vm->cons_heap_max;
+    }
+    vm->data_heap_limit = DATA_HEAP_BUDGET_MIN;
+    if (vm->data_heap_limit > vm->data_heap_max) {
+        vm->data_heap_limit = vm->data_heap_max;
+    }
+    if (vm->cons_nursery_limit > vm->cons_heap_limit) {
+        vm->cons_nursery_limit = vm->cons_heap_limit;
+    }
+    if (vm->data_nursery_limit > vm->data_heap_limit) {
+        vm->data_nursery_limit = vm->data_heap_limit;
+    }
 
-void lsp_gc_collect(void) {
-    mark_stack_ptr = 0;
+    vm->symbol_names = NULL;
+    vm->symbol_count = 0;
+    vm->symbol_capacity = 0;
+    vm->symbol_index = (lsp_sym_t *) calloc(
+        SYMBOL_INDEX_MIN, sizeof(lsp_sym_t)
+    );
+    assert(vm->symbol_index != NULL);
+    vm->symbol_index_capacity = SYMBOL_INDEX_MIN;
+
+    size_t nbuiltins = sizeof(symbol_builtin_names) / sizeof(char const *);
+    for (lsp_sym_t i = 0; i < nbuiltins; i++) {
+        lsp_sym_t sym = lsp_intern(symbol_builtin_names[i]);
+        assert(sym == i);
+        (void) sym;
+    }
 
-    memset(cons_heap_mark_bitset, 0, 4 * ((cons_heap_ptr / 32) + 1));
-    memset(data_heap_mark_bitset, 0, 4 * ((data_heap_ptr / 32) + 1));
+    // The first object allocated on the data stack must always be the null
+    // singleton.
+    lsp_heap_alloc_null();
 
-    // Traverse heap and mark reachable.
-    lsp_gc_internal_mark_ref(LSP_NULL);
+    lsp_vm_t *created = vm;
+    vm = previous;
+    return created;
+}
 
-    for (off_t i = 0; i < ref_stack_ptr; i++) {
-        lsp_ref_t ref = ref_stack[i];
-        lsp_gc_internal_mark_ref(ref);
+void lsp_vm_destroy(lsp_vm_t *target) {
+    // Stop the helper threads before anything they might touch is freed.
+    pthread_mutex_lock(&target->gc_pool_lock);
+    target->gc_pool_stopping = true;
+    pthread_cond_broadcast(&target->gc_pool_start);
+    pthread_mutex_unlock(&target->gc_pool_lock);
+    for (unsigned int i = 1; i < target->gc_threads; i++) {
+        pthread_join(target->gc_workers[i].thread, NULL);
     }
 
-    while (mark_stack_ptr) {
-        mark_stack_ptr--;
-        lsp_ref_t ref = mark_stack[mark_stack_ptr];
+    size_t trace_stack = LSP_TRACE_STACK_SIZE(
+        target->cons_heap_max, target->data_heap_max
+    );
+    size_t cons_bitset = (
+        LSP_BITSET_WORDS(target->cons_heap_max) * sizeof(uint32_t)
+    );
+    size_t data_bitset = (
+        LSP_BITSET_WORDS(target->data_heap_max) * sizeof(uint32_t)
+    );
 
-        lsp_cons_t *cons = lsp_heap_get_cons(ref);
-        lsp_gc_internal_mark_ref(cons->car);
-        lsp_gc_internal_mark_ref(cons->cdr);
+    for (unsigned int i = 0; i < target->gc_threads; i++) {
+        pthread_mutex_destroy(&target->gc_workers[i].lock);
+        if (target->gc_workers[i].stack != NULL) {
+            munmap(target->gc_workers[i].stack, trace_stack);
+        }
     }
+    pthread_mutex_destroy(&target->gc_pool_lock);
+    pthread_cond_destroy(&target->gc_pool_start);
+    pthread_cond_destroy(&target->gc_pool_done);
+
+    munmap(target->cons_heap, target->cons_heap_max * sizeof(lsp_cons_t));
+    munmap(target->data_heap, (size_t) target->data_heap_max * 8);
+    munmap(target->mark_stack, trace_stack);
+    munmap(target->grey_stack, trace_stack);
+    munmap(target->cons_heap_mark_bitset, cons_bitset);
+    munmap(target->cons_heap_offset_cache, cons_bitset);
+    munmap(target->cons_heap_remembered_bitset, cons_bitset);
+    munmap(target->data_heap_mark_bitset, data_bitset);
+    munmap(target->data_heap_offset_cache, data_bitset);
+    munmap(target->data_heap_remembered_bitset, data_bitset);
+
+    free(target->ref_stack);
+    free(target->remembered_set);
+    free(target->gc_workers);
+    free(target->gc_cons_chunk_sums);
+    free(target->gc_data_chunk_sums);
+    free(target->cons_heap_block_done);
+    free(target->data_heap_block_done);
+    free(target->data_heap_first_header);
+
+    for (lsp_sym_t i = 0; i < target->symbol_count; i++) {
+        free(target->symbol_names[i]);
+    }
+    free(target->symbol_names);
+    free(target->symbol_index);
 
+    for (size_t i = 0; i < target->profile_site_count; i++) {
+        free(target->profile_sites[i].form);
+    }
+    free(target->profile_sites);
+    free(target->profile_forms);
+    free(target->profile_saved_ops);
 
-    // Rebuild cons heap offset cache.
-    uint32_t offset = 0;
-    for (unsigned int i = 0; i < cons_heap_ptr; i++) {
-        cons_heap_offset_cache[i] = offset;
-        offset += lsp_popcount(cons_heap_mark_bitset[i]);
+    if (vm == target) {
+        vm = NULL;
     }
+    free(target);
+}
 
-    // Rebuild data heap offset cache.
-    offset = 0;
-    for (unsigned int i = 0; i < data_heap_ptr; i++) {
-        data_heap_offset_cache[i] = offset;
-        offset += lsp_popcount(data_heap_mark_bitset[i]);
+void lsp_vm_set_current(lsp_vm_t *target) {
+    vm = target;
+}
+
+lsp_vm_t *lsp_vm_get_current(void) {
+    return vm;
+}
+
+void lsp_vm_init_with_config(lsp_vm_config_t const *config) {
+    vm = lsp_vm_create(config);
+}
+
+/**
+ * Returns the references contained in the cons cell or vector pointed to by
+ * `ref`, and sets `*count` to the number of them.
+ */
+static lsp_ref_t *lsp_gc_internal_children(lsp_ref_t ref, size_t *count) {
+    if (lsp_ref_tag(ref) == LSP_REF_CONS) {
+        *count = 2;
+        return &lsp_heap_get_cons(ref)->car;
     }
 
-    // Compact the cons heap.
-    uint32_t old_offset;
-    uint32_t new_offset = 0;
-    for (old_offset = 0; old_offset < cons_heap_ptr; old_offset++) {
-        off_t bitset_word = old_offset >> 5;
-        int bitset_bit = old_offset & 0x1f;
-        uint32_t mark_bitmask = 0x01 << bitset_bit;
+    lsp_header_t *header = lsp_heap_get_header(ref);
+    assert(lsp_type_has_refs(header->type));
+    *count = header->size;
+    return (lsp_ref_t *) header->data;
+}
+
+/**
+ * Returns true if `ref` points to an object that contains references, and so
+ * needs to be traced once it has been marked.
+ */
+static bool lsp_gc_internal_has_children(lsp_ref_t ref) {
+    if (lsp_ref_tag(ref) == LSP_REF_CONS) {
+        return true;
+    }
+    lsp_header_t *header = lsp_heap_get_header_at(lsp_ref_offset(ref));
+    return lsp_type_has_refs(header->type) && header->size != 0;
+}
 
-        if (!(cons_heap_mark_bitset[bitset_word] & mark_bitmask)) {
-            continue;
+static void lsp_gc_internal_mark_ref(lsp_ref_t ref) {
+    if (lsp_ref_tag(ref) == LSP_REF_CONS) {
+        // Old cells are not traced by nursery collections.
+        if (lsp_ref_offset(ref) < vm->cons_heap_old_ptr) {
+            return;
         }
 
-        if (new_offset != old_offset) {
-            memcpy(
-                &cons_heap[new_offset], &cons_heap[old_offset],
-                sizeof(lsp_cons_t)
-            );
+        off_t word = lsp_ref_offset(ref) >> 5;
+        int bit = lsp_ref_offset(ref) & 0x1f;
+        uint32_t bitmask = 0x01 << bit;
+
+        if (vm->cons_heap_mark_bitset[word] & bitmask) {
+            return;
         }
-        new_offset += 1;
-    }
-    cons_heap_ptr = new_offset;
 
-    // Compact the data heap.
-    new_offset = 0;
-    for (old_offset = 0; old_offset < data_heap_ptr; old_offset++) {
-        off_t bitset_word = old_offset >> 5;
-        int bitset_bit = old_offset & 0x1f;
-        uint32_t mark_bitmask = 0x01 << bitset_bit;
+        vm->cons_heap_mark_bitset[word] |= bitmask;
 
-        if (!(data_heap_mark_bitset[bitset_word] & mark_bitmask)) {
-            continue;
+        vm->mark_stack[vm->mark_stack_ptr++] = ref;
+    } else if (lsp_ref_tag(ref) == LSP_REF_DATA) {
+        if (lsp_ref_offset(ref) < vm->data_heap_old_ptr) {
+            return;
         }
 
-        if (new_offset != old_offset) {
-            memcpy(&data_heap[8 * new_offset], &data_heap[8 * old_offset], 8);
+        off_t word = lsp_ref_offset(ref) >> 5;
+        uint32_t bitmask = 0x01u << (lsp_ref_offset(ref) & 0x1f);
+
+        if (vm->data_heap_mark_bitset[word] & bitmask) {
+            return;
         }
 
-        new_offset += 1;
+        vm->data_heap_mark_bitset[word] |= bitmask;
+
+        if (lsp_gc_internal_has_children(ref)) {
+            vm->mark_stack[vm->mark_stack_ptr++] = ref;
+        }
     }
-    data_heap_ptr = new_offset;
+}
 
-    // Iterate over the cons heap, and update each pointer to point to its  new location.
-    for (uint32_t offset = 0; offset < cons_heap_ptr; offset++) {
-        cons_heap[offset].car = lsp_gc_internal_rewrite_ref(
-            cons_heap[offset].car
-        );
+/**
+ * Body of each helper thread in the GC pool.  Waits for a new task to be
+ * started, runs it, and then reports that it is done.
+ */
+static void *lsp_gc_internal_helper(void *arg) {
+    lsp_gc_worker_t *self = (lsp_gc_worker_t *) arg;
+    vm = self->vm;
+    unsigned int worker = (unsigned int) (self - vm->gc_workers);
+    unsigned long generation = 0;
+
+    pthread_mutex_lock(&vm->gc_pool_lock);
+    while (true) {
+        while (
+            vm->gc_pool_generation == generation && !vm->gc_pool_stopping
+        ) {
+            pthread_cond_wait(&vm->gc_pool_start, &vm->gc_pool_lock);
+        }
+        if (vm->gc_pool_stopping) {
+            break;
+        }
+        generation = vm->gc_pool_generation;
+        void (*task)(unsigned int) = vm->gc_pool_task;
+        pthread_mutex_unlock(&vm->gc_pool_lock);
 
-        cons_heap[offset].cdr = lsp_gc_internal_rewrite_ref(
-            cons_heap[offset].cdr
-        );
+        task(worker);
+
+        pthread_mutex_lock(&vm->gc_pool_lock);
+        vm->gc_pool_running--;
+        if (vm->gc_pool_running == 0) {
+            pthread_cond_signal(&vm->gc_pool_done);
+        }
     }
+    pthread_mutex_unlock(&vm->gc_pool_lock);
 
-    // Update each reference on the stack to point to the new location of the data.
-    for (int offset = 0; offset < ref_stack_ptr; offset++) {
-        ref_stack[offset] = lsp_gc_internal_rewrite_ref(ref_stack[offset]);
+    return NULL;
+}
+
+/**
+ * Runs `task` on every worker in the GC pool, including the calling thread as
+ * worker zero, and waits for all of them to return.
+ */
+static void lsp_gc_internal_run_parallel(void (*task)(unsigned int worker)) {
+    pthread_mutex_lock(&vm->gc_pool_lock);
+    vm->gc_pool_task = task;
+    vm->gc_pool_running = vm->gc_threads - 1;
+    vm->gc_pool_generation++;
+    pthread_cond_broadcast(&vm->gc_pool_start);
+    pthread_mutex_unlock(&vm->gc_pool_lock);
+
+    task(0);
+
+    pthread_mutex_lock(&vm->gc_pool_lock);
+    while (vm->gc_pool_running) {
+        pthread_cond_wait(&vm->gc_pool_done, &vm->gc_pool_lock);
     }
+    pthread_mutex_unlock(&vm->gc_pool_lock);
+}
+
+static void lsp_gc_internal_worker_push(
+    lsp_gc_worker_t *worker, lsp_ref_t ref
+) {
+    worker->stack[worker->stack_ptr] = ref;
+    worker->stack_ptr++;
 }
 
-void lsp_gc_maybe_collect(void) {
-    // Don't collect unless there have been a good number of allocations.
+/**
+ * Moves up to half of the entries on the stack of `worker` into its shared
+ * buffer, starting with the oldest, which tend to lead to the most work.  Must
+ * only be called by the owner, and only while the buffer is empty.
+ */
+static void lsp_gc_internal_worker_share(lsp_gc_worker_t *worker) {
+    size_t count = (worker->stack_ptr - worker->stack_base) / 2;
+    if (count > GC_SHARED_SIZE) {
+        count = GC_SHARED_SIZE;
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    memcpy(
+        worker->shared, &worker->stack[worker->stack_base],
+        count * sizeof(lsp_ref_t)
+    );
+    __atomic_store_n(&worker->shared_ptr, count, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&worker->lock);
 
-    // If number of objects in data heap is greater than stack size plus the
-    // number of cons cells then some of them must be inaccessible.
+    worker->stack_base += count;
+}
 
-    // If the heap has grown by more than a certain amount since the last
-    // collection then it should be worth re-scanning it.
+/**
+ * Pops the next entry to trace from the stack of `worker`, falling back on
+ * whatever is left in its shared buffer once the stack is empty.  Must only
+ * be called by the owner.  Returns false if there is nothing left in either.
+ */
+static bool lsp_gc_internal_worker_pop(
+    lsp_gc_worker_t *worker, lsp_ref_t *ref
+) {
+    if (worker->stack_ptr == worker->stack_base) {
+        worker->stack_base = 0;
+        worker->stack_ptr = 0;
+
+        // Only the owner fills the buffer, so if it looks empty it is.
+        if (__atomic_load_n(&worker->shared_ptr, __ATOMIC_RELAXED) == 0) {
+            return false;
+        }
 
+        pthread_mutex_lock(&worker->lock);
+        size_t count = worker->shared_ptr;
+        memcpy(worker->stack, worker->shared, count * sizeof(lsp_ref_t));
+        __atomic_store_n(&worker->shared_ptr, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&worker->lock);
 
-    lsp_gc_collect();
+        worker->stack_ptr = count;
+        if (count == 0) {
+            return false;
+        }
+    } else if (
+        worker->stack_ptr - worker->stack_base > 1 &&
+        __atomic_load_n(&worker->shared_ptr, __ATOMIC_RELAXED) == 0
+    ) {
+        lsp_gc_internal_worker_share(worker);
+    }
+
+    worker->stack_ptr--;
+    *ref = worker->stack[worker->stack_ptr];
+    return true;
 }
 
 /**
- * Heap operations.
+ * Moves half of the entries in the shared buffer of `victim` on to the stack
+ * of `thief`.  Returns false if there was nothing to steal.
+ *
+ * Must only be called by the owner of `thief`, and only once its stack is
+ * empty.  The stack of the thief belongs to the calling thread, so only the
+ * lock for `victim` needs to be held while copying.
  */
-static lsp_cons_t *lsp_heap_get_cons(lsp_ref_t ref) {
-    assert(ref.is_cons);
-    assert(ref.offset <= CONS_HEAP_MAX);
-    assert(ref.offset < cons_heap_ptr);
+static bool lsp_gc_internal_worker_steal(
+    lsp_gc_worker_t *thief, lsp_gc_worker_t *victim
+) {
+    assert(thief->stack_ptr == 0);
+
+    if (__atomic_load_n(&victim->shared_ptr, __ATOMIC_RELAXED) == 0) {
+        return false;
+    }
 
-    return &cons_heap[ref.offset];
+    pthread_mutex_lock(&victim->lock);
+    size_t count = (victim->shared_ptr + 1) / 2;
+    memcpy(
+        thief->stack, &victim->shared[victim->shared_ptr - count],
+        count * sizeof(lsp_ref_t)
+    );
+    __atomic_store_n(
+        &victim->shared_ptr, victim->shared_ptr - count, __ATOMIC_RELAXED
+    );
+    pthread_mutex_unlock(&victim->lock);
+
+    thief->stack_base = 0;
+    thief->stack_ptr = count;
+    return count != 0;
+}
+
+/**
+ * Thread safe equivalent of `lsp_gc_internal_mark_ref`.  Unmarked cons cells
+ * and vectors are pushed on to the mark stack of `worker`.
+ */
+static void lsp_gc_internal_mark_ref_parallel(
+    lsp_gc_worker_t *worker, lsp_ref_t ref
+) {
+    if (lsp_ref_tag(ref) == LSP_REF_CONS) {
+        if (lsp_ref_offset(ref) < vm->cons_heap_old_ptr) {
+            return;
+        }
+
+        off_t word = lsp_ref_offset(ref) >> 5;
+        uint32_t bitmask = 0x01u << (lsp_ref_offset(ref) & 0x1f);
+
+        // Check before trying to set the bit, as an atomic load is much
+        // cheaper than an atomic read-modify-write.
+        uint32_t current = __atomic_load_n(
+            &vm->cons_heap_mark_bitset[word], __ATOMIC_RELAXED
+        );
+        if (current & bitmask) {
+            return;
+        }
+
+        uint32_t previous = __atomic_fetch_or(
+            &vm->cons_heap_mark_bitset[word], bitmask, __ATOMIC_RELAXED
+        );
+        if (previous & bitmask) {
+            // Another worker got here first.
+            return;
+        }
+
+        lsp_gc_internal_worker_push(worker, ref);
+    } else if (lsp_ref_tag(ref) == LSP_REF_DATA) {
+        if (lsp_ref_offset(ref) < vm->data_heap_old_ptr) {
+            return;
+        }
+
+        uint32_t bitmask = 0x01u << (lsp_ref_offset(ref) & 0x1f);
+        uint32_t previous = __atomic_fetch_or(
+            &vm->data_heap_mark_bitset[lsp_ref_offset(ref) >> 5], bitmask,
+            __ATOMIC_RELAXED
+        );
+        if (previous & bitmask) {
+            return;
+        }
+
+        if (lsp_gc_internal_has_children(ref)) {
+            lsp_gc_internal_worker_push(worker, ref);
+        }
+    }
+}
+
+/**
+ * Task run by each worker in the GC pool to mark the heap in parallel.  Roots
+ * are divided between the workers in round robin order.
+ */
+static void lsp_gc_internal_mark_task(unsigned int index) {
+    lsp_gc_worker_t *worker = &vm->gc_workers[index];
+
+    if (index == 0) {
+        lsp_gc_internal_mark_ref_parallel(worker, LSP_NULL);
+    }
+
+    for (off_t i = index; i < vm->ref_stack_ptr; i += vm->gc_threads) {
+        lsp_gc_internal_mark_ref_parallel(worker, vm->ref_stack[i]);
+    }
+
+    for (int i = index; i < vm->profile_depth; i += vm->gc_threads) {
+        lsp_gc_internal_mark_ref_parallel(worker, vm->profile_forms[i]);
+    }
+
+    for (size_t i = index; i < vm->remembered_set_ptr; i += vm->gc_threads) {
+        size_t count;
+        lsp_ref_t *children = lsp_gc_internal_children(
+            vm->remembered_set[i], &count
+        );
+        for (size_t j = 0; j < count; j++) {
+            lsp_gc_internal_mark_ref_parallel(worker, children[j]);
+        }
+    }
+
+    while (true) {
+        lsp_ref_t ref;
+        while (lsp_gc_internal_worker_pop(worker, &ref)) {
+            size_t count;
+            lsp_ref_t *children = lsp_gc_internal_children(ref, &count);
+            for (size_t j = 0; j < count; j++) {
+                lsp_gc_internal_mark_ref_parallel(worker, children[j]);
+            }
+        }
+
+        // Out of work.  Try to steal some from everyone else before giving
+        // up.
+        bool stolen = false;
+        for (unsigned int i = 1; i < vm->gc_threads && !stolen; i++) {
+            lsp_gc_worker_t *victim =
+                &vm->gc_workers[(index + i) % vm->gc_threads];
+            stolen = lsp_gc_internal_worker_steal(worker, victim);
+        }
+        if (stolen) {
+            continue;
+        }
+
+        // Nothing to steal.  Wait until either everyone else is also idle, in
+        // which case marking is finished, or until some work appears.
+        __atomic_fetch_add(&vm->gc_idle_workers, 1, __ATOMIC_SEQ_CST);
+        while (true) {
+            unsigned int idle = __atomic_load_n(
+                &vm->gc_idle_workers, __ATOMIC_SEQ_CST
+            );
+            if (idle == vm->gc_threads) {
+                return;
+            }
+
+            bool found = false;
+            for (unsigned int i = 0; i < vm->gc_threads && !found; i++) {
+                found = __atomic_load_n(
+                    &vm->gc_workers[i].shared_ptr, __ATOMIC_RELAXED
+                ) != 0;
+            }
+            if (found) {
+                __atomic_fetch_sub(&vm->gc_idle_workers, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+
+            sched_yield();
+        }
+    }
+}
+
+static lsp_ref_t lsp_gc_internal_rewrite_ref(lsp_ref_t old) {
+    lsp_ref_t new;
+    lsp_ref_tag_t tag = lsp_ref_tag(old);
+    lsp_offset_t offset = lsp_ref_offset(old);
+
+    // Immediates do not live on either heap.
+    if (tag == LSP_REF_INT || tag == LSP_REF_SYM) {
+        return old;
+    }
+
+    // Objects in the old generation are never moved by nursery collections.
+    if (tag == LSP_REF_CONS && offset < vm->cons_heap_old_ptr) {
+        return old;
+    }
+    if (tag == LSP_REF_DATA && offset < vm->data_heap_old_ptr) {
+        return old;
+    }
+
+    off_t bitset_word = offset >> 5;
+    int bitset_bit = offset & 0x1f;
+
+    uint32_t offset_bitmask = 0;
+    if (bitset_bit != 0) {
+        offset_bitmask = 0xffffffff >> (32 - bitset_bit);
+    }
+
+    if (tag == LSP_REF_CONS) {
+        uint32_t base_offset = vm->cons_heap_offset_cache[bitset_word];
+
+        uint32_t bit_offset = lsp_popcount(
+            vm->cons_heap_mark_bitset[bitset_word] & offset_bitmask
+        );
+
+        new = lsp_ref_make(LSP_REF_CONS, base_offset + bit_offset);
+
+        assert(lsp_ref_offset(new) < vm->cons_heap_ptr);
+        assert(lsp_ref_offset(new) <= offset);
+    } else {
+        uint32_t base_offset = vm->data_heap_offset_cache[bitset_word];
+
+        uint32_t bit_offset = lsp_popcount(
+            vm->data_heap_mark_bitset[bitset_word] & offset_bitmask
+        );
+
+        new = lsp_ref_make(LSP_REF_DATA, base_offset + bit_offset);
+
+        assert(lsp_ref_offset(new) < vm->data_heap_ptr);
+        assert(lsp_ref_offset(new) <= offset);
+    }
+
+    return new;
+}
+
+
+static void lsp_gc_internal_compact(void);
+
+/**
+ * Returns the current time in nanoseconds, for enforcing the pause budget and
+ * timing each phase of collection.
+ */
+static long lsp_gc_internal_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**
+ * Marks and compacts everything above the generation boundary, then promotes
+ * everything that survived into the old generation.
+ */
+static void lsp_gc_internal_collect(void) {
+    lsp_offset_t cons_base_word = vm->cons_heap_old_ptr >> 5;
+    lsp_offset_t data_base_word = vm->data_heap_old_ptr >> 5;
+
+    // If an incremental mark is in progress then it will own the bits below
+    // the generation boundary in the first word.  These need to be cleared
+    // while the nursery is compacted, but must be restored afterwards.
+    uint32_t cons_base_mask = (0x01u << (vm->cons_heap_old_ptr & 0x1f)) - 1;
+    uint32_t cons_base_bits = (
+        vm->cons_heap_mark_bitset[cons_base_word] & cons_base_mask
+    );
+    uint32_t data_base_mask = (0x01u << (vm->data_heap_old_ptr & 0x1f)) - 1;
+    uint32_t data_base_bits = (
+        vm->data_heap_mark_bitset[data_base_word] & data_base_mask
+    );
+
+    vm->mark_stack_ptr = 0;
+
+    memset(
+        &vm->cons_heap_mark_bitset[cons_base_word], 0,
+        4 * ((vm->cons_heap_ptr / 32) - cons_base_word + 1)
+    );
+    memset(
+        &vm->data_heap_mark_bitset[data_base_word], 0,
+        4 * ((vm->data_heap_ptr / 32) - data_base_word + 1)
+    );
+
+    // Traverse heap and mark reachable.  Nursery collections are expected
+    // to be small enough that it isn't worth waking up the helper threads.
+    long start = lsp_gc_internal_now();
+    if (
+        vm->gc_threads > 1 &&
+        vm->cons_heap_old_ptr == 0 && vm->data_heap_old_ptr == 0
+    ) {
+        vm->gc_idle_workers = 0;
+        lsp_gc_internal_run_parallel(lsp_gc_internal_mark_task);
+    } else {
+        lsp_gc_internal_mark_ref(LSP_NULL);
+
+        for (off_t i = 0; i < vm->ref_stack_ptr; i++) {
+            lsp_ref_t ref = vm->ref_stack[i];
+            lsp_gc_internal_mark_ref(ref);
+        }
+
+        for (int i = 0; i < vm->profile_depth; i++) {
+            lsp_gc_internal_mark_ref(vm->profile_forms[i]);
+        }
+
+        for (size_t i = 0; i < vm->remembered_set_ptr; i++) {
+            size_t count;
+            lsp_ref_t *children = lsp_gc_internal_children(
+                vm->remembered_set[i], &count
+            );
+            for (size_t j = 0; j < count; j++) {
+                lsp_gc_internal_mark_ref(children[j]);
+            }
+        }
+
+        while (vm->mark_stack_ptr) {
+            vm->mark_stack_ptr--;
+            lsp_ref_t ref = vm->mark_stack[vm->mark_stack_ptr];
+
+            size_t count;
+            lsp_ref_t *children = lsp_gc_internal_children(ref, &count);
+            for (size_t j = 0; j < count; j++) {
+                lsp_gc_internal_mark_ref(children[j]);
+            }
+        }
+    }
+    vm->stats.mark_ns += lsp_gc_internal_now() - start;
+
+    lsp_gc_internal_compact();
+
+    // Put back any bits belonging to an in-progress incremental mark.
+    vm->cons_heap_mark_bitset[cons_base_word] &= ~cons_base_mask;
+    vm->cons_heap_mark_bitset[cons_base_word] |= cons_base_bits;
+    vm->data_heap_mark_bitset[data_base_word] &= ~data_base_mask;
+    vm->data_heap_mark_bitset[data_base_word] |= data_base_bits;
+}
+
+/**
+ * Sets the bits for the range of entries from `start` up to, but not
+ * including, `end` in a mark bitset.
+ */
+static void lsp_gc_internal_set_bits(
+    uint32_t *bitset, lsp_offset_t start, lsp_offset_t end
+) {
+    while (start < end && (start & 0x1f)) {
+        bitset[start >> 5] |= 0x01u << (start & 0x1f);
+        start++;
+    }
+    while (start + 32 <= end) {
+        bitset[start >> 5] = 0xffffffff;
+        start += 32;
+    }
+    while (start < end) {
+        bitset[start >> 5] |= 0x01u << (start & 0x1f);
+        start++;
+    }
+}
+
+/**
+ * Number of bitset words handled in each step of the prefix sum loops.  The
+ * popcounts for a whole block are computed before any of them are summed so
+ * that the first loop has no dependencies between iterations and can be
+ * vectorised.
+ */
+#define GC_SCAN_BLOCK 16
+
+/**
+ * Writes the running total of set bits before each word from `first` to
+ * `last` inclusive into `cache`, starting from `offset`.  Returns the total
+ * after the last word.
+ */
+static uint32_t lsp_gc_internal_fill_cache(
+    uint32_t *cache, uint32_t const *bitset,
+    lsp_offset_t first, lsp_offset_t last, uint32_t offset
+) {
+    lsp_offset_t i = first;
+
+    for (; i + GC_SCAN_BLOCK <= last + 1; i += GC_SCAN_BLOCK) {
+        uint32_t counts[GC_SCAN_BLOCK];
+        for (int j = 0; j < GC_SCAN_BLOCK; j++) {
+            counts[j] = lsp_popcount(bitset[i + j]);
+        }
+        for (int j = 0; j < GC_SCAN_BLOCK; j++) {
+            cache[i + j] = offset;
+            offset += counts[j];
+        }
+    }
+
+    for (; i <= last; i++) {
+        cache[i] = offset;
+        offset += lsp_popcount(bitset[i]);
+    }
+    return offset;
+}
+
+/**
+ * Returns the number of bits set in the words from `first` to `last`
+ * inclusive.
+ */
+static uint32_t lsp_gc_internal_count_bits(
+    uint32_t const *bitset, lsp_offset_t first, lsp_offset_t last
+) {
+    uint32_t count = 0;
+    for (lsp_offset_t i = first; i <= last; i++) {
+        count += lsp_popcount(bitset[i]);
+    }
+    return count;
+}
+
+/**
+ * Finds the first run of consecutive set bits in `bitset` that starts at or
+ * after `*start` and before `end`.  On success, sets `*start` and `*stop` to
+ * the bounds of the run, clipped to `end`, and returns true.
+ *
+ * Words that are entirely clear or entirely set are skipped in a single step.
+ */
+static bool lsp_gc_internal_next_run(
+    uint32_t const *bitset, lsp_offset_t *start, lsp_offset_t *stop,
+    lsp_offset_t end
+) {
+    lsp_offset_t word = *start >> 5;
+    if (*start >= end) {
+        return false;
+    }
+
+    // Find the first set bit.
+    uint32_t bits = bitset[word] & (0xffffffffu << (*start & 0x1f));
+    while (!bits) {
+        word++;
+        if (word << 5 >= end) {
+            return false;
+        }
+        bits = bitset[word];
+    }
+    lsp_offset_t run_start = (word << 5) + lsp_ctz(bits);
+    if (run_start >= end) {
+        return false;
+    }
+
+    // Find the first clear bit after it.
+    bits = ~bitset[word] & (0xffffffffu << (run_start & 0x1f));
+    while (!bits) {
+        word++;
+        if (word << 5 >= end) {
+            break;
+        }
+        bits = ~bitset[word];
+    }
+    lsp_offset_t run_stop = end;
+    if (bits && (word << 5) + lsp_ctz(bits) < end) {
+        run_stop = (word << 5) + lsp_ctz(bits);
+    }
+
+    *start = run_start;
+    *stop = run_stop;
+    return true;
+}
+
+/**
+ * Slides each marked cons cell in the range from `start` up to `end` down to
+ * consecutive positions starting at `dest`.  Returns the offset after the last
+ * cell written.
+ */
+static lsp_offset_t lsp_gc_internal_slide_cons(
+    lsp_offset_t start, lsp_offset_t end, lsp_offset_t dest
+) {
+    uint32_t const *bitset = vm->cons_heap_mark_bitset;
+    lsp_offset_t stop;
+    while (lsp_gc_internal_next_run(bitset, &start, &stop, end)) {
+        if (dest != start) {
+            memmove(
+                &vm->cons_heap[dest], &vm->cons_heap[start],
+                (stop - start) * sizeof(lsp_cons_t)
+            );
+        }
+        dest += stop - start;
+        start = stop;
+    }
+    return dest;
+}
+
+/**
+ * Equivalent of `lsp_gc_internal_slide_cons` for words in the data heap.
+ */
+static lsp_offset_t lsp_gc_internal_slide_data(
+    lsp_offset_t start, lsp_offset_t end, lsp_offset_t dest
+) {
+    uint32_t const *bitset = vm->data_heap_mark_bitset;
+    lsp_offset_t stop;
+    while (lsp_gc_internal_next_run(bitset, &start, &stop, end)) {
+        if (dest != start) {
+            memmove(
+                &vm->data_heap[8 * dest], &vm->data_heap[8 * start],
+                8 * (stop - start)
+            );
+        }
+        dest += stop - start;
+        start = stop;
+    }
+    return dest;
+}
+
+/**
+ * Extends the mark on the header of each live object above the generation
+ * boundary in the data heap to cover all of the words in the object.
+ *
+ * Live objects are compacted in order, so the offset each one will be moved to
+ * is the total size of the ones before it.  This is used to fill in
+ * `data_heap_first_header` for the blocks of the compacted heap.
+ */
+static void lsp_gc_internal_expand_data_marks(void) {
+    lsp_offset_t *first_header = vm->data_heap_first_header;
+    lsp_offset_t dest = vm->data_heap_old_ptr;
+    lsp_offset_t block = dest / GC_BLOCK_SIZE;
+
+    lsp_offset_t start = vm->data_heap_old_ptr;
+    lsp_offset_t stop;
+    while (
+        lsp_gc_internal_next_run(
+            vm->data_heap_mark_bitset, &start, &stop, vm->data_heap_ptr
+        )
+    ) {
+        lsp_header_t *header = lsp_heap_get_header_at(start);
+        lsp_offset_t end = start + 1 + header->size;
+
+        lsp_gc_internal_set_bits(vm->data_heap_mark_bitset, start + 1, end);
+        start = end;
+
+        while (block * GC_BLOCK_SIZE <= dest) {
+            first_header[block++] = dest;
+        }
+        dest += 1 + header->size;
+    }
+
+    // Blocks past the last object point to the end of the compacted heap.
+    while (block * GC_BLOCK_SIZE <= dest) {
+        first_header[block++] = dest;
+    }
+}
+
+/**
+ * Updates the references in each cons cell from `start` up to `end` to point
+ * to the new locations of their targets.
+ */
+static void lsp_gc_internal_rewrite_cons(lsp_offset_t start, lsp_offset_t end) {
+    for (lsp_offset_t offset = start; offset < end; offset++) {
+        vm->cons_heap[offset].car = lsp_gc_internal_rewrite_ref(
+            vm->cons_heap[offset].car
+        );
+
+        vm->cons_heap[offset].cdr = lsp_gc_internal_rewrite_ref(
+            vm->cons_heap[offset].cdr
+        );
+    }
+}
+
+/**
+ * Updates the references in each vector or table with a header from `start` up
+ * to `end` to point to the new locations of their targets.  The walk starts
+ * from the first header recorded for the block containing `start`, so `start`
+ * and `end` do not need to fall on object boundaries, but must not be below
+ * the generation boundary.
+ */
+static void lsp_gc_internal_rewrite_data(lsp_offset_t start, lsp_offset_t end) {
+    for (
+        lsp_offset_t offset = vm->data_heap_first_header[
+            start / GC_BLOCK_SIZE
+        ];
+        offset < end;
+        offset += 1 + lsp_heap_get_header_at(offset)->size
+    ) {
+        lsp_header_t *header = lsp_heap_get_header_at(offset);
+        if (offset < start || !lsp_type_has_refs(header->type)) {
+            continue;
+        }
+
+        lsp_ref_t *items = (lsp_ref_t *) header->data;
+        for (uint32_t i = 0; i < header->size; i++) {
+            items[i] = lsp_gc_internal_rewrite_ref(items[i]);
+        }
+    }
+}
+
+/**
+ * Clears the remembered bit for the cons cell or vector at `ref`.
+ */
+static void lsp_gc_internal_forget(lsp_ref_t ref) {
+    uint32_t *bitset = vm->cons_heap_remembered_bitset;
+    if (lsp_ref_tag(ref) == LSP_REF_DATA) {
+        bitset = vm->data_heap_remembered_bitset;
+    }
+    lsp_offset_t offset = lsp_ref_offset(ref);
+    bitset[offset >> 5] &= ~(0x01u << (offset & 0x1f));
+}
+
+/**
+ * Empties the remembered set.
+ */
+static void lsp_gc_internal_forget_all(void) {
+    for (size_t i = 0; i < vm->remembered_set_ptr; i++) {
+        lsp_gc_internal_forget(vm->remembered_set[i]);
+    }
+    vm->remembered_set_ptr = 0;
+}
+
+/**
+ * Returns the start of the share of `total` entries assigned to `worker`.
+ */
+static lsp_offset_t lsp_gc_internal_share(
+    lsp_offset_t total, unsigned int worker
+) {
+    return (lsp_offset_t) (((uint64_t) total * worker) / vm->gc_threads);
+}
+
+static void lsp_gc_internal_count_task(unsigned int worker) {
+    lsp_offset_t cons_words = vm->cons_heap_ptr / 32 + 1;
+    lsp_offset_t data_words = vm->data_heap_ptr / 32 + 1;
+
+    lsp_offset_t start = lsp_gc_internal_share(cons_words, worker);
+    lsp_offset_t end = lsp_gc_internal_share(cons_words, worker + 1);
+    vm->gc_cons_chunk_sums[worker] = 0;
+    if (start < end) {
+        vm->gc_cons_chunk_sums[worker] = lsp_gc_internal_count_bits(
+            vm->cons_heap_mark_bitset, start, end - 1
+        );
+    }
+
+    start = lsp_gc_internal_share(data_words, worker);
+    end = lsp_gc_internal_share(data_words, worker + 1);
+    vm->gc_data_chunk_sums[worker] = 0;
+    if (start < end) {
+        vm->gc_data_chunk_sums[worker] = lsp_gc_internal_count_bits(
+            vm->data_heap_mark_bitset, start, end - 1
+        );
+    }
+}
+
+static void lsp_gc_internal_cache_task(unsigned int worker) {
+    lsp_offset_t cons_words = vm->cons_heap_ptr / 32 + 1;
+    lsp_offset_t data_words = vm->data_heap_ptr / 32 + 1;
+
+    lsp_offset_t start = lsp_gc_internal_share(cons_words, worker);
+    lsp_offset_t end = lsp_gc_internal_share(cons_words, worker + 1);
+    if (start < end) {
+        lsp_gc_internal_fill_cache(
+            vm->cons_heap_offset_cache, vm->cons_heap_mark_bitset,
+            start, end - 1, vm->gc_cons_chunk_sums[worker]
+        );
+    }
+
+    start = lsp_gc_internal_share(data_words, worker);
+    end = lsp_gc_internal_share(data_words, worker + 1);
+    if (start < end) {
+        lsp_gc_internal_fill_cache(
+            vm->data_heap_offset_cache, vm->data_heap_mark_bitset,
+            start, end - 1, vm->gc_data_chunk_sums[worker]
+        );
+    }
+}
+
+/**
+ * Blocks until every block before `block` that overlaps the range of entries
+ * starting at `dest` has been moved.
+ */
+static void lsp_gc_internal_wait_for_blocks(
+    unsigned char *done, lsp_offset_t dest, lsp_offset_t block
+) {
+    for (lsp_offset_t i = dest / GC_BLOCK_SIZE; i < block; i++) {
+        while (!__atomic_load_n(&done[i], __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+    }
+}
+
+static void lsp_gc_internal_slide_task(unsigned int worker) {
+    (void) worker;
+
+    lsp_offset_t cons_blocks = (
+        (vm->cons_heap_ptr + GC_BLOCK_SIZE - 1) / GC_BLOCK_SIZE
+    );
+    lsp_offset_t data_blocks = (
+        (vm->data_heap_ptr + GC_BLOCK_SIZE - 1) / GC_BLOCK_SIZE
+    );
+
+    while (true) {
+        lsp_offset_t block = __atomic_fetch_add(
+            &vm->gc_next_block, 1, __ATOMIC_RELAXED
+        );
+
+        if (block < cons_blocks) {
+            lsp_offset_t start = block * GC_BLOCK_SIZE;
+            lsp_offset_t end = start + GC_BLOCK_SIZE;
+            if (end > vm->cons_heap_ptr) {
+                end = vm->cons_heap_ptr;
+            }
+            lsp_offset_t dest = vm->cons_heap_offset_cache[start >> 5];
+
+            lsp_gc_internal_wait_for_blocks(
+                vm->cons_heap_block_done, dest, block
+            );
+            lsp_gc_internal_slide_cons(start, end, dest);
+            __atomic_store_n(
+                &vm->cons_heap_block_done[block], 1, __ATOMIC_RELEASE
+            );
+
+        } else if (block < cons_blocks + data_blocks) {
+            block -= cons_blocks;
+
+            lsp_offset_t start = block * GC_BLOCK_SIZE;
+            lsp_offset_t end = start + GC_BLOCK_SIZE;
+            if (end > vm->data_heap_ptr) {
+                end = vm->data_heap_ptr;
+            }
+            lsp_offset_t dest = vm->data_heap_offset_cache[start >> 5];
+
+            lsp_gc_internal_wait_for_blocks(
+                vm->data_heap_block_done, dest, block
+            );
+            lsp_gc_internal_slide_data(start, end, dest);
+            __atomic_store_n(
+                &vm->data_heap_block_done[block], 1, __ATOMIC_RELEASE
+            );
+
+        } else {
+            return;
+        }
+    }
+}
+
+static void lsp_gc_internal_rewrite_task(unsigned int worker) {
+    lsp_gc_internal_rewrite_cons(
+        lsp_gc_internal_share(vm->cons_heap_ptr, worker),
+        lsp_gc_internal_share(vm->cons_heap_ptr, worker + 1)
+    );
+    lsp_gc_internal_rewrite_data(
+        lsp_gc_internal_share(vm->data_heap_ptr, worker),
+        lsp_gc_internal_share(vm->data_heap_ptr, worker + 1)
+    );
+
+    lsp_offset_t start = lsp_gc_internal_share(vm->ref_stack_ptr, worker);
+    lsp_offset_t end = lsp_gc_internal_share(vm->ref_stack_ptr, worker + 1);
+    for (lsp_offset_t offset = start; offset < end; offset++) {
+        vm->ref_stack[offset] = lsp_gc_internal_rewrite_ref(
+            vm->ref_stack[offset]
+        );
+    }
+
+    for (int i = worker; i < vm->profile_depth; i += vm->gc_threads) {
+        vm->profile_forms[i] = lsp_gc_internal_rewrite_ref(
+            vm->profile_forms[i]
+        );
+    }
+}
+
+/**
+ * Compacts both heaps from the bottom using the GC pool.  The remembered set
+ * must be empty.
+ */
+static void lsp_gc_internal_compact_parallel(void) {
+    assert(vm->cons_heap_old_ptr == 0 && vm->data_heap_old_ptr == 0);
+    assert(vm->remembered_set_ptr == 0);
+
+    // Rebuild both offset caches.
+    long start = lsp_gc_internal_now();
+    lsp_gc_internal_run_parallel(lsp_gc_internal_count_task);
+
+    uint32_t cons_total = 0;
+    uint32_t data_total = 0;
+    for (unsigned int i = 0; i < vm->gc_threads; i++) {
+        uint32_t cons_count = vm->gc_cons_chunk_sums[i];
+        vm->gc_cons_chunk_sums[i] = cons_total;
+        cons_total += cons_count;
+
+        uint32_t data_count = vm->gc_data_chunk_sums[i];
+        vm->gc_data_chunk_sums[i] = data_total;
+        data_total += data_count;
+    }
+
+    lsp_gc_internal_run_parallel(lsp_gc_internal_cache_task);
+
+    long end = lsp_gc_internal_now();
+    vm->stats.cache_ns += end - start;
+    start = end;
+
+    // Slide both heaps.
+    memset(vm->cons_heap_block_done, 0, GC_BLOCK_COUNT(vm->cons_heap_ptr));
+    memset(vm->data_heap_block_done, 0, GC_BLOCK_COUNT(vm->data_heap_ptr));
+    vm->gc_next_block = 0;
+
+    lsp_gc_internal_run_parallel(lsp_gc_internal_slide_task);
+
+    vm->cons_heap_ptr = cons_total;
+    vm->data_heap_ptr = data_total;
+
+    end = lsp_gc_internal_now();
+    vm->stats.compact_ns += end - start;
+    start = end;
+
+    // Update each reference in the cons heap, in vectors, and on the stack to
+    // point to the new location of its target.
+    lsp_gc_internal_run_parallel(lsp_gc_internal_rewrite_task);
+
+    vm->stats.rewrite_ns += lsp_gc_internal_now() - start;
+}
+
+/**
+ * Compacts everything above the generation boundary using the current mark
+ * bits, rewrites all references to point to the new locations, and then
+ * promotes everything that survived into the old generation.
+ */
+static void lsp_gc_internal_compact(void) {
+    long start = lsp_gc_internal_now();
+    lsp_gc_internal_expand_data_marks();
+    vm->stats.cache_ns += lsp_gc_internal_now() - start;
+
+    if (
+        vm->gc_threads > 1 &&
+        vm->cons_heap_old_ptr == 0 && vm->data_heap_old_ptr == 0
+    ) {
+        lsp_gc_internal_compact_parallel();
+
+        vm->cons_heap_old_ptr = vm->cons_heap_ptr;
+        vm->data_heap_old_ptr = vm->data_heap_ptr;
+        vm->stats.live_cells = vm->cons_heap_ptr;
+        vm->stats.live_words = vm->data_heap_ptr;
+        return;
+    }
+
+    start = lsp_gc_internal_now();
+
+    // Rebuild cons heap offset cache.  Bits below the generation boundary in
+    // the first word are always clear, so the count starts from the boundary.
+    lsp_gc_internal_fill_cache(
+        vm->cons_heap_offset_cache, vm->cons_heap_mark_bitset,
+        vm->cons_heap_old_ptr >> 5, vm->cons_heap_ptr >> 5,
+        vm->cons_heap_old_ptr
+    );
+
+    // Rebuild data heap offset cache.
+    lsp_gc_internal_fill_cache(
+        vm->data_heap_offset_cache, vm->data_heap_mark_bitset,
+        vm->data_heap_old_ptr >> 5, vm->data_heap_ptr >> 5,
+        vm->data_heap_old_ptr
+    );
+
+    long end = lsp_gc_internal_now();
+    vm->stats.cache_ns += end - start;
+    start = end;
+
+    // Compact both heaps.
+    vm->cons_heap_ptr = lsp_gc_internal_slide_cons(
+        vm->cons_heap_old_ptr, vm->cons_heap_ptr, vm->cons_heap_old_ptr
+    );
+    vm->data_heap_ptr = lsp_gc_internal_slide_data(
+        vm->data_heap_old_ptr, vm->data_heap_ptr, vm->data_heap_old_ptr
+    );
+
+    end = lsp_gc_internal_now();
+    vm->stats.compact_ns += end - start;
+    start = end;
+
+    // Iterate over the surviving young cells and vectors, and the old ones
+    // that might point into the nursery, and update each pointer to point to
+    // its new location.
+    lsp_gc_internal_rewrite_cons(vm->cons_heap_old_ptr, vm->cons_heap_ptr);
+    lsp_gc_internal_rewrite_data(vm->data_heap_old_ptr, vm->data_heap_ptr);
+
+    for (size_t i = 0; i < vm->remembered_set_ptr; i++) {
+        size_t count;
+        lsp_ref_t *children = lsp_gc_internal_children(
+            vm->remembered_set[i], &count
+        );
+        for (size_t j = 0; j < count; j++) {
+            children[j] = lsp_gc_internal_rewrite_ref(children[j]);
+        }
+    }
+    lsp_gc_internal_forget_all();
+    vm->remembered_set_overflow = false;
+
+    // Update each reference on the stack to point to the new location of the data.
+    for (int offset = 0; offset < vm->ref_stack_ptr; offset++) {
+        vm->ref_stack[offset] = lsp_gc_internal_rewrite_ref(
+            vm->ref_stack[offset]
+        );
+    }
+    for (int i = 0; i < vm->profile_depth; i++) {
+        vm->profile_forms[i] = lsp_gc_internal_rewrite_ref(
+            vm->profile_forms[i]
+        );
+    }
+
+    vm->stats.rewrite_ns += lsp_gc_internal_now() - start;
+
+    // Promote everything that survived.
+    vm->cons_heap_old_ptr = vm->cons_heap_ptr;
+    vm->data_heap_old_ptr = vm->data_heap_ptr;
+    vm->stats.live_cells = vm->cons_heap_ptr;
+    vm->stats.live_words = vm->data_heap_ptr;
+}
+
+void lsp_gc_collect(void) {
+    // A full collection makes any incremental mark in progress redundant.
+    vm->gc_marking = false;
+
+    // Move the generation boundary to the bottom of each heap so that
+    // everything is collected.  The remembered set is redundant when nothing
+    // is old, so it is discarded rather than traced.
+    lsp_gc_internal_forget_all();
+
+    vm->cons_heap_old_ptr = 0;
+    vm->data_heap_old_ptr = 0;
+
+    vm->stats.collections++;
+    lsp_gc_internal_collect();
+}
+
+void lsp_gc_collect_nursery(void) {
+    if (vm->remembered_set_overflow) {
+        lsp_gc_collect();
+        return;
+    }
+
+    vm->stats.nursery_collections++;
+    lsp_gc_internal_collect();
+}
+
+/**
+ * Marks a reference that was reachable when incremental marking started,
+ * and queues it to be traced if it is an unmarked cons cell or vector.
+ */
+static void lsp_gc_internal_shade_ref(lsp_ref_t ref) {
+    if (lsp_ref_tag(ref) == LSP_REF_CONS) {
+        // Allocated since marking started, so already live.
+        if (lsp_ref_offset(ref) >= vm->cons_heap_mark_ptr) {
+            return;
+        }
+
+        off_t word = lsp_ref_offset(ref) >> 5;
+        uint32_t bitmask = 0x01u << (lsp_ref_offset(ref) & 0x1f);
+
+        if (vm->cons_heap_mark_bitset[word] & bitmask) {
+            return;
+        }
+
+        vm->cons_heap_mark_bitset[word] |= bitmask;
+
+        vm->grey_stack[vm->grey_stack_ptr++] = ref;
+    } else if (lsp_ref_tag(ref) == LSP_REF_DATA) {
+        if (lsp_ref_offset(ref) >= vm->data_heap_mark_ptr) {
+            return;
+        }
+
+        off_t word = lsp_ref_offset(ref) >> 5;
+        uint32_t bitmask = 0x01u << (lsp_ref_offset(ref) & 0x1f);
+
+        if (vm->data_heap_mark_bitset[word] & bitmask) {
+            return;
+        }
+
+        vm->data_heap_mark_bitset[word] |= bitmask;
+
+        if (lsp_gc_internal_has_children(ref)) {
+            vm->grey_stack[vm->grey_stack_ptr++] = ref;
+        }
+    }
+}
+
+/**
+ * Starts an incremental mark.  Shading the reference stack is the only work
+ * that is done up front.
+ */
+static void lsp_gc_internal_start_marking(void) {
+    // Marking starts from an empty nursery so that there is nothing in the
+    // snapshot that could be moved by a nursery collection.
+    lsp_gc_collect_nursery();
+
+    vm->gc_marking = true;
+    vm->gc_slice_countdown = GC_SLICE_INTERVAL;
+
+    vm->cons_heap_mark_ptr = vm->cons_heap_ptr;
+    vm->data_heap_mark_ptr = vm->data_heap_ptr;
+
+    memset(vm->cons_heap_mark_bitset, 0, 4 * ((vm->cons_heap_ptr / 32) + 1));
+    memset(vm->data_heap_mark_bitset, 0, 4 * ((vm->data_heap_ptr / 32) + 1));
+
+    vm->grey_stack_ptr = 0;
+    lsp_gc_internal_shade_ref(LSP_NULL);
+    for (off_t i = 0; i < vm->ref_stack_ptr; i++) {
+        lsp_gc_internal_shade_ref(vm->ref_stack[i]);
+    }
+    for (int i = 0; i < vm->profile_depth; i++) {
+        lsp_gc_internal_shade_ref(vm->profile_forms[i]);
+    }
+}
+
+/**
+ * Traces cells from the grey stack until either it is empty or the pause
+ * budget has been used up.  Returns true if marking is complete.
+ */
+static bool lsp_gc_internal_mark_slice(void) {
+    long start = lsp_gc_internal_now();
+    long deadline = start + vm->gc_pause_budget;
+
+    while (vm->grey_stack_ptr) {
+        // Reading the clock is relatively expensive so only check it every
+        // few cells.
+        for (int i = 0; i < 64 && vm->grey_stack_ptr; i++) {
+            vm->grey_stack_ptr--;
+            lsp_ref_t ref = vm->grey_stack[vm->grey_stack_ptr];
+
+            size_t count;
+            lsp_ref_t *children = lsp_gc_internal_children(ref, &count);
+            for (size_t j = 0; j < count; j++) {
+                lsp_gc_internal_shade_ref(children[j]);
+            }
+        }
+
+        if (lsp_gc_internal_now() >= deadline) {
+            break;
+        }
+    }
+
+    vm->stats.mark_ns += lsp_gc_internal_now() - start;
+    return vm->grey_stack_ptr == 0;
+}
+
+/**
+ * Finishes an incremental mark in a single pause, and then compacts both
+ * heaps.
+ */
+static void lsp_gc_internal_finish_marking(void) {
+    long start = lsp_gc_internal_now();
+    while (vm->grey_stack_ptr) {
+        vm->grey_stack_ptr--;
+        lsp_ref_t ref = vm->grey_stack[vm->grey_stack_ptr];
+
+        size_t count;
+        lsp_ref_t *children = lsp_gc_internal_children(ref, &count);
+        for (size_t j = 0; j < count; j++) {
+            lsp_gc_internal_shade_ref(children[j]);
+        }
+    }
+
+    // Everything allocated since the snapshot was taken is assumed to be
+    // live.  Anything that isn't will be picked up by the next collection.
+    lsp_gc_internal_set_bits(
+        vm->cons_heap_mark_bitset, vm->cons_heap_mark_ptr, vm->cons_heap_ptr
+    );
+    for (
+        lsp_offset_t offset = vm->data_heap_mark_ptr;
+        offset < vm->data_heap_ptr;
+        offset += 1 + lsp_heap_get_header_at(offset)->size
+    ) {
+        vm->data_heap_mark_bitset[offset >> 5] |= 0x01u << (offset & 0x1f);
+    }
+    vm->stats.mark_ns += lsp_gc_internal_now() - start;
+
+    vm->gc_marking = false;
+    vm->stats.collections++;
+
+    // Everything is about to be rewritten, so the remembered set is redundant.
+    lsp_gc_internal_forget_all();
+
+    vm->cons_heap_old_ptr = 0;
+    vm->data_heap_old_ptr = 0;
+
+    lsp_gc_internal_compact();
+}
+
+/**
+ * Write barrier that must be called before replacing `old` with `value` in the
+ * cons cell or vector at `object`.
+ *
+ * Records the object in the remembered set if it is old and `value` points
+ * into the nursery, and shades `old` if an incremental mark is in progress.
+ */
+static void lsp_gc_internal_write_barrier(
+    lsp_ref_t object, lsp_ref_t old, lsp_ref_t value
+) {
+    if (vm->gc_marking) {
+        lsp_gc_internal_shade_ref(old);
+    }
+
+    lsp_offset_t offset = lsp_ref_offset(object);
+    uint32_t *bitset = vm->cons_heap_remembered_bitset;
+    if (
+        lsp_ref_tag(object) == LSP_REF_CONS &&
+        offset >= vm->cons_heap_old_ptr
+    ) {
+        return;
+    }
+    if (lsp_ref_tag(object) == LSP_REF_DATA) {
+        if (offset >= vm->data_heap_old_ptr) {
+            return;
+        }
+        bitset = vm->data_heap_remembered_bitset;
+    }
+
+    lsp_ref_tag_t value_tag = lsp_ref_tag(value);
+    lsp_offset_t value_offset = lsp_ref_offset(value);
+    if (value_tag == LSP_REF_INT || value_tag == LSP_REF_SYM) {
+        return;
+    }
+    if (value_tag == LSP_REF_CONS && value_offset < vm->cons_heap_old_ptr) {
+        return;
+    }
+    if (value_tag == LSP_REF_DATA && value_offset < vm->data_heap_old_ptr) {
+        return;
+    }
+
+    off_t word = offset >> 5;
+    uint32_t bitmask = 0x01u << (offset & 0x1f);
+    if (bitset[word] & bitmask) {
+        return;
+    }
+
+    if (vm->remembered_set_ptr == REMEMBERED_SET_MAX) {
+        vm->remembered_set_overflow = true;
+        return;
+    }
+
+    bitset[word] |= bitmask;
+    vm->remembered_set[vm->remembered_set_ptr++] = object;
+}
+
+/**
+ * Resets the allocation budget for a heap after a collection has left it
+ * containing `live` entries, and returns the new limit.
+ */
+static lsp_offset_t lsp_gc_internal_limit(
+    lsp_offset_t live, lsp_offset_t min_budget, lsp_offset_t max
+) {
+    double budget = vm->gc_growth_factor * live;
+    if (budget < min_budget) {
+        budget = min_budget;
+    }
+    if (budget > max - live) {
+        return max;
+    }
+    return live + (lsp_offset_t) budget;
+}
+
+/**
+ * Recalculates the allocation budget for the old generation after a full
+ * collection.
+ */
+static void lsp_gc_internal_reset_limits(void) {
+    vm->cons_heap_limit = lsp_gc_internal_limit(
+        vm->cons_heap_ptr, CONS_HEAP_BUDGET_MIN, vm->cons_heap_max
+    );
+    vm->data_heap_limit = lsp_gc_internal_limit(
+        vm->data_heap_ptr, DATA_HEAP_BUDGET_MIN, vm->data_heap_max
+    );
+}
+
+/**
+ * Recalculates the point at which the next nursery collection should be
+ * triggered.  While an incremental mark is in progress the budget for the old
+ * generation has already been used up, so the nursery is only limited by the
+ * size of the heap.
+ */
+static void lsp_gc_internal_reset_nursery(void) {
+    lsp_offset_t cons_max = (
+        vm->gc_marking ? vm->cons_heap_max : vm->cons_heap_limit
+    );
+    lsp_offset_t data_max = (
+        vm->gc_marking ? vm->data_heap_max : vm->data_heap_limit
+    );
+
+    vm->cons_nursery_limit = vm->cons_heap_ptr + CONS_NURSERY_SIZE;
+    if (vm->cons_nursery_limit > cons_max) {
+        vm->cons_nursery_limit = cons_max;
+    }
+    vm->data_nursery_limit = vm->data_heap_ptr + DATA_NURSERY_SIZE;
+    if (vm->data_nursery_limit > data_max) {
+        vm->data_nursery_limit = data_max;
+    }
+}
+
+/**
+ * Triggers a collection if allocating `ncells` cons cells and `nwords` words of
+ * data would exceed the budget for either heap, and runs a slice of marking if
+ * an incremental mark is in progress.
+ *
+ * Will abort if there is still not enough space after collecting.
+ */
+static void lsp_gc_maybe_collect(size_t ncells, size_t nwords) {
+    if (vm->gc_marking && --vm->gc_slice_countdown == 0) {
+        vm->gc_slice_countdown = GC_SLICE_INTERVAL;
+
+        if (lsp_gc_internal_mark_slice()) {
+            lsp_gc_internal_finish_marking();
+            lsp_gc_internal_reset_limits();
+            lsp_gc_internal_reset_nursery();
+        }
+    }
+
+    if (
+        vm->cons_heap_ptr + ncells <= vm->cons_nursery_limit &&
+        vm->data_heap_ptr + nwords <= vm->data_nursery_limit
+    ) {
+        return;
+    }
+
+    lsp_gc_collect_nursery();
+
+    if (vm->gc_marking) {
+        // The budget has already been exceeded, but marking is allowed to
+        // continue until the heap is actually full.
+        if (
+            vm->cons_heap_ptr + ncells > vm->cons_heap_max ||
+            vm->data_heap_ptr + nwords > vm->data_heap_max
+        ) {
+            lsp_gc_internal_finish_marking();
+            lsp_gc_internal_reset_limits();
+        }
+    } else if (
+        vm->cons_heap_ptr + ncells > vm->cons_heap_limit ||
+        vm->data_heap_ptr + nwords > vm->data_heap_limit
+    ) {
+        // Promotion has grown the old generation past its budget, or there is
+        // not enough free space left for the allocation, so collect
+        // everything.  If there is still room then this can be done
+        // incrementally.
+        if (
+            vm->gc_pause_budget &&
+            vm->cons_heap_ptr + ncells <= vm->cons_heap_max &&
+            vm->data_heap_ptr + nwords <= vm->data_heap_max
+        ) {
+            lsp_gc_internal_start_marking();
+        } else {
+            lsp_gc_collect();
+            lsp_gc_internal_reset_limits();
+        }
+    }
+
+    // The limits are clamped to the size of each heap, so if the allocation
+    // still doesn't fit then we have run out of memory.
+    assert(vm->cons_heap_ptr + ncells <= vm->cons_heap_max);
+    assert(vm->data_heap_ptr + nwords <= vm->data_heap_max);
+
+    lsp_gc_internal_reset_nursery();
+
+}
+
+void lsp_gc_set_growth_factor(double factor) {
+    assert(factor >= 0);
+    vm->gc_growth_factor = factor;
+}
+
+void lsp_gc_set_pause_budget(unsigned int usec) {
+    vm->gc_pause_budget = 1000L * usec;
+}
+
+/**
+ * Images.
+ *
+ * An image is a header followed by a number of sections, each starting at a
+ * multiple of `LSP_IMAGE_ALIGN` bytes so that they can be mapped directly on
+ * any platform with pages no larger than that.  The cons and data heaps are
+ * copied verbatim, except that ops in the data heap are replaced by indexes
+ * into the list of op names.  The offsets of those ops are saved in a
+ * relocation table, so that loading can patch them without walking the rest
+ * of the heap.  Symbols are saved as a list of names in id order so that
+ * interning them again reproduces the same ids.
+ */
+#define LSP_IMAGE_MAGIC "LSPIMAGE"
+#define LSP_IMAGE_VERSION 6
+#define LSP_IMAGE_ALIGN 0x10000
+
+typedef struct {
+    uint64_t offset;
+    uint64_t count;
+    uint64_t size;
+} lsp_image_section_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    int32_t frame_ptr;
+    uint32_t env_version;
+    lsp_image_section_t symbols;
+    lsp_image_section_t ops;
+    lsp_image_section_t relocations;
+    lsp_image_section_t stack;
+    lsp_image_section_t cons_heap;
+    lsp_image_section_t data_heap;
+} lsp_image_header_t;
+
+void lsp_register_op(char const *name, lsp_op_t op) {
+    pthread_mutex_lock(&op_registry_lock);
+    for (size_t i = 0; i < op_registry_count; i++) {
+        if (strcmp(op_registry[i].name, name) == 0) {
+            op_registry[i].op = op;
+            pthread_mutex_unlock(&op_registry_lock);
+            return;
+        }
+    }
+
+    if (op_registry_count == op_registry_capacity) {
+        op_registry_capacity = (
+            op_registry_capacity ? 2 * op_registry_capacity : 16
+        );
+        op_registry = (lsp_op_entry_t *) realloc(
+            op_registry, op_registry_capacity * sizeof(lsp_op_entry_t)
+        );
+        assert(op_registry != NULL);
+    }
+    op_registry[op_registry_count].name = strdup(name);
+    assert(op_registry[op_registry_count].name != NULL);
+    op_registry[op_registry_count].op = op;
+    op_registry_count++;
+    pthread_mutex_unlock(&op_registry_lock);
+}
+
+/**
+ * Returns the name that `op` was registered under, or NULL if it hasn't been
+ * registered.
+ */
+static char const *lsp_image_internal_op_name(lsp_op_t op) {
+    pthread_mutex_lock(&op_registry_lock);
+    for (size_t i = 0; i < op_registry_count; i++) {
+        if (op_registry[i].op == op) {
+            char const *name = op_registry[i].name;
+            pthread_mutex_unlock(&op_registry_lock);
+            return name;
+        }
+    }
+    pthread_mutex_unlock(&op_registry_lock);
+    size_t nbuiltins = sizeof(op_builtins) / sizeof(lsp_op_entry_t);
+    for (size_t i = 0; i < nbuiltins; i++) {
+        if (op_builtins[i].op == op) {
+            return op_builtins[i].name;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Returns the op registered under `name`, or NULL if there isn't one.  Ops
+ * added with `lsp_register_op` take precedence over the builtins.
+ */
+static lsp_op_t lsp_image_internal_op_by_name(char const *name) {
+    pthread_mutex_lock(&op_registry_lock);
+    for (size_t i = 0; i < op_registry_count; i++) {
+        if (strcmp(op_registry[i].name, name) == 0) {
+            lsp_op_t op = op_registry[i].op;
+            pthread_mutex_unlock(&op_registry_lock);
+            return op;
+        }
+    }
+    pthread_mutex_unlock(&op_registry_lock);
+    size_t nbuiltins = sizeof(op_builtins) / sizeof(lsp_op_entry_t);
+    for (size_t i = 0; i < nbuiltins; i++) {
+        if (strcmp(op_builtins[i].name, name) == 0) {
+            return op_builtins[i].op;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t lsp_image_internal_align(uint64_t offset) {
+    return (offset + LSP_IMAGE_ALIGN - 1) & ~(uint64_t) (LSP_IMAGE_ALIGN - 1);
+}
+
+static bool lsp_image_internal_write(
+    FILE *file, lsp_image_section_t const *section, void const *data
+) {
+    if (section->size == 0) {
+        return true;
+    }
+    if (fseek(file, (long) section->offset, SEEK_SET) != 0) {
+        return false;
+    }
+    return fwrite(data, 1, section->size, file) == section->size;
+}
+
+bool lsp_vm_save_image(char const *path) {
+    // Only live data is saved, and the heaps must be compacted so that they
+    // can be mapped back in as a single range.
+    lsp_gc_collect();
+    lsp_gc_internal_reset_limits();
+    lsp_gc_internal_reset_nursery();
+
+    // Collect the ops used on the data heap, and make sure that every one of
+    // them has a name that it can be resolved by again.  The offset of each
+    // entry holding an op is recorded so that it can be found again quickly.
+    lsp_op_t *op_values = NULL;
+    char const **op_names = NULL;
+    size_t op_count = 0;
+    size_t op_names_size = 0;
+    lsp_offset_t *relocations = NULL;
+    size_t relocation_count = 0;
+    size_t relocation_capacity = 0;
+    for (
+        lsp_offset_t offset = 0; offset < vm->data_heap_ptr;
+        offset += 1 + lsp_heap_get_header_at(offset)->size
+    ) {
+        lsp_header_t *header = lsp_heap_get_header_at(offset);
+        if (header->type != LSP_TYPE_OP) {
+            continue;
+        }
+
+        if (relocation_count == relocation_capacity) {
+            relocation_capacity = (
+                relocation_capacity ? 2 * relocation_capacity : 0x40
+            );
+            relocations = (lsp_offset_t *) realloc(
+                relocations, relocation_capacity * sizeof(lsp_offset_t)
+            );
+            assert(relocations != NULL);
+        }
+        relocations[relocation_count++] = offset;
+
+        lsp_op_t op;
+        memcpy(&op, header->data, sizeof(op));
+        size_t index = 0;
+        while (index < op_count && op_values[index] != op) {
+            index++;
+        }
+        if (index < op_count) {
+            continue;
+        }
+
+        char const *name = lsp_image_internal_op_name(op);
+        if (name == NULL) {
+            free(op_values);
+            free(op_names);
+            free(relocations);
+            return false;
+        }
+
+        op_values = (lsp_op_t *) realloc(
+            op_values, (op_count + 1) * sizeof(lsp_op_t)
+        );
+        op_names = (char const **) realloc(
+            op_names, (op_count + 1) * sizeof(char const *)
+        );
+        assert(op_values != NULL && op_names != NULL);
+        op_values[op_count] = op;
+        op_names[op_count] = name;
+        op_names_size += strlen(name) + 1;
+        op_count++;
+    }
+
+    lsp_image_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LSP_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = LSP_IMAGE_VERSION;
+    header.frame_ptr = vm->ref_frame_ptr;
+    header.env_version = vm->env_version;
+
+    size_t symbols_size = 0;
+    for (lsp_sym_t i = 0; i < vm->symbol_count; i++) {
+        symbols_size += strlen(vm->symbol_names[i]) + 1;
+    }
+    header.symbols.offset = lsp_image_internal_align(sizeof(header));
+    header.symbols.count = vm->symbol_count;
+    header.symbols.size = symbols_size;
+
+    header.ops.offset = lsp_image_internal_align(
+        header.symbols.offset + header.symbols.size
+    );
+    header.ops.count = op_count;
+    header.ops.size = op_names_size;
+
+    header.relocations.offset = lsp_image_internal_align(
+        header.ops.offset + header.ops.size
+    );
+    header.relocations.count = relocation_count;
+    header.relocations.size = relocation_count * sizeof(lsp_offset_t);
+
+    header.stack.offset = lsp_image_internal_align(
+        header.relocations.offset + header.relocations.size
+    );
+    header.stack.count = vm->ref_stack_ptr;
+    header.stack.size = vm->ref_stack_ptr * sizeof(lsp_ref_t);
+
+    header.cons_heap.offset = lsp_image_internal_align(
+        header.stack.offset + header.stack.size
+    );
+    header.cons_heap.count = vm->cons_heap_ptr;
+    header.cons_heap.size = vm->cons_heap_ptr * sizeof(lsp_cons_t);
+
+    header.data_heap.offset = lsp_image_internal_align(
+        header.cons_heap.offset + header.cons_heap.size
+    );
+    header.data_heap.count = vm->data_heap_ptr;
+    header.data_heap.size = (size_t) vm->data_heap_ptr * 8;
+
+    char *symbols = (char *) malloc(symbols_size + 1);
+    char *ops = (char *) malloc(op_names_size + 1);
+    assert(symbols != NULL && ops != NULL);
+    for (size_t i = 0, at = 0; i < vm->symbol_count; i++) {
+        size_t length = strlen(vm->symbol_names[i]) + 1;
+        memcpy(&symbols[at], vm->symbol_names[i], length);
+        at += length;
+    }
+    for (size_t i = 0, at = 0; i < op_count; i++) {
+        size_t length = strlen(op_names[i]) + 1;
+        memcpy(&ops[at], op_names[i], length);
+        at += length;
+    }
+
+    // Swap every op for its index in the list of names while the data heap is
+    // written out, and then swap them back.
+    for (size_t i = 0; i < relocation_count; i++) {
+        lsp_header_t *entry = lsp_heap_get_header_at(relocations[i]);
+
+        lsp_op_t op;
+        memcpy(&op, entry->data, sizeof(op));
+        uint64_t index = 0;
+        while (op_values[index] != op) {
+            index++;
+        }
+        memcpy(entry->data, &index, sizeof(index));
+    }
+
+    bool ok = false;
+    FILE *file = fopen(path, "wb");
+    if (file != NULL) {
+        ok = (
+            fwrite(&header, sizeof(header), 1, file) == 1 &&
+            lsp_image_internal_write(file, &header.symbols, symbols) &&
+            lsp_image_internal_write(file, &header.ops, ops) &&
+            lsp_image_internal_write(
+                file, &header.relocations, relocations
+            ) &&
+            lsp_image_internal_write(file, &header.stack, vm->ref_stack) &&
+            lsp_image_internal_write(file, &header.cons_heap, vm->cons_heap) &&
+            lsp_image_internal_write(file, &header.data_heap, vm->data_heap)
+        );
+
+        // Pad the file out to a whole number of pages so that the last
+        // section can be mapped.
+        fflush(file);
+        uint64_t end = lsp_image_internal_align(
+            header.data_heap.offset + header.data_heap.size
+        );
+        ok = ok && ftruncate(fileno(file), (off_t) end) == 0;
+        ok = fclose(file) == 0 && ok;
+    }
+
+    for (size_t i = 0; i < relocation_count; i++) {
+        lsp_header_t *entry = lsp_heap_get_header_at(relocations[i]);
+
+        uint64_t index;
+        memcpy(&index, entry->data, sizeof(index));
+        memcpy(entry->data, &op_values[index], sizeof(lsp_op_t));
+    }
+
+    free(symbols);
+    free(ops);
+    free(op_values);
+    free(op_names);
+    free(relocations);
+    return ok;
+}
+
+/**
+ * Reads a section that isn't mapped into a newly allocated buffer, with an
+ * extra null byte at the end.
+ */
+static char *lsp_image_internal_read(
+    int fd, lsp_image_section_t const *section
+) {
+    char *buffer = (char *) malloc(section->size + 1);
+    assert(buffer != NULL);
+    buffer[section->size] = '\0';
+
+    size_t done = 0;
+    while (done < section->size) {
+        ssize_t result = pread(
+            fd, buffer + done, section->size - done,
+            (off_t) (section->offset + done)
+        );
+        if (result <= 0) {
+            free(buffer);
+            return NULL;
+        }
+        done += (size_t) result;
+    }
+    return buffer;
+}
+
+/**
+ * Maps a heap section from an image over the start of the range reserved for
+ * the heap.  The mapping is private, so pages are only copied when they are
+ * written to.
+ */
+static void lsp_image_internal_map(
+    int fd, lsp_image_section_t const *section, void *heap
+) {
+    if (section->size == 0) {
+        return;
+    }
+    void *result = mmap(
+        heap, section->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+        fd, (off_t) section->offset
+    );
+    assert(result == heap);
+    (void) result;
+}
+
+/**
+ * Returns true if `section` lies entirely within a file of `file_size` bytes
+ * and, if `element_size` is not zero, is exactly big enough to hold `count`
+ * elements of that size.
+ */
+static bool lsp_image_internal_check_section(
+    lsp_image_section_t const *section, uint64_t file_size,
+    uint64_t element_size
+) {
+    if (
+        section->offset > file_size ||
+        section->size > file_size - section->offset
+    ) {
+        return false;
+    }
+    if (element_size == 0) {
+        return true;
+    }
+    return (
+        section->count <= UINT64_MAX / element_size &&
+        section->size == section->count * element_size
+    );
+}
+
+/**
+ * Returns true if a section read by `lsp_image_internal_read` holds exactly
+ * `count` null terminated names, with nothing after the last of them.
+ */
+static bool lsp_image_internal_check_names(
+    char const *names, lsp_image_section_t const *section
+) {
+    uint64_t found = 0;
+    for (uint64_t at = 0; at < section->size; at++) {
+        if (names[at] == '\0') {
+            found++;
+        }
+    }
+    return (
+        found == section->count &&
+        (section->size == 0 || names[section->size - 1] == '\0')
+    );
+}
+
+/**
+ * Returns true if interning the `count` names in `names`, in order, in a new
+ * VM would give each of them its index as its id.  This requires the names
+ * to start with the symbols that every VM interns when it is created, and to
+ * all be different.
+ */
+static bool lsp_image_internal_check_symbols(
+    char const *names, uint64_t count
+) {
+    size_t nbuiltins = sizeof(symbol_builtin_names) / sizeof(char const *);
+    if (count < nbuiltins) {
+        return false;
+    }
+
+    uint64_t capacity = SYMBOL_INDEX_MIN;
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
+    uint64_t mask = capacity - 1;
+    char const **index = (char const **) calloc(
+        capacity, sizeof(char const *)
+    );
+    assert(index != NULL);
+
+    bool ok = true;
+    char const *name = names;
+    for (uint64_t i = 0; ok && i < count; i++) {
+        size_t length = strlen(name);
+        if (i < nbuiltins && strcmp(name, symbol_builtin_names[i]) != 0) {
+            ok = false;
+        }
+
+        uint64_t slot = lsp_symbol_hash(name, length) & mask;
+        while (ok && index[slot] != NULL) {
+            ok = strcmp(index[slot], name) != 0;
+            slot = (slot + 1) & mask;
+        }
+        index[slot] = name;
+        name += length + 1;
+    }
+
+    free(index);
+    return ok;
+}
+
+/**
+ * Returns true if every entry in the relocation table points to the header of
+ * an op on the data heap, holding the index of one of the names in the ops
+ * section.  Entries must be in increasing order, so no two of them can point
+ * to the same op, and each op must fit inside the heap.  Only the entries
+ * themselves are read from the file.
+ */
+static bool lsp_image_internal_check_relocations(
+    int fd, lsp_image_header_t const *header,
+    lsp_offset_t const *relocations
+) {
+    for (uint64_t i = 0; i < header->relocations.count; i++) {
+        uint64_t offset = relocations[i];
+        if (i > 0 && offset <= relocations[i - 1]) {
+            return false;
+        }
+        if (offset + 2 > header->data_heap.count) {
+            return false;
+        }
+
+        char buffer[sizeof(lsp_header_t) + sizeof(uint64_t)];
+        off_t at = (off_t) (header->data_heap.offset + offset * 8);
+        if (pread(fd, buffer, sizeof(buffer), at) != sizeof(buffer)) {
+            return false;
+        }
+
+        lsp_header_t entry;
+        uint64_t index;
+        memcpy(&entry, buffer, sizeof(entry));
+        memcpy(&index, buffer + sizeof(entry), sizeof(index));
+        if (
+            entry.type != LSP_TYPE_OP ||
+            (uint64_t) entry.size * 8 < sizeof(lsp_op_t) ||
+            offset + 1 + entry.size > header->data_heap.count ||
+            index >= header->ops.count
+        ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+lsp_vm_t *lsp_vm_create_from_image(
+    char const *path, lsp_vm_config_t const *config
+) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // Check everything that could make the image unusable before creating
+    // the VM.  Once the VM exists, nothing below can fail.
+    struct stat info;
+    lsp_image_header_t header;
+    if (
+        fstat(fd, &info) != 0 ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, LSP_IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != LSP_IMAGE_VERSION
+    ) {
+        close(fd);
+        return NULL;
+    }
+
+    uint64_t file_size = (uint64_t) info.st_size;
+    size_t cons_max = config->cons_heap_max;
+    if (cons_max == 0) {
+        cons_max = CONS_HEAP_MAX_DEFAULT;
+    }
+    size_t data_max = config->data_heap_max;
+    if (data_max == 0) {
+        data_max = DATA_HEAP_MAX_DEFAULT;
+    }
+    if (
+        !lsp_image_internal_check_section(&header.symbols, file_size, 0) ||
+        !lsp_image_internal_check_section(&header.ops, file_size, 0) ||
+        !lsp_image_internal_check_section(
+            &header.relocations, file_size, sizeof(lsp_offset_t)
+        ) ||
+        !lsp_image_internal_check_section(
+            &header.stack, file_size, sizeof(lsp_ref_t)
+        ) ||
+        !lsp_image_internal_check_section(
+            &header.cons_heap, file_size, sizeof(lsp_cons_t)
+        ) ||
+        !lsp_image_internal_check_section(&header.data_heap, file_size, 8) ||
+        header.cons_heap.offset % LSP_IMAGE_ALIGN != 0 ||
+        header.data_heap.offset % LSP_IMAGE_ALIGN != 0 ||
+        header.stack.count > REF_STACK_MAX ||
+        header.frame_ptr < 0 ||
+        (uint64_t) header.frame_ptr > header.stack.count ||
+        header.cons_heap.count > cons_max ||
+        header.data_heap.count > data_max ||
+        header.data_heap.count == 0
+    ) {
+        close(fd);
+        return NULL;
+    }
+
+    char *symbols = lsp_image_internal_read(fd, &header.symbols);
+    char *op_names = lsp_image_internal_read(fd, &header.ops);
+    lsp_offset_t *relocations = (lsp_offset_t *) lsp_image_internal_read(
+        fd, &header.relocations
+    );
+    char *stack = lsp_image_internal_read(fd, &header.stack);
+    bool resolved = (
+        symbols != NULL && op_names != NULL && relocations != NULL &&
+        stack != NULL &&
+        lsp_image_internal_check_names(symbols, &header.symbols) &&
+        lsp_image_internal_check_names(op_names, &header.ops) &&
+        lsp_image_internal_check_symbols(symbols, header.symbols.count) &&
+        lsp_image_internal_check_relocations(fd, &header, relocations)
+    );
+
+    // Each name takes at least one byte, so this is no bigger than the file.
+    lsp_op_t *ops = (lsp_op_t *) malloc(
+        ((resolved ? header.ops.count : 0) + 1) * sizeof(lsp_op_t)
+    );
+    assert(ops != NULL);
+    char const *name = op_names;
+    for (size_t i = 0; resolved && i < header.ops.count; i++) {
+        ops[i] = lsp_image_internal_op_by_name(name);
+        resolved = ops[i] != NULL;
+        name += strlen(name) + 1;
+    }
+    if (!resolved) {
+        free(symbols);
+        free(op_names);
+        free(relocations);
+        free(stack);
+        free(ops);
+        close(fd);
+        return NULL;
+    }
+
+    lsp_vm_t *previous = vm;
+    vm = lsp_vm_create(config);
+
+    // Intern the symbols in their original order.  The symbols interned by
+    // the VM itself always come first, so this reproduces every id.
+    name = symbols;
+    for (lsp_sym_t i = 0; i < header.symbols.count; i++) {
+        lsp_sym_t sym = lsp_intern(name);
+        assert(sym == i);
+        (void) sym;
+        name += strlen(name) + 1;
+    }
+
+    lsp_image_internal_map(fd, &header.cons_heap, vm->cons_heap);
+    lsp_image_internal_map(fd, &header.data_heap, vm->data_heap);
+    lsp_vm_internal_grow(
+        header.cons_heap.count > vm->cons_heap_size ?
+            header.cons_heap.count : vm->cons_heap_size,
+        header.data_heap.count > vm->data_heap_size ?
+            header.data_heap.count : vm->data_heap_size
+    );
+    vm->cons_heap_ptr = header.cons_heap.count;
+    vm->data_heap_ptr = header.data_heap.count;
+
+    memcpy(vm->ref_stack, stack, header.stack.size);
+    vm->ref_stack_ptr = header.stack.count;
+    vm->ref_frame_ptr = header.frame_ptr;
+    vm->env_version = header.env_version;
+    vm->stats.stack_high_water = (size_t) vm->ref_stack_ptr;
+
+    // Only the entries listed in the relocation table are touched, so the
+    // only pages copied from the image are the ones that hold ops.  Nothing
+    // else on the data heap is read or modified until it is used.
+    for (size_t i = 0; i < header.relocations.count; i++) {
+        lsp_header_t *entry = lsp_heap_get_header_at(relocations[i]);
+        assert(entry->type == LSP_TYPE_OP);
+
+        uint64_t index;
+        memcpy(&index, entry->data, sizeof(index));
+        assert(index < header.ops.count);
+        memcpy(entry->data, &ops[index], sizeof(lsp_op_t));
+    }
+
+    // The image was saved straight after a full collection, so everything in
+    // it belongs to the old generation.
+    vm->cons_heap_old_ptr = vm->cons_heap_ptr;
+    vm->data_heap_old_ptr = vm->data_heap_ptr;
+    lsp_gc_internal_reset_limits();
+    lsp_gc_internal_reset_nursery();
+
+    free(symbols);
+    free(op_names);
+    free(relocations);
+    free(stack);
+    free(ops);
+    close(fd);
+
+    lsp_vm_t *created = vm;
+    vm = previous;
+    return created;
+}
+
+bool lsp_vm_init_from_image(
+    char const *path, lsp_vm_config_t const *config
+) {
+    lsp_vm_t *created = lsp_vm_create_from_image(path, config);
+    if (created == NULL) {
+        return false;
+    }
+    vm = created;
+    return true;
+}
+
+/**
+ * Heap operations.
+ */
+static lsp_cons_t *lsp_heap_get_cons(lsp_ref_t ref) {
+    assert(lsp_ref_tag(ref) == LSP_REF_CONS);
+    assert(lsp_ref_offset(ref) < vm->cons_heap_ptr);
+
+    return &vm->cons_heap[lsp_ref_offset(ref)];
+}
+
+
+static lsp_header_t *lsp_heap_get_header(lsp_ref_t ref) {
+    assert(lsp_ref_tag(ref) == LSP_REF_DATA);
+    assert(lsp_ref_offset(ref) < vm->data_heap_ptr);
+
+    return lsp_heap_get_header_at(lsp_ref_offset(ref));
+}
+
+
+/**
+ * Returns the header of the object starting at `offset` words into the data
+ * heap, without checking that there is one.
+ */
+static lsp_header_t *lsp_heap_get_header_at(lsp_offset_t offset) {
+    return (lsp_header_t *) &vm->data_heap[(size_t) offset << 3];
+}
+
+
+static lsp_type_t lsp_heap_get_type(lsp_ref_t ref) {
+    if (lsp_ref_tag(ref) == LSP_REF_CONS) {
+        return LSP_TYPE_CONS;
+    }
+
+    if (lsp_ref_tag(ref) == LSP_REF_INT) {
+        return LSP_TYPE_INT;
+    }
+
+    if (lsp_ref_tag(ref) == LSP_REF_SYM) {
+        return LSP_TYPE_SYM;
+    }
+
+    if (lsp_ref_offset(ref) == 0) {
+        return LSP_TYPE_NULL;
+    }
+
+    lsp_header_t *header = lsp_heap_get_header(ref);
+    return header->type;
+}
+
+
+static char *lsp_heap_get_data(lsp_ref_t ref) {
+    lsp_header_t *header = lsp_heap_get_header(ref);
+    return header->data;
+}
+
+
+/**
+ * Allocation profiling.
+ */
+static void lsp_profile_internal_append(
+    char **cursor, char const *end, char const *text
+) {
+    while (*text && *cursor < end) {
+        *(*cursor)++ = *text++;
+    }
+}
+
+/**
+ * Writes a rendering of `ref` at `*cursor`, stopping at `end`.  Lists nested
+ * more than `PROFILE_RENDER_DEPTH` deep are elided.
+ */
+static void lsp_profile_internal_render(
+    lsp_ref_t ref, int depth, char **cursor, char const *end
+) {
+    char number[24];
+
+    switch (lsp_heap_get_type(ref)) {
+    case LSP_TYPE_NULL:
+        lsp_profile_internal_append(cursor, end, "()");
+        break;
+    case LSP_TYPE_CONS:
+        if (depth >= PROFILE_RENDER_DEPTH) {
+            lsp_profile_internal_append(cursor, end, "(...)");
+            break;
+        }
+        lsp_profile_internal_append(cursor, end, "(");
+        lsp_profile_internal_render(
+            lsp_heap_get_cons(ref)->car, depth + 1, cursor, end
+        );
+        ref = lsp_heap_get_cons(ref)->cdr;
+        while (lsp_ref_tag(ref) == LSP_REF_CONS && *cursor < end) {
+            lsp_profile_internal_append(cursor, end, " ");
+            lsp_profile_internal_render(
+                lsp_heap_get_cons(ref)->car, depth + 1, cursor, end
+            );
+            ref = lsp_heap_get_cons(ref)->cdr;
+        }
+        if (lsp_heap_get_type(ref) != LSP_TYPE_NULL) {
+            lsp_profile_internal_append(cursor, end, " . ");
+            lsp_profile_internal_render(ref, depth + 1, cursor, end);
+        }
+        lsp_profile_internal_append(cursor, end, ")");
+        break;
+    case LSP_TYPE_INT:
+        snprintf(
+            number, sizeof(number), "%" PRId64, (int64_t) lsp_ref_int(ref)
+        );
+        lsp_profile_internal_append(cursor, end, number);
+        break;
+    case LSP_TYPE_SYM:
+        lsp_profile_internal_append(
+            cursor, end, vm->symbol_names[lsp_ref_sym(ref)]
+        );
+        break;
+    case LSP_TYPE_STR:
+        lsp_profile_internal_append(cursor, end, "\"");
+        lsp_profile_internal_append(cursor, end, lsp_heap_get_data(ref));
+        lsp_profile_internal_append(cursor, end, "\"");
+        break;
+    case LSP_TYPE_OP:
+        lsp_profile_internal_append(cursor, end, "<builtin>");
+        break;
+    case LSP_TYPE_VEC:
+        lsp_profile_internal_append(cursor, end, "#(...)");
+        break;
+    case LSP_TYPE_TABLE:
+        lsp_profile_internal_append(cursor, end, "<table>");
+        break;
+    case LSP_TYPE_CODE:
+        lsp_profile_internal_append(cursor, end, "<bytecode>");
+        break;
+    }
+}
+
+/**
+ * Attributes a sampled allocation of `bytes` bytes to the current site.
+ */
+static void lsp_profile_internal_sample(size_t bytes) {
+    char form[PROFILE_FORM_MAX + 1] = "-";
+    if (vm->profile_depth > 0) {
+        char *cursor = form;
+        char *end = form + PROFILE_FORM_MAX;
+        lsp_profile_internal_render(
+            vm->profile_forms[vm->profile_depth - 1], 0, &cursor, end
+        );
+        if (cursor == end) {
+            memcpy(end - 3, "...", 3);
+        }
+        *cursor = '\0';
+    }
+
+    lsp_profile_site_t *site = NULL;
+    for (size_t i = 0; i < vm->profile_site_count; i++) {
+        if (
+            vm->profile_sites[i].op == vm->profile_op &&
+            strcmp(vm->profile_sites[i].form, form) == 0
+        ) {
+            site = &vm->profile_sites[i];
+            break;
+        }
+    }
+
+    if (site == NULL) {
+        if (vm->profile_site_count == vm->profile_site_capacity) {
+            vm->profile_site_capacity = (
+                vm->profile_site_capacity ? 2 * vm->profile_site_capacity : 64
+            );
+            vm->profile_sites = (lsp_profile_site_t *) realloc(
+                vm->profile_sites,
+                vm->profile_site_capacity * sizeof(lsp_profile_site_t)
+            );
+            assert(vm->profile_sites != NULL);
+        }
+        site = &vm->profile_sites[vm->profile_site_count++];
+        site->form = strdup(form);
+        assert(site->form != NULL);
+        site->op = vm->profile_op;
+        site->allocations = 0;
+        site->bytes = 0;
+    }
+
+    site->allocations += vm->profile_interval;
+    site->bytes += bytes * vm->profile_interval;
+}
+
+/**
+ * Counts an allocation of `bytes` bytes, sampling it if profiling is enabled
+ * and it is due.
+ */
+static inline void lsp_profile_internal_count(size_t bytes) {
+    if (vm->profile_interval && --vm->profile_countdown == 0) {
+        vm->profile_countdown = vm->profile_interval;
+        lsp_profile_internal_sample(bytes);
+    }
+}
+
+static int lsp_profile_internal_compare(void const *a, void const *b) {
+    size_t bytes_a = ((lsp_profile_site_t const *) a)->bytes;
+    size_t bytes_b = ((lsp_profile_site_t const *) b)->bytes;
+    return (bytes_a < bytes_b) - (bytes_a > bytes_b);
+}
+
+void lsp_profile_set_interval(unsigned int interval) {
+    if (interval && vm->profile_forms == NULL) {
+        // Every form that is being evaluated has at least two references on
+        // the stack, so the stack limit also bounds the nesting depth.
+        vm->profile_forms = (lsp_ref_t *) malloc(
+            REF_STACK_MAX * sizeof(lsp_ref_t)
+        );
+        assert(vm->profile_forms != NULL);
+        vm->profile_saved_ops = (lsp_op_t *) malloc(
+            REF_STACK_MAX * sizeof(lsp_op_t)
+        );
+        assert(vm->profile_saved_ops != NULL);
+    }
+    vm->profile_interval = interval;
+    vm->profile_countdown = interval;
 }
 
+bool lsp_profile_enabled(void) {
+    return vm->profile_forms != NULL;
+}
 
-static lsp_header_t *lsp_heap_get_header(lsp_ref_t ref) {
-    assert(!ref.is_cons);
-    assert(ref.offset <= DATA_HEAP_MAX);
-    assert(ref.offset < data_heap_ptr);
-
-    return (lsp_header_t *) &data_heap[ref.offset << 3];
+unsigned int lsp_env_version(void) {
+    return vm->env_version;
 }
 
+void lsp_env_changed(void) {
+    vm->env_version++;
+}
 
-static lsp_type_t lsp_heap_get_type(lsp_ref_t ref) {
-    if (ref.is_cons) {
-        return LSP_TYPE_CONS;
+void lsp_profile_enter_form(int offset) {
+    if (vm->profile_forms == NULL) {
+        return;
     }
+    assert(vm->profile_depth < REF_STACK_MAX);
+    vm->profile_forms[vm->profile_depth] = lsp_get_at_offset(offset);
+    vm->profile_saved_ops[vm->profile_depth] = vm->profile_op;
+    vm->profile_depth++;
+    vm->profile_op = NULL;
+}
 
-    if (ref.offset == 0) {
-        return LSP_TYPE_NULL;
+void lsp_profile_leave_form(void) {
+    if (vm->profile_forms == NULL) {
+        return;
     }
+    assert(vm->profile_depth > 0);
+    vm->profile_depth--;
+    vm->profile_op = vm->profile_saved_ops[vm->profile_depth];
+}
 
-    lsp_header_t *header = lsp_heap_get_header(ref);
-    return header->type;
+lsp_op_t lsp_profile_enter_op(lsp_op_t op) {
+    lsp_op_t previous = vm->profile_op;
+    vm->profile_op = op;
+    return previous;
 }
 
+void lsp_profile_write(FILE *stream) {
+    qsort(
+        vm->profile_sites, vm->profile_site_count, sizeof(lsp_profile_site_t),
+        lsp_profile_internal_compare
+    );
 
-static char *lsp_heap_get_data(lsp_ref_t ref) {
-    lsp_header_t *header = lsp_heap_get_header(ref);
-    return header->data;
+    fprintf(stream, "allocations\tbytes\tbuiltin\tform\n");
+    for (size_t i = 0; i < vm->profile_site_count; i++) {
+        lsp_profile_site_t *site = &vm->profile_sites[i];
+
+        char const *name = "-";
+        if (site->op != NULL) {
+            name = lsp_image_internal_op_name(site->op);
+            if (name == NULL) {
+                name = "?";
+            }
+        }
+
+        fprintf(
+            stream, "%zu\t%zu\t%s\t%s\n",
+            site->allocations, site->bytes, name, site->form
+        );
+    }
 }
 
 
 static lsp_ref_t lsp_heap_alloc_null(void) {
     // Null can only be initialised as the first item on the data-heap.
-    assert(data_heap_ptr == 0);
+    assert(vm->data_heap_ptr == 0);
 
     // Construct a reference to the data pointed to by ptr.
-    lsp_ref_t ref;
-    ref.is_cons = false;
-    ref.offset = 0;
+    lsp_ref_t ref = lsp_ref_make(LSP_REF_DATA, 0);
 
     // Bump the ptr;
-    data_heap_ptr += 1;
+    vm->data_heap_ptr += 1;
 
     // Initialise the header.
     // TODO might be worth clearing the data.
@@ -447,17 +3399,16 @@ static lsp_ref_t lsp_heap_alloc_null(void) {
 
 
 static lsp_ref_t lsp_heap_alloc_cons(void) {
-    assert(cons_heap_ptr < CONS_HEAP_MAX);
-
-    lsp_gc_maybe_collect();
+    lsp_profile_internal_count(sizeof(lsp_cons_t));
+    lsp_gc_maybe_collect(1, 0);
+    lsp_vm_internal_ensure_committed(1, 0);
 
     // Construct a reference.
-    lsp_ref_t ref;
-    ref.is_cons = true;
-    ref.offset = cons_heap_ptr;
+    lsp_ref_t ref = lsp_ref_make(LSP_REF_CONS, vm->cons_heap_ptr);
 
     // Bump the ptr.
-    cons_heap_ptr += 1;
+    vm->cons_heap_ptr += 1;
+    vm->stats.cons_allocations += 1;
 
     // Initialise the cons cell.
     lsp_cons_t *cons = lsp_heap_get_cons(ref);
@@ -469,27 +3420,29 @@ static lsp_ref_t lsp_heap_alloc_cons(void) {
 
 
 static lsp_ref_t lsp_heap_alloc_data(lsp_type_t type, size_t size) {
-    assert(size < DATA_HEAP_MAX);
+    assert(size / 8 < vm->data_heap_max);
 
-    lsp_gc_maybe_collect();
+    size_t nwords = ((sizeof(lsp_header_t) + size - 1) / 8) + 1;
+    lsp_profile_internal_count(nwords * 8);
+    lsp_gc_maybe_collect(0, nwords);
+    lsp_vm_internal_ensure_committed(0, nwords);
 
     // Offset zero is reserved for null.
-    assert(data_heap_ptr >= 1);
-    // TODO check upper bound.
+    assert(vm->data_heap_ptr >= 1);
 
     // Construct a reference to the data pointed to by ptr.
-    lsp_ref_t ref;
-    ref.is_cons = false;
-    ref.offset = data_heap_ptr;
+    lsp_ref_t ref = lsp_ref_make(LSP_REF_DATA, vm->data_heap_ptr);
 
     // Bump the ptr;
-    data_heap_ptr += ((sizeof(lsp_header_t) + size - 1) / 8) + 1;
+    vm->data_heap_ptr += nwords;
+    vm->stats.data_allocations += 1;
+    vm->stats.data_bytes_allocated += nwords * 8;
 
     // Initialise the header.
     // TODO might be worth clearing the data.
     lsp_header_t *header = lsp_heap_get_header(ref);
     header->type = type;
-    header->size = ((size - 1) / 8) + 1;
+    header->size = (size + 7) / 8;
 
     return ref;
 }
@@ -498,7 +3451,7 @@ static lsp_ref_t lsp_heap_alloc_data(lsp_type_t type, size_t size) {
  * Stack operations.
  */
 lsp_fp_t lsp_get_fp(void) {
-    return (lsp_fp_t) ref_frame_ptr;
+    return (lsp_fp_t) vm->ref_frame_ptr;
 }
 
 void lsp_shrink_frame(int nargs) {
@@ -507,12 +3460,12 @@ void lsp_shrink_frame(int nargs) {
         // lsp_abort("new frame cannot contain a negative number of references");
     }
 
-    if (nargs > (ref_stack_ptr - ref_frame_ptr)) {
+    if (nargs > (vm->ref_stack_ptr - vm->ref_frame_ptr)) {
         assert(false);
         // lsp_abort("not enough values to create new frame");
     }
 
-    ref_frame_ptr = ref_stack_ptr - nargs;
+    vm->ref_frame_ptr = vm->ref_stack_ptr - nargs;
 }
 
 void lsp_restore_fp(lsp_fp_t fp) {
@@ -521,48 +3474,67 @@ void lsp_restore_fp(lsp_fp_t fp) {
         // lsp_abort("cannot restore frame pointer to invalid value");
     }
 
-    if (fp > ref_stack_ptr) {
+    if (fp > vm->ref_stack_ptr) {
         assert(false);
         // lsp_abort("cannot restore frame that has been completely popped");
     }
 
-    ref_frame_ptr = fp;
+    vm->ref_frame_ptr = fp;
 }
 
 static void lsp_push_ref(lsp_ref_t ref) {
-    ref_stack[ref_stack_ptr] = ref;
-    ref_stack_ptr++;
+    if (vm->ref_stack_ptr >= REF_STACK_MAX) {
+        assert(false);
+        // lsp_abort("stack overflow");
+    }
+
+    vm->ref_stack[vm->ref_stack_ptr] = ref;
+    vm->ref_stack_ptr++;
+    if ((size_t) vm->ref_stack_ptr > vm->stats.stack_high_water) {
+        vm->stats.stack_high_water = (size_t) vm->ref_stack_ptr;
+    }
+}
+
+/**
+ * Returns the index into the reference stack of `offset`, without checking
+ * that it falls within the current frame.
+ */
+static int lsp_unchecked_index(int offset) {
+    if (offset < 0) {
+        return vm->ref_frame_ptr - offset - 1;
+    }
+    return vm->ref_stack_ptr - offset - 1;
 }
 
 static lsp_ref_t lsp_get_at_offset(int offset) {
     int abs_offset;
     if (offset < 0) {
         // Offset is less than zero so is relative to the frame pointer.
-        assert(ref_frame_ptr - ref_stack_ptr <= offset);
-        abs_offset = ref_frame_ptr - offset - 1;
+        assert(vm->ref_frame_ptr - vm->ref_stack_ptr <= offset);
+        abs_offset = vm->ref_frame_ptr - offset - 1;
     } else {
         // Offset is greater than zero so is relative to the stack pointer.
-        assert(ref_stack_ptr - ref_frame_ptr > offset);
-        abs_offset = ref_stack_ptr - offset - 1;
+        assert(vm->ref_stack_ptr - vm->ref_frame_ptr > offset);
+        abs_offset = vm->ref_stack_ptr - offset - 1;
     }
-    assert(abs_offset >= ref_frame_ptr);
-    assert(abs_offset < ref_stack_ptr);
-    return ref_stack[abs_offset];
+    assert(abs_offset >= vm->ref_frame_ptr);
+    assert(abs_offset < vm->ref_stack_ptr);
+    return vm->ref_stack[abs_offset];
 }
 
 static void lsp_put_at_offset(lsp_ref_t value, int offset) {
     int abs_offset;
     if (offset < 0) {
         // Offset is less than zero so is relative to the frame pointer.
-        assert(ref_frame_ptr - ref_stack_ptr <= offset);
-        abs_offset = ref_frame_ptr - offset - 1;
+        assert(vm->ref_frame_ptr - vm->ref_stack_ptr <= offset);
+        abs_offset = vm->ref_frame_ptr - offset - 1;
     } else {
         // Offset is greater than zero so is relative to the stack pointer.
-        assert(ref_stack_ptr - ref_frame_ptr > offset);
-        abs_offset = ref_stack_ptr - offset - 1;
+        assert(vm->ref_stack_ptr - vm->ref_frame_ptr > offset);
+        abs_offset = vm->ref_stack_ptr - offset - 1;
     }
-    assert(abs_offset >= ref_frame_ptr && abs_offset < ref_stack_ptr);
-    ref_stack[abs_offset] = value;
+    assert(abs_offset >= vm->ref_frame_ptr && abs_offset < vm->ref_stack_ptr);
+    vm->ref_stack[abs_offset] = value;
 }
 
 void lsp_push_null(void) {
@@ -574,13 +3546,9 @@ void lsp_push_cons(void) {
     lsp_push_ref(expr);
 }
 
-void lsp_push_int(int value) {
-    // Allocate space.
-    lsp_ref_t ref = lsp_heap_alloc_data(LSP_TYPE_INT, sizeof(value));
-
-    // Copy the value into the allocated space.
-    char *data = lsp_heap_get_data(ref);
-    memcpy(data, &value, sizeof(value));
+void lsp_push_int(lsp_int_t value) {
+    // Integers are stored in the reference itself, so no space is allocated.
+    lsp_ref_t ref = lsp_ref_make_int(value);
 
     // Save the reference to the stack.
     lsp_push_ref(ref);
@@ -603,8 +3571,91 @@ static void lsp_push_null_terminated(lsp_type_t type, char const *value) {
     lsp_push_ref(ref);
 }
 
+static uint32_t lsp_symbol_hash(char const *name, size_t length) {
+    // FNV-1a.
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void lsp_symbol_index_insert(lsp_sym_t sym) {
+    lsp_sym_t mask = vm->symbol_index_capacity - 1;
+    char const *name = vm->symbol_names[sym];
+    lsp_sym_t slot = lsp_symbol_hash(name, strlen(name)) & mask;
+    while (vm->symbol_index[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    vm->symbol_index[slot] = sym + 1;
+}
+
+lsp_sym_t lsp_intern(char const *name) {
+    return lsp_intern_length(name, strlen(name));
+}
+
+lsp_sym_t lsp_intern_length(char const *name, size_t length) {
+    lsp_sym_t mask = vm->symbol_index_capacity - 1;
+    lsp_sym_t slot = lsp_symbol_hash(name, length) & mask;
+    while (vm->symbol_index[slot] != 0) {
+        lsp_sym_t sym = vm->symbol_index[slot] - 1;
+        char const *candidate = vm->symbol_names[sym];
+        if (
+            strncmp(candidate, name, length) == 0 &&
+            candidate[length] == '\0'
+        ) {
+            return sym;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    // Not seen before.  Copy the name into the table.
+    if (vm->symbol_count == vm->symbol_capacity) {
+        vm->symbol_capacity = (
+            vm->symbol_capacity ? vm->symbol_capacity * 2 : 0x40
+        );
+        vm->symbol_names = (char **) realloc(
+            vm->symbol_names, vm->symbol_capacity * sizeof(char *)
+        );
+        assert(vm->symbol_names != NULL);
+    }
+    lsp_sym_t sym = vm->symbol_count++;
+    char *copy = (char *) malloc(length + 1);
+    assert(copy != NULL);
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    vm->symbol_names[sym] = copy;
+
+    if (2 * vm->symbol_count <= vm->symbol_index_capacity) {
+        vm->symbol_index[slot] = sym + 1;
+        return sym;
+    }
+
+    // Keep the index at most half full so that probe sequences stay short.
+    free(vm->symbol_index);
+    vm->symbol_index_capacity *= 2;
+    vm->symbol_index = (lsp_sym_t *) calloc(
+        vm->symbol_index_capacity, sizeof(lsp_sym_t)
+    );
+    assert(vm->symbol_index != NULL);
+    for (lsp_sym_t i = 0; i < vm->symbol_count; i++) {
+        lsp_symbol_index_insert(i);
+    }
+    return sym;
+}
+
 void lsp_push_symbol(char const *value) {
-    lsp_push_null_terminated(LSP_TYPE_SYM, value);
+    lsp_push_symbol_id(lsp_intern(value));
+}
+
+void lsp_push_symbol_id(lsp_sym_t sym) {
+    assert(sym < vm->symbol_count);
+
+    // Symbols are stored in the reference itself, so no space is allocated.
+    lsp_ref_t ref = lsp_ref_make(LSP_REF_SYM, sym);
+
+    lsp_push_ref(ref);
 }
 
 void lsp_push_string(char const *value) {
@@ -623,17 +3674,24 @@ void lsp_push_op(lsp_op_t op) {
     lsp_push_ref(ref);
 }
 
-int lsp_read_int(int offset) {
+lsp_int_t lsp_read_int(int offset) {
     lsp_ref_t ref = lsp_get_at_offset(offset);
-    assert(lsp_heap_get_type(ref) == LSP_TYPE_INT);
-    int *data = (int *) lsp_heap_get_data(ref);
-    return *data;
+    assert(lsp_ref_tag(ref) == LSP_REF_INT);
+    return lsp_ref_int(ref);
 }
 
-char const *lsp_borrow_symbol(int offset) {
+lsp_sym_t lsp_read_symbol(int offset) {
     lsp_ref_t ref = lsp_get_at_offset(offset);
-    assert(lsp_heap_get_type(ref) == LSP_TYPE_SYM);
-    return lsp_heap_get_data(ref);
+    assert(lsp_ref_tag(ref) == LSP_REF_SYM);
+    return lsp_ref_sym(ref);
+}
+
+char const *lsp_borrow_symbol(int offset) {
+    return vm->symbol_names[lsp_read_symbol(offset)];
+}
+
+bool lsp_symbol_matches_literal(char const *value) {
+    return strcmp(lsp_borrow_symbol(0), value) == 0;
 }
 
 char const *lsp_borrow_string(int offset) {
@@ -688,6 +3746,7 @@ void lsp_set_car(void) {
     lsp_ref_t car_ref = lsp_get_at_offset(1);
 
     lsp_cons_t *cons = lsp_heap_get_cons(cons_ref);
+    lsp_gc_internal_write_barrier(cons_ref, cons->car, car_ref);
     cons->car = car_ref;
 
     lsp_pop();
@@ -699,6 +3758,7 @@ void lsp_set_cdr(void) {
     lsp_ref_t cdr_ref = lsp_get_at_offset(1);
 
     lsp_cons_t *cons = lsp_heap_get_cons(cons_ref);
+    lsp_gc_internal_write_barrier(cons_ref, cons->cdr, cdr_ref);
     cons->cdr = cdr_ref;
 
     lsp_pop();
@@ -718,8 +3778,8 @@ void lsp_store(int offset) {
 }
 
 void lsp_pop(void) {
-    assert(ref_stack_ptr > ref_frame_ptr);
-    ref_stack_ptr--;
+    assert(vm->ref_stack_ptr > vm->ref_frame_ptr);
+    vm->ref_stack_ptr--;
 }
 
 void lsp_swp(int offset) {
@@ -730,11 +3790,448 @@ void lsp_swp(int offset) {
     lsp_put_at_offset(tgt, 0);
 }
 
+void lsp_reserve(int n) {
+    if (n < 0 || n > REF_STACK_MAX - vm->ref_stack_ptr) {
+        assert(false);
+        // lsp_abort("not enough space on the stack");
+    }
+}
+
+void lsp_dup_unchecked(int offset) {
+    vm->ref_stack[vm->ref_stack_ptr] = vm->ref_stack[
+        lsp_unchecked_index(offset)
+    ];
+    vm->ref_stack_ptr++;
+    if ((size_t) vm->ref_stack_ptr > vm->stats.stack_high_water) {
+        vm->stats.stack_high_water = (size_t) vm->ref_stack_ptr;
+    }
+}
+
+void lsp_store_unchecked(int offset) {
+    vm->ref_stack[lsp_unchecked_index(offset)] = vm->ref_stack[
+        vm->ref_stack_ptr - 1
+    ];
+    vm->ref_stack_ptr--;
+}
+
+void lsp_pop_unchecked(void) {
+    vm->ref_stack_ptr--;
+}
+
+void lsp_swp_unchecked(int offset) {
+    int index = lsp_unchecked_index(offset);
+    lsp_ref_t tgt = vm->ref_stack[index];
+    vm->ref_stack[index] = vm->ref_stack[vm->ref_stack_ptr - 1];
+    vm->ref_stack[vm->ref_stack_ptr - 1] = tgt;
+}
+
+/**
+ * Allocates a vector with `length` elements, each set to null.  The vector is
+ * not pushed, so nothing can trigger a collection until it has been.
+ */
+static lsp_ref_t lsp_heap_alloc_vector(size_t length) {
+    assert(length < vm->data_heap_max);
+
+    lsp_ref_t ref = lsp_heap_alloc_data(
+        LSP_TYPE_VEC, length * sizeof(lsp_ref_t)
+    );
+
+    lsp_ref_t *items = (lsp_ref_t *) lsp_heap_get_data(ref);
+    for (size_t i = 0; i < length; i++) {
+        items[i] = LSP_NULL;
+    }
+    return ref;
+}
+
+/**
+ * Returns the element at `index` in the vector at `ref`, aborting if `index`
+ * is not an integer in range.
+ */
+static lsp_ref_t *lsp_heap_get_vector_item(lsp_ref_t ref, lsp_ref_t index) {
+    assert(lsp_heap_get_type(ref) == LSP_TYPE_VEC);
+    assert(lsp_ref_tag(index) == LSP_REF_INT);
+
+    lsp_header_t *header = lsp_heap_get_header(ref);
+    lsp_int_t item = lsp_ref_int(index);
+    if (item < 0 || (uint64_t) item >= header->size) {
+        assert(false);
+        // lsp_abort("vector index out of range");
+    }
+    return &((lsp_ref_t *) header->data)[item];
+}
+
+void lsp_push_vector(size_t length) {
+    lsp_push_ref(lsp_heap_alloc_vector(length));
+}
+
+void lsp_push_vector_from_ints(lsp_int_t const *values, size_t length) {
+    lsp_ref_t ref = lsp_heap_alloc_vector(length);
+
+    lsp_ref_t *items = (lsp_ref_t *) lsp_heap_get_data(ref);
+    for (size_t i = 0; i < length; i++) {
+        items[i] = lsp_ref_make_int(values[i]);
+    }
+
+    lsp_push_ref(ref);
+}
+
+void lsp_vector(void) {
+    size_t length = lsp_stats_frame_size();
+    lsp_ref_t ref = lsp_heap_alloc_vector(length);
+
+    // The new vector is young, so filling it doesn't need a write barrier.
+    lsp_ref_t *items = (lsp_ref_t *) lsp_heap_get_data(ref);
+    for (size_t i = 0; i < length; i++) {
+        items[i] = lsp_get_at_offset((int) i);
+    }
+
+    vm->ref_stack_ptr = vm->ref_frame_ptr;
+    lsp_push_ref(ref);
+}
+
+void lsp_vector_length(void) {
+    lsp_ref_t ref = lsp_get_at_offset(0);
+    assert(lsp_heap_get_type(ref) == LSP_TYPE_VEC);
+    int length = (int) lsp_heap_get_header(ref)->size;
+
+    lsp_pop();
+    lsp_push_int(length);
+}
+
+void lsp_vector_ref(void) {
+    lsp_ref_t ref = lsp_get_at_offset(0);
+    lsp_ref_t index = lsp_get_at_offset(1);
+    lsp_ref_t item = *lsp_heap_get_vector_item(ref, index);
+
+    lsp_pop();
+    lsp_pop();
+    lsp_push_ref(item);
+}
+
+void lsp_vector_set(void) {
+    lsp_ref_t ref = lsp_get_at_offset(0);
+    lsp_ref_t index = lsp_get_at_offset(1);
+    lsp_ref_t value = lsp_get_at_offset(2);
+
+    lsp_ref_t *item = lsp_heap_get_vector_item(ref, index);
+    lsp_gc_internal_write_barrier(ref, *item, value);
+    *item = value;
+
+    lsp_pop();
+    lsp_pop();
+    lsp_pop();
+}
+
+/**
+ * Tables are stored as a data object containing two references: the number of
+ * entries, as an integer, and a vector of slots.  Each slot takes up three
+ * elements of the vector: the hash of the key, cached as an integer, the key,
+ * and the value.  Empty slots have a null hash.  The number of slots is always
+ * a power of two, and keys are found by probing linearly from their hash.
+ * Deleted entries are filled by shifting back later entries from the same
+ * run, so there are no tombstones.
+ *
+ * Keys are hashed by value rather than by location, so entries stay in the
+ * right slots when the compactor moves keys and values.  Only null, integers,
+ * symbols and strings can be used as keys.
+ */
+#define TABLE_MIN_SLOTS 8
+
+typedef struct {
+    lsp_ref_t count;
+    lsp_ref_t slots;
+} lsp_table_t;
+
+static lsp_table_t *lsp_heap_get_table(lsp_ref_t ref) {
+    assert(lsp_heap_get_type(ref) == LSP_TYPE_TABLE);
+    return (lsp_table_t *) lsp_heap_get_data(ref);
+}
+
+/**
+ * Returns a pointer to the first slot of `table`, and sets `*nslots` to the
+ * number of slots.
+ */
+static lsp_ref_t *lsp_table_internal_slots(
+    lsp_table_t *table, uint32_t *nslots
+) {
+    lsp_header_t *header = lsp_heap_get_header(table->slots);
+    *nslots = header->size / 3;
+    return (lsp_ref_t *) header->data;
+}
+
+static uint32_t lsp_table_internal_hash(lsp_ref_t key) {
+    uint32_t hash = 0;
+    switch (lsp_heap_get_type(key)) {
+    case LSP_TYPE_NULL:
+        break;
+    case LSP_TYPE_INT:
+        hash = (uint32_t) (key.bits >> LSP_REF_TAG_BITS);
+        hash ^= (uint32_t) (key.bits >> 32);
+        break;
+    case LSP_TYPE_SYM:
+        hash = (uint32_t) lsp_ref_sym(key) ^ 0x9e3779b9u;
+        break;
+    case LSP_TYPE_STR:
+        // FNV-1a.
+        hash = 0x811c9dc5u;
+        for (char const *c = lsp_heap_get_data(key); *c; c++) {
+            hash = (hash ^ (unsigned char) *c) * 0x01000193u;
+        }
+        break;
+    default:
+        assert(false);
+        // lsp_abort("unhashable key");
+    }
+
+    // Mix the bits so that sequential integers and symbols are spread across
+    // the table.
+    hash ^= hash >> 16;
+    hash *= 0x7feb352du;
+    hash ^= hash >> 15;
+    hash *= 0x846ca68bu;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static bool lsp_table_internal_equal(lsp_ref_t a, lsp_ref_t b) {
+    if (a.bits == b.bits) {
+        return true;
+    }
+    if (
+        lsp_heap_get_type(a) != LSP_TYPE_STR ||
+        lsp_heap_get_type(b) != LSP_TYPE_STR
+    ) {
+        return false;
+    }
+    return strcmp(lsp_heap_get_data(a), lsp_heap_get_data(b)) == 0;
+}
+
+/**
+ * Returns the index of the slot containing `key`, or of the empty slot that it
+ * should be inserted into if it is not in the table.
+ */
+static uint32_t lsp_table_internal_find(
+    lsp_ref_t *slots, uint32_t nslots, lsp_ref_t key, uint32_t hash
+) {
+    uint32_t mask = nslots - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        lsp_ref_t *slot = &slots[3 * i];
+        if (lsp_ref_tag(slot[0]) != LSP_REF_INT) {
+            return i;
+        }
+        if (
+            (uint32_t) lsp_ref_int(slot[0]) == hash &&
+            lsp_table_internal_equal(slot[1], key)
+        ) {
+            return i;
+        }
+    }
+}
+
+/**
+ * Doubles the number of slots in the table at the top of the stack.
+ */
+static void lsp_table_internal_grow(void) {
+    uint32_t nslots;
+    lsp_table_internal_slots(
+        lsp_heap_get_table(lsp_get_at_offset(0)), &nslots
+    );
+
+    lsp_ref_t new_slots_ref = lsp_heap_alloc_vector(6 * (size_t) nslots);
+    lsp_ref_t *new_slots = (lsp_ref_t *) lsp_heap_get_data(new_slots_ref);
+
+    // Allocating may have moved the table, so it is only read afterwards.
+    lsp_ref_t ref = lsp_get_at_offset(0);
+    lsp_table_t *table = lsp_heap_get_table(ref);
+    lsp_ref_t *old_slots = lsp_table_internal_slots(table, &nslots);
+
+    // The new slots are young, so filling them doesn't need a write barrier.
+    // The old slots are shaded by the barrier below when they are replaced.
+    for (uint32_t i = 0; i < nslots; i++) {
+        lsp_ref_t *slot = &old_slots[3 * i];
+        if (lsp_ref_tag(slot[0]) != LSP_REF_INT) {
+            continue;
+        }
+        uint32_t j = lsp_table_internal_find(
+            new_slots, 2 * nslots, slot[1], (uint32_t) lsp_ref_int(slot[0])
+        );
+        memcpy(&new_slots[3 * j], slot, 3 * sizeof(lsp_ref_t));
+    }
+
+    lsp_gc_internal_write_barrier(ref, table->slots, new_slots_ref);
+    table->slots = new_slots_ref;
+}
+
+/**
+ * Overwrites a reference in the slots of a table, applying the write barrier.
+ */
+static void lsp_table_internal_store(
+    lsp_ref_t slots_ref, lsp_ref_t *item, lsp_ref_t value
+) {
+    lsp_gc_internal_write_barrier(slots_ref, *item, value);
+    *item = value;
+}
+
+void lsp_push_table(void) {
+    lsp_push_ref(lsp_heap_alloc_vector(3 * TABLE_MIN_SLOTS));
+
+    lsp_ref_t ref = lsp_heap_alloc_data(LSP_TYPE_TABLE, sizeof(lsp_table_t));
+    lsp_table_t *table = lsp_heap_get_table(ref);
+    table->count = lsp_ref_make_int(0);
+    table->slots = lsp_get_at_offset(0);
+
+    lsp_pop();
+    lsp_push_ref(ref);
+}
+
+bool lsp_is_table(int offset) {
+    lsp_ref_t ref = lsp_get_at_offset(offset);
+    return lsp_heap_get_type(ref) == LSP_TYPE_TABLE;
+}
+
+void lsp_table_count(void) {
+    lsp_table_t *table = lsp_heap_get_table(lsp_get_at_offset(0));
+    int count = lsp_ref_int(table->count);
+
+    lsp_pop();
+    lsp_push_int(count);
+}
+
+void lsp_table_ref(void) {
+    lsp_table_t *table = lsp_heap_get_table(lsp_get_at_offset(0));
+    lsp_ref_t key = lsp_get_at_offset(1);
+    uint32_t hash = lsp_table_internal_hash(key);
+
+    uint32_t nslots;
+    lsp_ref_t *slots = lsp_table_internal_slots(table, &nslots);
+    lsp_ref_t *slot = &slots[
+        3 * lsp_table_internal_find(slots, nslots, key, hash)
+    ];
+
+    lsp_ref_t value = LSP_NULL;
+    if (lsp_ref_tag(slot[0]) == LSP_REF_INT) {
+        value = slot[2];
+    }
+
+    lsp_pop();
+    lsp_pop();
+    lsp_push_ref(value);
+}
+
+void lsp_table_set(void) {
+    uint32_t hash = lsp_table_internal_hash(lsp_get_at_offset(1));
+
+    lsp_table_t *table = lsp_heap_get_table(lsp_get_at_offset(0));
+    uint32_t nslots;
+    lsp_ref_t *slots = lsp_table_internal_slots(table, &nslots);
+    uint32_t index = lsp_table_internal_find(
+        slots, nslots, lsp_get_at_offset(1), hash
+    );
+
+    if (lsp_ref_tag(slots[3 * index]) != LSP_REF_INT) {
+        // Keep at least a quarter of the slots empty so that probe sequences
+        // stay short.
+        if (4 * ((uint32_t) lsp_ref_int(table->count) + 1) > 3 * nslots) {
+            lsp_table_internal_grow();
+
+            table = lsp_heap_get_table(lsp_get_at_offset(0));
+            slots = lsp_table_internal_slots(table, &nslots);
+            index = lsp_table_internal_find(
+                slots, nslots, lsp_get_at_offset(1), hash
+            );
+        }
+
+        // Integers never need a write barrier.
+        slots[3 * index] = lsp_ref_make_int(hash);
+        lsp_table_internal_store(
+            table->slots, &slots[3 * index + 1], lsp_get_at_offset(1)
+        );
+        table->count = lsp_ref_make_int(lsp_ref_int(table->count) + 1);
+    }
+
+    lsp_table_internal_store(
+        table->slots, &slots[3 * index + 2], lsp_get_at_offset(2)
+    );
+
+    lsp_pop();
+    lsp_pop();
+    lsp_pop();
+}
+
+void lsp_table_delete(void) {
+    lsp_ref_t key = lsp_get_at_offset(1);
+    uint32_t hash = lsp_table_internal_hash(key);
+
+    lsp_table_t *table = lsp_heap_get_table(lsp_get_at_offset(0));
+    uint32_t nslots;
+    lsp_ref_t *slots = lsp_table_internal_slots(table, &nslots);
+    uint32_t mask = nslots - 1;
+    uint32_t i = lsp_table_internal_find(slots, nslots, key, hash);
+
+    if (lsp_ref_tag(slots[3 * i]) == LSP_REF_INT) {
+        // Move back any later entry in the same run that would otherwise
+        // become unreachable, which is any entry whose ideal slot does not
+        // lie cyclically between the gap and its current slot.
+        for (
+            uint32_t j = (i + 1) & mask;
+            lsp_ref_tag(slots[3 * j]) == LSP_REF_INT;
+        ) {
+            uint32_t k = (uint32_t) lsp_ref_int(slots[3 * j]) & mask;
+            bool movable = j > i ? (k <= i || k > j) : (k <= i && k > j);
+            if (movable) {
+                slots[3 * i] = slots[3 * j];
+                lsp_table_internal_store(
+                    table->slots, &slots[3 * i + 1], slots[3 * j + 1]
+                );
+                lsp_table_internal_store(
+                    table->slots, &slots[3 * i + 2], slots[3 * j + 2]
+                );
+                i = j;
+            }
+            j = (j + 1) & mask;
+        }
+
+        slots[3 * i] = LSP_NULL;
+        lsp_table_internal_store(table->slots, &slots[3 * i + 1], LSP_NULL);
+        lsp_table_internal_store(table->slots, &slots[3 * i + 2], LSP_NULL);
+        table->count = lsp_ref_make_int(lsp_ref_int(table->count) - 1);
+    }
+
+    lsp_pop();
+    lsp_pop();
+}
+
+void lsp_push_bytecode(unsigned char const *code, size_t length) {
+    assert(length < UINT32_MAX);
+
+    lsp_ref_t ref = lsp_heap_alloc_data(LSP_TYPE_CODE, length);
+    memcpy(lsp_heap_get_data(ref), code, length);
+
+    lsp_push_ref(ref);
+}
+
+bool lsp_is_bytecode(int offset) {
+    lsp_ref_t ref = lsp_get_at_offset(offset);
+    return lsp_heap_get_type(ref) == LSP_TYPE_CODE;
+}
+
+unsigned char const *lsp_borrow_bytecode(int offset) {
+    lsp_ref_t ref = lsp_get_at_offset(offset);
+    assert(lsp_heap_get_type(ref) == LSP_TYPE_CODE);
+    return (unsigned char const *) lsp_heap_get_data(ref);
+}
+
 bool lsp_is_null(int offset) {
     lsp_ref_t ref = lsp_get_at_offset(offset);
     return lsp_heap_get_type(ref) == LSP_TYPE_NULL;
 }
 
+bool lsp_is_identical(int offset_a, int offset_b) {
+    lsp_ref_t a = lsp_get_at_offset(offset_a);
+    lsp_ref_t b = lsp_get_at_offset(offset_b);
+    return a.bits == b.bits;
+}
+
 bool lsp_is_cons(int offset) {
     lsp_ref_t ref = lsp_get_at_offset(offset);
     return lsp_heap_get_type(ref) == LSP_TYPE_CONS;
@@ -742,12 +4239,12 @@ bool lsp_is_cons(int offset) {
 
 bool lsp_is_int(int offset) {
     lsp_ref_t ref = lsp_get_at_offset(offset);
-    return lsp_heap_get_type(ref) == LSP_TYPE_INT;
+    return lsp_ref_tag(ref) == LSP_REF_INT;
 }
 
 bool lsp_is_symbol(int offset) {
     lsp_ref_t ref = lsp_get_at_offset(offset);
-    return lsp_heap_get_type(ref) == LSP_TYPE_SYM;
+    return lsp_ref_tag(ref) == LSP_REF_SYM;
 }
 
 bool lsp_is_string(int offset) {
@@ -760,6 +4257,11 @@ bool lsp_is_op(int offset) {
     return lsp_heap_get_type(ref) == LSP_TYPE_OP;
 }
 
+bool lsp_is_vector(int offset) {
+    lsp_ref_t ref = lsp_get_at_offset(offset);
+    return lsp_heap_get_type(ref) == LSP_TYPE_VEC;
+}
+
 bool lsp_is_truthy(void) {
     lsp_ref_t ref = lsp_get_at_offset(0);
     switch (lsp_heap_get_type(ref)) {
@@ -773,20 +4275,38 @@ bool lsp_is_truthy(void) {
             return true;
         case LSP_TYPE_STR:
             return strlen(lsp_borrow_string(0)) > 0;
+        case LSP_TYPE_VEC:
+            return true;
+        case LSP_TYPE_TABLE:
+            return true;
+        case LSP_TYPE_CODE:
+            return true;
         default:
             assert(false);
     }
 }
 
 size_t lsp_stats_frame_size(void) {
-    assert(ref_frame_ptr >= 0);
-    assert(ref_stack_ptr >= 0);
-    assert(ref_frame_ptr <= ref_stack_ptr);
-    return (size_t) (ref_stack_ptr - ref_frame_ptr);
+    assert(vm->ref_frame_ptr >= 0);
+    assert(vm->ref_stack_ptr >= 0);
+    assert(vm->ref_frame_ptr <= vm->ref_stack_ptr);
+    return (size_t) (vm->ref_stack_ptr - vm->ref_frame_ptr);
 }
 
 size_t lsp_stats_stack_size(void) {
-    assert(ref_stack_ptr >= 0);
-    return (size_t) ref_stack_ptr;
+    assert(vm->ref_stack_ptr >= 0);
+    return (size_t) vm->ref_stack_ptr;
+}
+
+size_t lsp_stats_cons_allocations(void) {
+    return vm->stats.cons_allocations;
+}
+
+size_t lsp_stats_data_allocations(void) {
+    return vm->stats.data_allocations;
+}
+
+void lsp_stats_get(lsp_vm_stats_t *stats) {
+    *stats = vm->stats;
 }
 
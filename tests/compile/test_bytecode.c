@@ -0,0 +1,54 @@
+/**
+ * Checks that bytecode survives collections, and that compiled code can be
+ * run more than once.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    unsigned char bytes[] = {0, 1, 2, 3, 250, 251, 252, 253, 254, 255};
+    lsp_push_bytecode(bytes, sizeof(bytes));
+    lspt_assert(lsp_is_bytecode(0));
+    lspt_assert(!lsp_is_string(0));
+    lspt_assert(!lsp_is_vector(0));
+
+    lsp_gc_collect();
+    lspt_assert(memcmp(lsp_borrow_bytecode(0), bytes, sizeof(bytes)) == 0);
+    lsp_pop();
+
+    lsp_push_string("(cons (quote a) (+ 1 2))");
+    lsp_parse();
+    lsp_car();
+    lsp_compile();
+
+    lspt_assert(lsp_is_vector(0));
+    lsp_push_int(0);
+    lsp_dup(1);
+    lsp_vector_ref();
+    lspt_assert(lsp_is_bytecode(0));
+    lsp_pop();
+
+    for (int i = 0; i < 2; i++) {
+        lsp_dup(0);
+        lsp_push_default_env();
+        lsp_exec();
+
+        lsp_dup(0);
+        lsp_car();
+        lspt_assert(lsp_read_symbol(0) == lsp_intern("a"));
+        lsp_pop();
+        lsp_cdr();
+        lspt_assert(lsp_read_int(0) == 3);
+        lsp_pop();
+
+        lsp_gc_collect();
+    }
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+/**
+ * Checks that compiled code gives the same results as the tree walker.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+static char const *programs[] = {
+    "(+ 1 2)",
+    "(if 0 1 2)",
+    "(if (quote ()) 1 (quote (2 3)))",
+    "(begin)",
+    "(begin 1 2 3)",
+    "\"abc\"",
+    "(quote (a \"b\" 3))",
+    "(cons (car (quote (1 2))) (cdr (quote (3 4))))",
+    "(vector-ref (vector 1 2 3) 1)",
+    "(map (lambda (x) (* x x)) (quote (1 2 3)))",
+    "(fold + 0 (quote (1 2 3)))",
+    "(define x 4) (set! x (+ x 1)) x",
+    "(define x 1) ((lambda (x) (set! x 2) x) 5)",
+    "(define x 1) ((lambda (x) (set! x 2)) 5) x",
+    "((lambda (x) (define y 4) (set! y 5) (+ x y)) 2)",
+    "(define f (lambda (n) (if n (+ n (f (- n 1))) 0))) (f 10)",
+    "(define make-adder (lambda (n) (lambda (x) (+ x n))))"
+    "(define add-three (make-adder 3))"
+    "(add-three 4)",
+    "(define counter ((lambda (n) (lambda () (set! n (+ n 1)) n)) 0))"
+    "(counter) (counter) (cons (counter) (counter))",
+    "(define f (lambda (a) (lambda (b) (lambda (c) (set! a (+ a c)) (+ a b)))))"
+    "(define g ((f 1) 2))"
+    "(g 3) (g 4)",
+    "(define x 1) ((lambda (y) (if y (begin (define x 3) (+ x y)) 0)) 4)",
+    "(define x 1) ((lambda () (set! x 2))) x",
+    "((lambda (n)"
+    "   (define even (lambda (n) (if n (odd (- n 1)) 1)))"
+    "   (define odd (lambda (n) (if n (even (- n 1)) 0)))"
+    "   (even n)) 7)",
+    "(define f (lambda () (g))) (define g (lambda () 5)) (f)",
+    "(define make (lambda (n) (cons (lambda () n) (lambda (x) (set! n x)))))"
+    "(define p (make 1))"
+    "((cdr p) 7)"
+    "((car p))",
+    "(map (lambda (f) (f)) (map (lambda (x) (lambda () x)) (quote (1 2 3))))",
+    "(define loop (lambda (i acc) (if i (loop (- i 1) (+ acc i)) acc)))"
+    "(loop 100 0)",
+    "(define a (lambda (x) (b x 1 3)))"
+    "(define b (lambda (x y z) (define w (+ x y)) (if z (+ w z) w)))"
+    "(a 5)",
+    "(((lambda (x) ((lambda (y) (lambda () (set! x (+ x y)) x)) 2)) 1))",
+    "(define t (make-table))"
+    "(table-set! t (quote a) 1)"
+    "(table-set! t (quote b) 2)"
+    "(+ (table-ref t (quote a)) (table-count t))",
+};
+
+
+/**
+ * Evaluates each expression in `source`, in a new default environment, using
+ * `eval`, and pushes the value of the last.
+ */
+static void run(char const *source, void (*eval)(void)) {
+    lsp_push_default_env();
+
+    lsp_push_string(source);
+    lsp_parse();
+
+    lsp_push_null();
+    while (!lsp_is_null(1)) {
+        lsp_pop();
+        lsp_dup(0);
+        lsp_car();
+        lsp_dup(2);
+        eval();
+        lsp_dup(1);
+        lsp_cdr();
+        lsp_store(2);
+    }
+
+    lsp_store(2);
+    lsp_pop();
+}
+
+
+int main(void) {
+    lsp_vm_init();
+
+    size_t nprograms = sizeof(programs) / sizeof(programs[0]);
+    for (size_t i = 0; i < nprograms; i++) {
+        run(programs[i], lsp_eval_tree);
+        run(programs[i], lsp_eval);
+
+        lspt_assert(lsp_stats_frame_size() == 2);
+        lspt_assert_equal();
+        lsp_pop();
+        lsp_pop();
+    }
+
+    return 0;
+}
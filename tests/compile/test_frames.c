@@ -0,0 +1,137 @@
+/**
+ * Checks that compiled lambdas bind their variables in slots on the stack,
+ * that closures capture only the variables that they use, and that calls
+ * allocate nothing but boxes for captured variables that can change.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+/**
+ * Evaluates `source` in the environment at the top of the stack, and pushes
+ * the result.
+ */
+static void eval(char const *source) {
+    lsp_push_string(source);
+    lsp_parse();
+    lsp_car();
+    lsp_dup(1);
+    lsp_eval();
+}
+
+
+int main(void) {
+    lsp_vm_init();
+    lsp_push_default_env();
+
+    // Variables are found at every depth, and inner bindings shadow outer
+    // ones, including names defined in a body.
+    eval("(define x 100)");
+    lsp_pop();
+    eval(
+        "(((lambda (a b) (lambda (b) (lambda (c) (define x 1) "
+        "(+ x (+ a (+ b c)))))) 10 20) 30)"
+    );
+    lsp_push_int(4);
+    lsp_swp(1);
+    lsp_call(1);
+    lspt_assert(lsp_read_int(0) == 45);
+    lsp_pop();
+
+    // The definition in the body did not touch the environment.
+    eval("x");
+    lspt_assert(lsp_read_int(0) == 100);
+    lsp_pop();
+
+    // A closure's environment is a capture frame holding the environment,
+    // the layout of the frame, and then only the variables that its body
+    // refers to.
+    eval("((lambda (x y z) (lambda () (+ x y))) 5 2 100)");
+    lsp_dup(0);
+    lsp_cdr();
+    lspt_assert(lsp_is_vector(0));
+    lsp_dup(0);
+    lsp_vector_length();
+    lspt_assert(lsp_read_int(0) == 4);
+    lsp_pop();
+    lsp_push_int(2);
+    lsp_dup(1);
+    lsp_vector_ref();
+    lspt_assert(lsp_read_int(0) == 5);
+    lsp_pop();
+    lsp_push_int(3);
+    lsp_dup(1);
+    lsp_vector_ref();
+    lspt_assert(lsp_read_int(0) == 2);
+    lsp_pop();
+    lsp_pop();
+    lsp_call(0);
+    lspt_assert(lsp_read_int(0) == 7);
+    lsp_pop();
+
+    // Variables that can change after they are captured are shared through
+    // a box, and closures that capture nothing keep only the environment.
+    eval("((lambda (n) (lambda () (set! n (+ n 1)) n)) 0)");
+    lsp_dup(0);
+    lsp_cdr();
+    lsp_push_int(2);
+    lsp_swp(1);
+    lsp_vector_ref();
+    lspt_assert(lsp_is_cons(0));
+    lsp_pop();
+    lsp_dup(0);
+    lsp_call(0);
+    lsp_pop();
+    lsp_call(0);
+    lspt_assert(lsp_read_int(0) == 2);
+    lsp_pop();
+
+    eval("((lambda (x) (lambda () 3)) 1)");
+    lsp_cdr();
+    lspt_assert(lsp_is_identical(0, 1));
+    lsp_pop();
+
+    // Once its body is compiled, a call allocates nothing at all, whether or
+    // not the lambda binds anything, and even if it assigns its variables.
+    eval("(lambda (a b) (+ a b))");
+    lsp_swp(1);
+    eval("(lambda () 3)");
+    lsp_swp(1);
+    eval("(lambda (n) (set! n (+ n 1)) (define m (+ n 1)) m)");
+    lsp_swp(1);
+    for (int i = 0; i < 2; i++) {
+        size_t cons_allocations = lsp_stats_cons_allocations();
+        size_t data_allocations = lsp_stats_data_allocations();
+
+        lsp_push_int(2);
+        lsp_push_int(1);
+        lsp_dup(5);
+        lsp_call(2);
+        lspt_assert(lsp_read_int(0) == 3);
+        lsp_pop();
+
+        lsp_dup(2);
+        lsp_call(0);
+        lspt_assert(lsp_read_int(0) == 3);
+        lsp_pop();
+
+        lsp_push_int(1);
+        lsp_dup(2);
+        lsp_call(1);
+        lspt_assert(lsp_read_int(0) == 3);
+        lsp_pop();
+
+        if (i > 0) {
+            lspt_assert(lsp_stats_cons_allocations() == cons_allocations);
+            lspt_assert(lsp_stats_data_allocations() == data_allocations);
+        }
+    }
+    lsp_store(3);
+    lsp_pop();
+    lsp_pop();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    return 0;
+}
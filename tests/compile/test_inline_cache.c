@@ -0,0 +1,92 @@
+/**
+ * Checks that cached lookups in compiled code notice new definitions, and
+ * are not shared between environments.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+/**
+ * Evaluates `source` in the environment at the top of the stack, and pushes
+ * the result.
+ */
+static void eval(char const *source) {
+    lsp_push_string(source);
+    lsp_parse();
+    lsp_car();
+    lsp_dup(1);
+    lsp_eval();
+}
+
+
+int main(void) {
+    lsp_vm_init();
+    lsp_push_default_env();
+    lsp_push_scope();
+
+    eval("(define x 1)");
+    lsp_pop();
+    eval("(define f (lambda (y) (+ x y)))");
+    lsp_pop();
+
+    eval("(f 10)");
+    lspt_assert(lsp_read_int(0) == 11);
+    lsp_pop();
+
+    // Assignments replace the value in the cached cell.
+    eval("(set! x 2)");
+    lsp_pop();
+    eval("(f 10)");
+    lspt_assert(lsp_read_int(0) == 12);
+    lsp_pop();
+
+    // New definitions can shadow a cached binding, here a builtin in the
+    // outermost scope.
+    eval("(define + -)");
+    lsp_pop();
+    eval("(f 10)");
+    lspt_assert(lsp_read_int(0) == -8);
+    lsp_pop();
+
+    // The same code run in two environments, with nothing defined in
+    // between, sees the bindings of each.
+    lsp_push_default_env();
+    lsp_push_default_env();
+    lsp_push_int(3);
+    lsp_push_symbol("x");
+    lsp_dup(2);
+    lsp_define();
+    lsp_push_int(4);
+    lsp_push_symbol("x");
+    lsp_dup(3);
+    lsp_define();
+
+    lsp_push_string("(+ x x)");
+    lsp_parse();
+    lsp_car();
+    lsp_compile();
+
+    for (int i = 0; i < 2; i++) {
+        lsp_dup(0);
+        lsp_dup(2);
+        lsp_exec();
+        lspt_assert(lsp_read_int(0) == 6);
+        lsp_pop();
+
+        lsp_dup(0);
+        lsp_dup(3);
+        lsp_exec();
+        lspt_assert(lsp_read_int(0) == 8);
+        lsp_pop();
+
+        lsp_gc_collect();
+    }
+    lsp_pop();
+    lsp_pop();
+    lsp_pop();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+/**
+ * Checks that the body of a lambda is compiled when it is first called, and
+ * that the code is shared by every closure created from the same expression.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+/**
+ * Evaluates `source` in the environment at the top of the stack, and pushes
+ * the result.
+ */
+static void eval(char const *source) {
+    lsp_push_string(source);
+    lsp_parse();
+    lsp_car();
+    lsp_dup(1);
+    lsp_eval();
+}
+
+/**
+ * Replaces the closure at the top of the stack with the body of its lambda.
+ */
+static void body(void) {
+    lsp_car();
+    lsp_cdr();
+    lsp_cdr();
+}
+
+
+int main(void) {
+    lsp_vm_init();
+    lsp_push_default_env();
+
+    eval("(define make-adder (lambda (n) (lambda (x) (+ x n))))");
+    lsp_pop();
+    eval("(define add-one (make-adder 1))");
+    lsp_pop();
+    eval("(define add-two (make-adder 2))");
+    lsp_pop();
+
+    // Neither closure has been called yet.
+    eval("add-two");
+    body();
+    lspt_assert(lsp_is_cons(0));
+    lsp_pop();
+
+    eval("(add-one 5)");
+    lspt_assert(lsp_read_int(0) == 6);
+    lsp_pop();
+
+    // Calling `add-one` compiled the body for both closures.
+    eval("add-two");
+    body();
+    lspt_assert(lsp_is_vector(0));
+    lsp_push_int(0);
+    lsp_dup(1);
+    lsp_vector_ref();
+    lspt_assert(lsp_is_bytecode(0));
+    lsp_pop();
+    lsp_pop();
+
+    lsp_gc_collect();
+
+    eval("(add-two 5)");
+    lspt_assert(lsp_read_int(0) == 7);
+    lsp_pop();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    return 0;
+}
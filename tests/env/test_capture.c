@@ -0,0 +1,125 @@
+/**
+ * Checks that `lsp_capture` copies only the requested local bindings, shares
+ * their cells with the original environment, and leaves global bindings to be
+ * looked up through the environment behind them.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+static void define(char const *name, int value) {
+    lsp_push_int(value);
+    lsp_push_symbol(name);
+    lsp_dup(2);
+    lsp_define();
+}
+
+static void lookup(char const *name) {
+    lsp_push_symbol(name);
+    lsp_dup(1);
+    lsp_lookup();
+}
+
+static void push_symbols(char const *first, char const *second) {
+    lsp_push_null();
+    lsp_push_symbol(second);
+    lsp_cons();
+    lsp_push_symbol(first);
+    lsp_cons();
+}
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_empty_env();
+    define("global", 1);
+
+    // An environment without captured scopes is entirely global, so nothing
+    // is copied.
+    lsp_dup(0);
+    push_symbols("global", "global");
+    lsp_capture();
+    lsp_dup(0);
+    lsp_car();
+    lspt_assert(lsp_is_vector(0));
+    lsp_vector_length();
+    lspt_assert(lsp_read_int(0) == 0);
+    lsp_pop();
+    lsp_cdr();
+    lspt_assert(lsp_is_identical(0, 1));
+    lsp_pop();
+
+    // Capture from a scope in front of that, as a closure would.
+    lsp_dup(0);
+    push_symbols("local", "global");
+    lsp_capture();
+    lsp_push_scope();
+    define("local", 2);
+    define("unused", 3);
+
+    lsp_dup(0);
+    push_symbols("local", "global");
+    lsp_capture();
+
+    lsp_dup(0);
+    lsp_car();
+    lsp_vector_length();
+    lspt_assert(lsp_read_int(0) == 1);
+    lsp_pop();
+
+    lookup("local");
+    lspt_assert(lsp_read_int(0) == 2);
+    lsp_pop();
+    lookup("global");
+    lspt_assert(lsp_read_int(0) == 1);
+    lsp_pop();
+
+    // Assignments through either environment are seen by the other.
+    lsp_push_int(4);
+    lsp_push_symbol("local");
+    lsp_dup(2);
+    lsp_set();
+    lsp_swp(1);
+    lookup("local");
+    lspt_assert(lsp_read_int(0) == 4);
+    lsp_pop();
+
+    define("local", 5);
+    lsp_swp(1);
+    lookup("local");
+    lspt_assert(lsp_read_int(0) == 5);
+    lsp_pop();
+
+    // Captured scopes are local too, so capturing again from a scope in front
+    // of one finds bindings in both.
+    lsp_push_scope();
+    define("inner", 6);
+    lsp_dup(0);
+    push_symbols("inner", "local");
+    lsp_capture();
+
+    lsp_dup(0);
+    lsp_car();
+    lsp_vector_length();
+    lspt_assert(lsp_read_int(0) == 2);
+    lsp_pop();
+
+    lookup("inner");
+    lspt_assert(lsp_read_int(0) == 6);
+    lsp_pop();
+    lookup("local");
+    lspt_assert(lsp_read_int(0) == 5);
+    lsp_pop();
+    lookup("global");
+    lspt_assert(lsp_read_int(0) == 1);
+    lsp_pop();
+
+    // Nothing else was copied.
+    lookup("inner");
+    lsp_pop();
+    lspt_assert_aborts(lookup("unused"));
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * Checks that the outermost scope moves its bindings to a table once it has
+ * more than a few, and that they can still be read, replaced and shadowed.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+#include <stdio.h>
+
+
+static void define(char const *name, int value) {
+    lsp_push_int(value);
+    lsp_push_symbol(name);
+    lsp_dup(2);
+    lsp_define();
+}
+
+static void lookup(char const *name) {
+    lsp_push_symbol(name);
+    lsp_dup(1);
+    lsp_lookup();
+}
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_empty_env();
+
+    char name[16];
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "var-%c%c", 'a' + i / 10, 'a' + i % 10);
+        define(name, i);
+    }
+    define("var-aa", 1000);
+
+    lsp_dup(0);
+    lsp_car();
+    lspt_assert(lsp_is_table(0));
+    lsp_pop();
+
+    lookup("var-jj");
+    lspt_assert(lsp_read_int(0) == 99);
+    lsp_pop();
+
+    lookup("var-aa");
+    lspt_assert(lsp_read_int(0) == 1000);
+    lsp_pop();
+
+    // The binding cell is updated in place by both `set` and `define`.
+    lsp_push_symbol("var-bc");
+    lsp_dup(1);
+    lsp_lookup_binding();
+
+    lsp_push_int(-1);
+    lsp_push_symbol("var-bc");
+    lsp_dup(3);
+    lsp_set();
+    lsp_dup(0);
+    lsp_cdr();
+    lspt_assert(lsp_read_int(0) == -1);
+    lsp_pop();
+
+    lsp_push_int(-2);
+    lsp_push_symbol("var-bc");
+    lsp_dup(3);
+    lsp_define();
+    lsp_dup(0);
+    lsp_cdr();
+    lspt_assert(lsp_read_int(0) == -2);
+    lsp_pop();
+    lsp_pop();
+
+    // Inner scopes still shadow the table.
+    lsp_push_scope();
+    define("var-bc", 7);
+    lookup("var-bc");
+    lspt_assert(lsp_read_int(0) == 7);
+    lsp_pop();
+    lookup("var-cd");
+    lspt_assert(lsp_read_int(0) == 23);
+    lsp_pop();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    return 0;
+}
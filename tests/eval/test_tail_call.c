@@ -0,0 +1,71 @@
+/**
+ * Checks that `lsp_eval` runs loops written as tail recursion in constant
+ * stack space, including through `if`, `begin` and calls between lambdas.
+ * Without tail calls, a million iterations would overflow the stack many
+ * times over.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+/**
+ * Evaluates `source` in the environment at the top of the stack, and pushes
+ * the result.
+ */
+static void eval(char const *source) {
+    lsp_push_string(source);
+    lsp_parse();
+    lsp_car();
+    lsp_dup(1);
+    lsp_eval();
+}
+
+static void bind(char const *name, lsp_op_t op) {
+    lsp_push_op(op);
+    lsp_push_symbol(name);
+    lsp_dup(2);
+    lsp_define();
+}
+
+
+int main(void) {
+    lsp_vm_init();
+
+    // Only bind what is needed, so that lookups stay cheap.
+    lsp_push_empty_env();
+    bind("+", lsp_int_add);
+    bind("-", lsp_int_sub);
+
+    eval(
+        "(define count-down"
+        "  (lambda (n) (if n (count-down (- n 1)) (quote done))))"
+    );
+    lsp_pop();
+
+    eval("(count-down 1000000)");
+    lspt_assert(lsp_read_symbol(0) == lsp_intern("done"));
+    lsp_pop();
+
+    eval("(define ping (lambda (n) (begin (if n (pong (- n 1)) n))))");
+    lsp_pop();
+    eval("(define pong (lambda (n) (define m n) (ping m)))");
+    lsp_pop();
+
+    eval("(ping 100000)");
+    lspt_assert(lsp_read_int(0) == 0);
+    lsp_pop();
+
+    // A builtin in tail position returns its result as normal.
+    eval("((lambda (x) (+ x 1)) 41)");
+    lspt_assert(lsp_read_int(0) == 42);
+    lsp_pop();
+
+    lsp_vm_stats_t stats;
+    lsp_stats_get(&stats);
+    lspt_assert(stats.stack_high_water < 64);
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    return 0;
+}
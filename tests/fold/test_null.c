@@ -0,0 +1,21 @@
+/**
+ * Checks that folding over an empty list returns the initial value.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_null();
+    lsp_push_int(7);
+    lsp_push_op(lsp_int_add);
+    lsp_fold();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+    lspt_assert(lsp_read_int(0) == 7);
+
+    return 0;
+}
@@ -0,0 +1,37 @@
+/**
+ * Checks that `lsp_fold` visits elements from the front of the list, passing
+ * each element followed by the accumulator.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    // (1 2 3)
+    lsp_push_null();
+    for (int i = 3; i > 0; i--) {
+        lsp_push_int(i);
+        lsp_cons();
+    }
+
+    // Consing each element onto the accumulator reverses the list.
+    lsp_push_null();
+    lsp_push_op(lsp_cons);
+    lsp_fold();
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    for (int i = 3; i > 0; i--) {
+        lspt_assert(lsp_is_cons(0));
+        lsp_dup(0);
+        lsp_car();
+        lspt_assert(lsp_read_int(0) == i);
+        lsp_pop();
+        lsp_cdr();
+    }
+    lspt_assert(lsp_is_null(0));
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+/**
+ * Checks that allocating far more than fits in the heap triggers collections
+ * that preserve reachable data.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    // A list that should survive every collection.
+    lsp_push_null();
+    for (int i = 0; i < 1000; i++) {
+        lsp_push_int(i);
+        lsp_cons();
+    }
+
+    // Enough garbage to fill both heaps several times over.
+    for (int i = 0; i < 4000000; i++) {
+        lsp_push_int(i);
+        lsp_push_null();
+        lsp_cons();
+        lsp_pop();
+    }
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    for (int i = 999; i >= 0; i--) {
+        lsp_dup(0);
+        lsp_car();
+        lspt_assert(lsp_read_int(0) == i);
+        lsp_pop();
+        lsp_cdr();
+    }
+    lspt_assert(lsp_is_null(0));
+
+    return 0;
+}
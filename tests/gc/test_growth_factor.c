@@ -0,0 +1,33 @@
+/**
+ * Checks that the heap is still collected correctly when there is no slack
+ * between collections.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+    lsp_gc_set_growth_factor(0.0);
+
+    lsp_push_null();
+    for (int i = 0; i < 100000; i++) {
+        lsp_push_string("a string that takes up several words");
+        lsp_cons();
+    }
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    for (int i = 0; i < 100000; i++) {
+        lsp_dup(0);
+        lsp_car();
+        char const *value = lsp_borrow_string(0);
+        lspt_assert(strcmp(value, "a string that takes up several words") == 0);
+        lsp_pop();
+        lsp_cdr();
+    }
+    lspt_assert(lsp_is_null(0));
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+/**
+ * Checks that both heaps can grow from a small initial size to well beyond the
+ * old fixed limit of 2^20 entries.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_config_t config = {
+        .gc_threads = 1,
+        .cons_heap_initial = 0x100,
+        .data_heap_initial = 0x100,
+        .cons_heap_max = 0x400000,
+        .data_heap_max = 0x400000,
+    };
+    lsp_vm_init_with_config(&config);
+
+    lsp_push_null();
+    for (int i = 0; i < 2000000; i++) {
+        lsp_push_int(i);
+        lsp_cons();
+    }
+
+    lsp_push_null();
+    for (int i = 0; i < 300000; i++) {
+        lsp_push_string("a string that takes up several words");
+        lsp_cons();
+    }
+
+    lsp_gc_collect();
+
+    for (int i = 0; i < 300000; i++) {
+        lsp_dup(0);
+        lsp_car();
+        char const *value = lsp_borrow_string(0);
+        lspt_assert(strcmp(value, "a string that takes up several words") == 0);
+        lsp_pop();
+        lsp_cdr();
+    }
+    lspt_assert(lsp_is_null(0));
+    lsp_pop();
+
+    for (int i = 1999999; i >= 0; i--) {
+        lsp_dup(0);
+        lsp_car();
+        lspt_assert(lsp_read_int(0) == i);
+        lsp_pop();
+        lsp_cdr();
+    }
+    lspt_assert(lsp_is_null(0));
+
+    return 0;
+}
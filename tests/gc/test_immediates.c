@@ -0,0 +1,55 @@
+/**
+ * Checks that integers stored directly in references survive collections and
+ * round trip at the limits of their range, including values that do not fit
+ * in 32 bits.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+#include <limits.h>
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_int(LSP_INT_MIN);
+    lsp_push_int(LSP_INT_MAX);
+    lsp_push_int(INT_MIN);
+    lsp_push_int(INT_MAX);
+    lsp_push_int(0);
+    lsp_push_int(-1);
+
+    lsp_push_null();
+    for (int i = 0; i < 100000; i++) {
+        lsp_push_int(i);
+        lsp_cons();
+    }
+
+    lsp_gc_collect();
+
+    for (int i = 99999; i >= 0; i--) {
+        lsp_dup(0);
+        lsp_car();
+        lspt_assert(lsp_is_int(0));
+        lspt_assert(lsp_read_int(0) == i);
+        lsp_pop();
+        lsp_cdr();
+    }
+    lspt_assert(lsp_is_null(0));
+    lsp_pop();
+
+    lspt_assert(lsp_read_int(0) == -1);
+    lspt_assert(lsp_read_int(1) == 0);
+    lspt_assert(lsp_read_int(2) == INT_MAX);
+    lspt_assert(lsp_read_int(3) == INT_MIN);
+    lspt_assert(lsp_read_int(4) == LSP_INT_MAX);
+    lspt_assert(lsp_read_int(5) == LSP_INT_MIN);
+
+    // Values outside of the range wrap around.
+    lsp_push_int(LSP_INT_MAX + 1);
+    lspt_assert(lsp_read_int(0) == LSP_INT_MIN);
+
+
+    return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * Checks that incremental marking keeps data reachable while the heap is
+ * mutated between slices.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+#define LENGTH 100000
+
+
+int main(void) {
+    lsp_vm_init();
+    lsp_gc_set_pause_budget(1);
+    lsp_gc_set_growth_factor(0.0);
+
+    lsp_push_null();
+    for (int i = LENGTH - 1; i >= 0; i--) {
+        lsp_push_int(i);
+        lsp_cons();
+    }
+
+    // Reversing the list in place repeatedly moves cells between the part of
+    // the list that is reachable from the stack and the part that is only
+    // reachable from the unvisited cells.
+    for (int round = 0; round < 6; round++) {
+        lsp_push_null();
+
+        while (!lsp_is_null(1)) {
+            lsp_dup(1);
+            lsp_cdr();
+
+            lsp_dup(1);
+            lsp_dup(3);
+            lsp_set_cdr();
+
+            // Garbage to drive the collector.
+            lsp_push_string("garbage");
+            lsp_push_cons();
+            lsp_pop();
+            lsp_pop();
+
+            lsp_dup(2);
+            lsp_store(2);
+            lsp_store(2);
+        }
+
+        lsp_store(1);
+    }
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    for (int i = 0; i < LENGTH; i++) {
+        lsp_dup(0);
+        lsp_car();
+        lspt_assert(lsp_read_int(0) == i);
+        lsp_pop();
+        lsp_cdr();
+    }
+    lspt_assert(lsp_is_null(0));
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/**
+ * Checks that strings spanning many words of the data heap are moved intact
+ * when garbage before them is collected.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+#define LENGTH 10000
+
+
+int main(void) {
+    lsp_vm_init();
+
+    static char expected[LENGTH + 1];
+    for (int i = 0; i < LENGTH; i++) {
+        expected[i] = 'a' + (i % 26);
+    }
+    expected[LENGTH] = '\0';
+
+    lsp_push_null();
+    for (int i = 0; i < 10; i++) {
+        lsp_push_string("garbage");
+        lsp_pop();
+
+        lsp_push_string(expected);
+        lsp_cons();
+
+        lsp_push_string(expected + i);
+        lsp_pop();
+    }
+
+    lsp_gc_collect();
+
+    for (int i = 0; i < 10; i++) {
+        lsp_dup(0);
+        lsp_car();
+        lspt_assert(strcmp(lsp_borrow_string(0), expected) == 0);
+        lsp_pop();
+        lsp_cdr();
+    }
+    lspt_assert(lsp_is_null(0));
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+/**
+ * Checks that a nursery collection discards young garbage and keeps young data
+ * that is reachable from the stack.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    // Promote a list into the old generation.
+    lsp_push_null();
+    lsp_push_int(1);
+    lsp_cons();
+    lsp_gc_collect();
+
+    // Garbage allocated before the young value will force it to move.
+    for (int i = 0; i < 100; i++) {
+        lsp_push_string("garbage");
+        lsp_pop();
+        lsp_push_cons();
+        lsp_pop();
+    }
+
+    lsp_push_null();
+    lsp_push_string("young");
+    lsp_cons();
+
+    lsp_gc_collect_nursery();
+
+    lspt_assert(lsp_stats_frame_size() == 2);
+
+    lsp_dup(0);
+    lsp_car();
+    lspt_assert(strcmp(lsp_borrow_string(0), "young") == 0);
+    lsp_pop();
+    lsp_cdr();
+    lspt_assert(lsp_is_null(0));
+    lsp_pop();
+
+    lsp_dup(0);
+    lsp_car();
+    lspt_assert(lsp_read_int(0) == 1);
+    lsp_pop();
+    lsp_cdr();
+    lspt_assert(lsp_is_null(0));
+
+    return 0;
+}
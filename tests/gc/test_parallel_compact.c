@@ -0,0 +1,53 @@
+/**
+ * Checks that data interleaved with garbage across many blocks of both heaps
+ * survives compaction by several threads.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+#define LENGTH 50000
+
+
+int main(void) {
+    lsp_vm_config_t config = {
+        .gc_threads = 3,
+    };
+    lsp_vm_init_with_config(&config);
+
+    char buffer[32];
+
+    lsp_push_null();
+    for (int i = 0; i < LENGTH; i++) {
+        // Garbage of varying size in both heaps.
+        for (int j = 0; j < i % 5; j++) {
+            lsp_push_string("garbage");
+            lsp_push_cons();
+            lsp_pop();
+            lsp_pop();
+        }
+
+        snprintf(buffer, sizeof(buffer), "item %i", i);
+        lsp_push_string(buffer);
+        lsp_cons();
+    }
+
+    lsp_gc_collect();
+    lsp_gc_collect();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    for (int i = LENGTH - 1; i >= 0; i--) {
+        snprintf(buffer, sizeof(buffer), "item %i", i);
+
+        lsp_dup(0);
+        lsp_car();
+        lspt_assert(strcmp(lsp_borrow_string(0), buffer) == 0);
+        lsp_pop();
+        lsp_cdr();
+    }
+    lspt_assert(lsp_is_null(0));
+
+    return 0;
+}
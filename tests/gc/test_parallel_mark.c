@@ -0,0 +1,58 @@
+/**
+ * Checks that a heap marked by several threads is collected correctly.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+/**
+ * Pushes a complete binary tree of the given depth, with the depth of each
+ * node stored in its leaves.
+ */
+static void push_tree(int depth) {
+    if (depth == 0) {
+        lsp_push_int(depth);
+        return;
+    }
+    push_tree(depth - 1);
+    push_tree(depth - 1);
+    lsp_cons();
+}
+
+static int check_tree(int depth) {
+    if (depth == 0) {
+        lspt_assert(lsp_read_int(0) == 0);
+        lsp_pop();
+        return 1;
+    }
+    lspt_assert(lsp_is_cons(0));
+    lsp_dup(0);
+    lsp_car();
+    int count = check_tree(depth - 1);
+    lsp_cdr();
+    return count + check_tree(depth - 1);
+}
+
+
+int main(void) {
+    lsp_vm_config_t config = {
+        .gc_threads = 4,
+    };
+    lsp_vm_init_with_config(&config);
+
+    push_tree(16);
+
+    for (int i = 0; i < 10; i++) {
+        // Garbage interleaved with live data so that everything has to move.
+        push_tree(12);
+        lsp_pop();
+
+        lsp_gc_collect();
+    }
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+    lspt_assert(check_tree(16) == 1 << 16);
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ * Checks that young values stored in old cons cells survive nursery
+ * collections even if nothing else refers to them.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    // Promote a cons cell into the old generation.
+    lsp_push_cons();
+    lsp_gc_collect();
+
+    // Garbage allocated before the young values will force them to move.
+    for (int i = 0; i < 100; i++) {
+        lsp_push_string("garbage");
+        lsp_pop();
+        lsp_push_cons();
+        lsp_pop();
+    }
+
+    lsp_push_string("car");
+    lsp_dup(1);
+    lsp_set_car();
+
+    lsp_push_null();
+    lsp_push_int(7);
+    lsp_cons();
+    lsp_dup(1);
+    lsp_set_cdr();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    lsp_gc_collect_nursery();
+
+    // A second nursery collection checks that the values were promoted.
+    lsp_push_cons();
+    lsp_pop();
+    lsp_gc_collect_nursery();
+
+    lsp_dup(0);
+    lsp_car();
+    lspt_assert(strcmp(lsp_borrow_string(0), "car") == 0);
+    lsp_pop();
+
+    lsp_cdr();
+    lsp_dup(0);
+    lsp_car();
+    lspt_assert(lsp_read_int(0) == 7);
+    lsp_pop();
+    lsp_cdr();
+    lspt_assert(lsp_is_null(0));
+
+    return 0;
+}
@@ -0,0 +1,209 @@
+/**
+ * Checks that images that are truncated, or whose header and tables don't agree
+ * with each other, are rejected without aborting.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+
+/**
+ * Mirrors the layout of the image header in `src/vm.c`.
+ */
+typedef struct {
+    uint64_t offset;
+    uint64_t count;
+    uint64_t size;
+} lspt_section_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    int32_t frame_ptr;
+    uint32_t env_version;
+    lspt_section_t symbols;
+    lspt_section_t ops;
+    lspt_section_t relocations;
+    lspt_section_t stack;
+    lspt_section_t cons_heap;
+    lspt_section_t data_heap;
+} lspt_header_t;
+
+
+static void lspt_answer(void) {
+    lsp_push_int(40);
+}
+
+
+static void lspt_save(char const *path) {
+    lsp_vm_init();
+    lsp_push_default_env();
+
+    lsp_push_string("(lambda (x) (* 2 x))");
+    lsp_parse();
+    lsp_car();
+    lsp_dup(1);
+    lsp_eval();
+    lsp_push_symbol("double");
+    lsp_dup(2);
+    lsp_define();
+
+    lsp_push_op(lspt_answer);
+    lsp_push_symbol("answer");
+    lsp_dup(2);
+    lsp_define();
+
+    lspt_assert(lsp_vm_save_image(path));
+}
+
+
+static char *image;
+static size_t image_size;
+static char *copy;
+static char path[] = "/tmp/lsp-test-image-XXXXXX";
+
+static lspt_header_t *lspt_reset(void) {
+    memcpy(copy, image, image_size);
+    return (lspt_header_t *) copy;
+}
+
+static bool lspt_loads(size_t size) {
+    FILE *file = fopen(path, "wb");
+    lspt_assert(file != NULL);
+    lspt_assert(fwrite(copy, 1, size, file) == size);
+    lspt_assert(fclose(file) == 0);
+
+    lsp_vm_config_t config = {
+        .gc_threads = 1,
+    };
+    lsp_vm_t *created = lsp_vm_create_from_image(path, &config);
+    if (created == NULL) {
+        return false;
+    }
+    lsp_vm_destroy(created);
+    return true;
+}
+
+
+int main(void) {
+    int fd = mkstemp(path);
+    lspt_assert(fd >= 0);
+    close(fd);
+
+    lsp_register_op("answer", lspt_answer);
+
+    pid_t child = fork();
+    lspt_assert(child >= 0);
+    if (child == 0) {
+        lspt_save(path);
+        exit(0);
+    }
+    int status;
+    lspt_assert(waitpid(child, &status, 0) == child);
+    lspt_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    FILE *file = fopen(path, "rb");
+    lspt_assert(file != NULL);
+    fseek(file, 0, SEEK_END);
+    image_size = (size_t) ftell(file);
+    fseek(file, 0, SEEK_SET);
+    image = malloc(image_size);
+    copy = malloc(image_size);
+    lspt_assert(image != NULL && copy != NULL);
+    lspt_assert(fread(image, 1, image_size, file) == image_size);
+    fclose(file);
+
+    lspt_header_t *header = lspt_reset();
+    lspt_assert(header->relocations.count >= 2);
+    lspt_assert(lspt_loads(image_size));
+
+    // Cut off inside the data heap.
+    header = lspt_reset();
+    lspt_assert(!lspt_loads(
+        header->data_heap.offset + header->data_heap.size / 2
+    ));
+
+    // Cut off inside the header.
+    lspt_reset();
+    lspt_assert(!lspt_loads(sizeof(lspt_header_t) / 2));
+
+    // A relocation that points at the null object instead of an op.
+    header = lspt_reset();
+    memset(copy + header->relocations.offset, 0, sizeof(uint32_t));
+    lspt_assert(!lspt_loads(image_size));
+
+    // Relocations out of order.
+    header = lspt_reset();
+    uint32_t *relocations = (uint32_t *) (copy + header->relocations.offset);
+    uint32_t first = relocations[0];
+    relocations[0] = relocations[1];
+    relocations[1] = first;
+    lspt_assert(!lspt_loads(image_size));
+
+    // An op that refers to a name past the end of the ops section.
+    header = lspt_reset();
+    relocations = (uint32_t *) (copy + header->relocations.offset);
+    uint64_t index = header->ops.count;
+    memcpy(
+        copy + header->data_heap.offset + (uint64_t) relocations[0] * 8 + 8,
+        &index, sizeof(index)
+    );
+    lspt_assert(!lspt_loads(image_size));
+
+    // More symbols than there are names.
+    header = lspt_reset();
+    header->symbols.count++;
+    lspt_assert(!lspt_loads(image_size));
+
+    // A name that runs off the end of the symbols section.
+    header = lspt_reset();
+    header->symbols.size--;
+    lspt_assert(!lspt_loads(image_size));
+
+    // The same name twice.
+    header = lspt_reset();
+    char *symbols = copy + header->symbols.offset;
+    char *answer = NULL;
+    for (char *name = symbols; name < symbols + header->symbols.size;) {
+        if (strcmp(name, "answer") == 0) {
+            answer = name;
+        }
+        name += strlen(name) + 1;
+    }
+    lspt_assert(answer != NULL);
+    memcpy(answer, "double", strlen("double"));
+    lspt_assert(!lspt_loads(image_size));
+
+    // Sections that are bigger than their counts say.
+    header = lspt_reset();
+    header->stack.size += 0x1000;
+    lspt_assert(!lspt_loads(image_size));
+
+    header = lspt_reset();
+    header->cons_heap.size += 0x1000;
+    lspt_assert(!lspt_loads(image_size));
+
+    header = lspt_reset();
+    header->data_heap.size += 0x1000;
+    lspt_assert(!lspt_loads(image_size));
+
+    // A section that runs past the end of the file.
+    header = lspt_reset();
+    header->data_heap.count += image_size;
+    header->data_heap.size += image_size * 8;
+    lspt_assert(!lspt_loads(image_size));
+
+    // The unmodified image still loads.
+    lspt_reset();
+    lspt_assert(lspt_loads(image_size));
+
+    unlink(path);
+    free(image);
+    free(copy);
+    return 0;
+}
@@ -0,0 +1,100 @@
+/**
+ * Checks that a VM restored from an image can use the environment, closures and
+ * registered ops that were saved in it.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+
+static void lspt_answer(void) {
+    lsp_push_int(40);
+}
+
+static void lspt_unregistered(void) {
+}
+
+
+static void lspt_save(char const *path) {
+    lsp_vm_init();
+    lsp_push_default_env();
+
+    lsp_push_string("(lambda (x) (* 2 x))");
+    lsp_parse();
+    lsp_car();
+    lsp_dup(1);
+    lsp_eval();
+    lsp_push_symbol("double");
+    lsp_dup(2);
+    lsp_define();
+
+    lsp_push_op(lspt_answer);
+    lsp_push_symbol("answer");
+    lsp_dup(2);
+    lsp_define();
+
+    // Ops that can't be resolved by name can't be saved.
+    lsp_push_op(lspt_unregistered);
+    lspt_assert(!lsp_vm_save_image(path));
+    lsp_pop();
+
+    lspt_assert(lsp_vm_save_image(path));
+}
+
+
+int main(void) {
+    char path[] = "/tmp/lsp-test-image-XXXXXX";
+    int fd = mkstemp(path);
+    lspt_assert(fd >= 0);
+    close(fd);
+
+    lsp_register_op("answer", lspt_answer);
+
+    // Build and save the image in a child process, so that the VM that loads
+    // it starts from nothing.
+    pid_t child = fork();
+    lspt_assert(child >= 0);
+    if (child == 0) {
+        lspt_save(path);
+        exit(0);
+    }
+    int status;
+    lspt_assert(waitpid(child, &status, 0) == child);
+    lspt_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    lsp_vm_config_t config = {
+        .gc_threads = 1,
+    };
+    lspt_assert(!lsp_vm_init_from_image("/nonexistent/image", &config));
+    lspt_assert(lsp_vm_init_from_image(path, &config));
+    unlink(path);
+
+    lspt_assert(lsp_stats_stack_size() == 1);
+
+    lsp_push_string("(+ (double 21) (answer))");
+    lsp_parse();
+    lsp_car();
+    lsp_dup(1);
+    lsp_eval();
+    lspt_assert(lsp_read_int(0) == 82);
+    lsp_pop();
+
+    // Allocate enough to force collections over the mapped heaps.
+    for (int i = 0; i < 100000; i++) {
+        lsp_push_string("garbage");
+        lsp_pop();
+    }
+    lsp_gc_collect();
+
+    lsp_push_string("(double (double 5))");
+    lsp_parse();
+    lsp_car();
+    lsp_dup(1);
+    lsp_eval();
+    lspt_assert(lsp_read_int(0) == 20);
+
+    return 0;
+}
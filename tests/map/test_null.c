@@ -0,0 +1,20 @@
+/**
+ * Checks that mapping over an empty list returns an empty list.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_null();
+    lsp_push_op(lsp_car);
+    lsp_map();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+    lspt_assert(lsp_is_null(0));
+
+    return 0;
+}
@@ -0,0 +1,37 @@
+/**
+ * Checks that `lsp_map` applies a function to each element of a three element
+ * list, preserving their order.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    // ((1 . 10) (2 . 20) (3 . 30))
+    lsp_push_null();
+    for (int i = 3; i > 0; i--) {
+        lsp_push_int(10 * i);
+        lsp_push_int(i);
+        lsp_cons();
+        lsp_cons();
+    }
+
+    lsp_push_op(lsp_cdr);
+    lsp_map();
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    for (int i = 1; i <= 3; i++) {
+        lspt_assert(lsp_is_cons(0));
+        lsp_dup(0);
+        lsp_car();
+        lspt_assert(lsp_read_int(0) == 10 * i);
+        lsp_pop();
+        lsp_cdr();
+    }
+    lspt_assert(lsp_is_null(0));
+
+    return 0;
+}
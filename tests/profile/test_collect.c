@@ -0,0 +1,55 @@
+/**
+ * Checks that forms being profiled are kept alive, and can still be rendered,
+ * after they have been moved by a collection.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+static void collect(void) {
+    lsp_gc_collect();
+    lsp_push_int(1);
+}
+
+
+int main(void) {
+    lsp_vm_config_t config = {
+        .gc_threads = 4,
+    };
+    lsp_vm_init_with_config(&config);
+    lsp_profile_set_interval(1);
+
+    lsp_push_default_env();
+    lsp_push_op(collect);
+    lsp_push_symbol("collect");
+    lsp_dup(2);
+    lsp_define();
+
+    // The reader leaves garbage below the parsed program, so the forms are
+    // moved by each call to `collect` before the conses that follow it.
+    lsp_push_string("(cons (collect) (cons \"tail\" (collect)))");
+    lsp_parse();
+    lsp_car();
+    lsp_swp(1);
+    lsp_eval();
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    char *output;
+    size_t size;
+    FILE *stream = open_memstream(&output, &size);
+    lsp_profile_write(stream);
+    fclose(stream);
+
+    lspt_assert(
+        strstr(output, "\tcons\t(cons (collect) (cons \"tail\" (collect)))\n")
+        != NULL
+    );
+    lspt_assert(strstr(output, "\tcons\t(cons \"tail\" (collect))\n") != NULL);
+
+    free(output);
+    return 0;
+}
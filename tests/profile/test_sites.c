@@ -0,0 +1,39 @@
+/**
+ * Checks that sampled allocations are attributed to the form being evaluated
+ * and the builtin that it calls.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+int main(void) {
+    lsp_vm_init();
+    lsp_profile_set_interval(1);
+
+    lsp_push_string("(cons \"a\" (vector 1 2))");
+    lsp_parse();
+    lsp_car();
+    lsp_push_default_env();
+    lsp_eval();
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    char *output;
+    size_t size;
+    FILE *stream = open_memstream(&output, &size);
+    lsp_profile_write(stream);
+    fclose(stream);
+
+    lspt_assert(strncmp(output, "allocations\tbytes\tbuiltin\tform\n", 31) == 0);
+    lspt_assert(strstr(output, "\tcons\t(cons \"a\" (vector 1 2))\n") != NULL);
+    lspt_assert(strstr(output, "\tvector\t(vector 1 2)\n") != NULL);
+
+    // The string literal is allocated by the reader, outside of any form.
+    lspt_assert(strstr(output, "\t-\t-\n") != NULL);
+
+    free(output);
+    return 0;
+}
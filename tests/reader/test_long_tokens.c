@@ -0,0 +1,55 @@
+/**
+ * Checks that `lsp_parse` can read strings and symbols that are longer than
+ * its fixed buffers, and that symbols read out of the middle of the source are
+ * the same as those interned by name.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    char expected[1001];
+    memset(expected, 'x', 1000);
+    expected[1000] = '\0';
+
+    char source[2100];
+    snprintf(source, sizeof(source), "(%s \"%s\" ab abc)", expected, expected);
+
+    lsp_push_string(source);
+    lsp_parse();
+
+    lspt_expect(lsp_stats_frame_size() == 1);
+    lsp_car();
+
+    lsp_dup(0);
+    lsp_car();
+    lspt_assert(lsp_read_symbol(0) == lsp_intern(expected));
+    lsp_pop();
+
+    lsp_cdr();
+    lsp_dup(0);
+    lsp_car();
+    lspt_assert(strcmp(lsp_borrow_string(0), expected) == 0);
+    lsp_pop();
+
+    lsp_cdr();
+    lsp_dup(0);
+    lsp_car();
+    lspt_assert(lsp_read_symbol(0) == lsp_intern("ab"));
+    lsp_pop();
+
+    lsp_cdr();
+    lsp_dup(0);
+    lsp_car();
+    lspt_assert(lsp_read_symbol(0) == lsp_intern("abc"));
+    lspt_assert(lsp_read_symbol(0) != lsp_intern("ab"));
+    lsp_pop();
+
+    lsp_cdr();
+    lspt_assert(lsp_is_null(0));
+
+    return 0;
+}
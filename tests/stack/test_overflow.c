@@ -0,0 +1,20 @@
+/**
+ * Checks that pushing onto a full stack aborts.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+static void fill_stack(void) {
+    while (true) {
+        lsp_push_int(0);
+    }
+}
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lspt_assert_aborts(fill_stack());
+}
@@ -0,0 +1,20 @@
+/**
+ * Checks that `lsp_reserve` accepts requests that fit in the stack, and aborts
+ * on those that do not.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_reserve(0);
+    lsp_reserve(1024);
+
+    lspt_assert_aborts(lsp_reserve(-1));
+    lspt_assert_aborts(lsp_reserve(0x7fffffff));
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+/**
+ * Checks that the unchecked stack operations behave the same as their checked
+ * counterparts.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+    lsp_reserve(4);
+
+    lsp_push_int(1);
+    lsp_push_int(2);
+    lsp_push_int(3);
+
+    // Positive offsets count down from the top of the stack.
+    lsp_dup_unchecked(2);
+    lspt_assert(lsp_read_int(0) == 1);
+
+    lsp_swp_unchecked(1);
+    lspt_assert(lsp_read_int(0) == 3);
+    lspt_assert(lsp_read_int(1) == 1);
+
+    lsp_store_unchecked(2);
+    lspt_assert(lsp_stats_frame_size() == 3);
+    lspt_assert(lsp_read_int(1) == 3);
+
+    // Negative offsets count up from the frame pointer.
+    lsp_dup_unchecked(-1);
+    lspt_assert(lsp_read_int(0) == 1);
+    lsp_store_unchecked(-3);
+    lspt_assert(lsp_read_int(0) == 1);
+
+    lsp_pop_unchecked();
+    lspt_assert(lsp_stats_frame_size() == 2);
+    lspt_assert(lsp_read_int(0) == 3);
+    lspt_assert(lsp_read_int(1) == 1);
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+/**
+ * Checks that symbols with the same name are interned to the same id, and
+ * that the ids survive garbage collection.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lspt_assert(lsp_intern("if") == LSP_SYM_IF);
+    lspt_assert(lsp_intern("quote") == LSP_SYM_QUOTE);
+    lspt_assert(lsp_intern("define") == LSP_SYM_DEFINE);
+    lspt_assert(lsp_intern("set!") == LSP_SYM_SET);
+    lspt_assert(lsp_intern("lambda") == LSP_SYM_LAMBDA);
+    lspt_assert(lsp_intern("begin") == LSP_SYM_BEGIN);
+
+    lsp_push_symbol("foo");
+    lsp_push_symbol("bar");
+    lsp_push_symbol("foo");
+    lspt_assert(lsp_read_symbol(0) == lsp_read_symbol(2));
+    lspt_assert(lsp_read_symbol(0) != lsp_read_symbol(1));
+
+    // Enough distinct names to force the index to be resized several times.
+    char name[32];
+    for (int i = 0; i < 10000; i++) {
+        snprintf(name, sizeof(name), "symbol-%i", i);
+        lsp_push_symbol(name);
+        lsp_pop();
+    }
+
+    lsp_gc_collect();
+
+    lspt_assert(strcmp(lsp_borrow_symbol(0), "foo") == 0);
+    lspt_assert(strcmp(lsp_borrow_symbol(1), "bar") == 0);
+    lspt_assert(lsp_read_symbol(0) == lsp_intern("foo"));
+    lspt_assert(lsp_symbol_matches_literal("foo"));
+
+    for (int i = 0; i < 10000; i++) {
+        snprintf(name, sizeof(name), "symbol-%i", i);
+        lsp_sym_t sym = lsp_intern(name);
+        lspt_assert(strcmp(lsp_borrow_symbol(0), "foo") == 0);
+        lsp_push_symbol_id(sym);
+        lspt_assert(strcmp(lsp_borrow_symbol(0), name) == 0);
+        lsp_pop();
+    }
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+/**
+ * Checks that tables keep working when their keys and values are moved by
+ * serial, parallel and incremental collections.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+#include <stdio.h>
+
+
+#define COUNT 2000
+
+
+static void push_key(int i) {
+    char key[16];
+    snprintf(key, sizeof(key), "key-%i", i);
+    lsp_push_string(key);
+}
+
+static void run(lsp_vm_config_t *config, long pause_budget) {
+    lsp_vm_t *vm = lsp_vm_create(config);
+    lsp_vm_set_current(vm);
+    lsp_gc_set_pause_budget(pause_budget);
+
+    // Promote the table so that later insertions go through the write
+    // barrier.
+    lsp_push_table();
+    lsp_gc_collect();
+
+    for (int i = 0; i < COUNT; i++) {
+        // Garbage interleaved with live data so that everything has to move.
+        lsp_push_string("garbage");
+        lsp_pop();
+
+        lsp_push_null();
+        lsp_push_int(i);
+        lsp_cons();
+        push_key(i);
+        lsp_dup(2);
+        lsp_table_set();
+
+        if (i % 500 == 0) {
+            lsp_gc_collect_nursery();
+        }
+    }
+
+    for (int i = 0; i < COUNT; i += 2) {
+        push_key(i);
+        lsp_dup(1);
+        lsp_table_delete();
+    }
+
+    lsp_gc_collect_nursery();
+    lsp_gc_collect();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    lsp_dup(0);
+    lsp_table_count();
+    lspt_assert(lsp_read_int(0) == COUNT / 2);
+    lsp_pop();
+
+    for (int i = 0; i < COUNT; i++) {
+        push_key(i);
+        lsp_dup(1);
+        lsp_table_ref();
+        if (i % 2 == 0) {
+            lspt_assert(lsp_is_null(0));
+        } else {
+            lsp_car();
+            lspt_assert(lsp_read_int(0) == i);
+        }
+        lsp_pop();
+    }
+
+    lsp_vm_destroy(vm);
+}
+
+
+int main(void) {
+    lsp_vm_config_t serial = {0};
+    lsp_vm_config_t parallel = {
+        .gc_threads = 4,
+    };
+
+    run(&serial, 0);
+    run(&parallel, 0);
+    run(&serial, 1);
+
+    return 0;
+}
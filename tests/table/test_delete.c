@@ -0,0 +1,54 @@
+/**
+ * Checks that deleting keys from a crowded table leaves every other key
+ * reachable.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+#define COUNT 5000
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_table();
+    for (int i = 0; i < COUNT; i++) {
+        lsp_push_int(-i);
+        lsp_push_int(i);
+        lsp_dup(2);
+        lsp_table_set();
+    }
+
+    // Delete every third key, and one key that was never added.
+    for (int i = 0; i < COUNT; i += 3) {
+        lsp_push_int(i);
+        lsp_dup(1);
+        lsp_table_delete();
+    }
+    lsp_push_int(COUNT);
+    lsp_dup(1);
+    lsp_table_delete();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    lsp_dup(0);
+    lsp_table_count();
+    lspt_assert(lsp_read_int(0) == COUNT - (COUNT + 2) / 3);
+    lsp_pop();
+
+    for (int i = 0; i < COUNT; i++) {
+        lsp_push_int(i);
+        lsp_dup(1);
+        lsp_table_ref();
+        if (i % 3 == 0) {
+            lspt_assert(lsp_is_null(0));
+        } else {
+            lspt_assert(lsp_read_int(0) == -i);
+        }
+        lsp_pop();
+    }
+
+    return 0;
+}
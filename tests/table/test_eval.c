@@ -0,0 +1,32 @@
+/**
+ * Checks that the table builtins can be called from lisp code.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_string(
+        "((lambda (t)"
+        "   (begin"
+        "     (table-set! t \"a\" 1)"
+        "     (table-set! t (quote b) 2)"
+        "     (table-set! t 3 30)"
+        "     (table-delete! t (quote b))"
+        "     (+ (table-ref t \"a\") (* (table-count t) (table-ref t 3)))))"
+        " (make-table))"
+    );
+    lsp_parse();
+    lsp_car();
+
+    lsp_push_default_env();
+    lsp_eval();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+    lspt_assert(lsp_read_int(0) == 61);
+
+    return 0;
+}
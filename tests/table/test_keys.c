@@ -0,0 +1,74 @@
+/**
+ * Checks that null, integers, symbols and strings can all be used as keys, and
+ * that strings are compared by value.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_table();
+
+    lsp_push_int(1);
+    lsp_push_null();
+    lsp_dup(2);
+    lsp_table_set();
+
+    lsp_push_int(2);
+    lsp_push_int(42);
+    lsp_dup(2);
+    lsp_table_set();
+
+    lsp_push_int(3);
+    lsp_push_symbol("key");
+    lsp_dup(2);
+    lsp_table_set();
+
+    lsp_push_int(4);
+    lsp_push_string("key");
+    lsp_dup(2);
+    lsp_table_set();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    lsp_dup(0);
+    lsp_table_count();
+    lspt_assert(lsp_read_int(0) == 4);
+    lsp_pop();
+
+    lsp_push_null();
+    lsp_dup(1);
+    lsp_table_ref();
+    lspt_assert(lsp_read_int(0) == 1);
+    lsp_pop();
+
+    lsp_push_int(42);
+    lsp_dup(1);
+    lsp_table_ref();
+    lspt_assert(lsp_read_int(0) == 2);
+    lsp_pop();
+
+    lsp_push_symbol("key");
+    lsp_dup(1);
+    lsp_table_ref();
+    lspt_assert(lsp_read_int(0) == 3);
+    lsp_pop();
+
+    // A different string with the same contents finds the same entry.
+    lsp_push_string("key");
+    lsp_dup(1);
+    lsp_table_ref();
+    lspt_assert(lsp_read_int(0) == 4);
+    lsp_pop();
+
+    lsp_push_int(43);
+    lsp_dup(1);
+    lsp_table_ref();
+    lspt_assert(lsp_is_null(0));
+    lsp_pop();
+
+    return 0;
+}
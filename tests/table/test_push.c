@@ -0,0 +1,30 @@
+/**
+ * Checks that `lsp_push_table` creates an empty table.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_table();
+    lspt_assert(lsp_is_table(0));
+    lspt_assert(!lsp_is_vector(0));
+
+    lsp_dup(0);
+    lsp_table_count();
+    lspt_assert(lsp_read_int(0) == 0);
+    lsp_pop();
+
+    lsp_push_int(1);
+    lsp_dup(1);
+    lsp_table_ref();
+    lspt_assert(lsp_is_null(0));
+    lsp_pop();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    return 0;
+}
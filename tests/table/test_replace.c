@@ -0,0 +1,37 @@
+/**
+ * Checks that setting an existing key replaces its value without adding a new
+ * entry.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_table();
+
+    lsp_push_int(1);
+    lsp_push_string("key");
+    lsp_dup(2);
+    lsp_table_set();
+
+    lsp_push_int(2);
+    lsp_push_string("key");
+    lsp_dup(2);
+    lsp_table_set();
+
+    lsp_dup(0);
+    lsp_table_count();
+    lspt_assert(lsp_read_int(0) == 1);
+    lsp_pop();
+
+    lsp_push_string("key");
+    lsp_dup(1);
+    lsp_table_ref();
+    lspt_assert(lsp_read_int(0) == 2);
+    lsp_pop();
+
+    return 0;
+}
@@ -0,0 +1,17 @@
+/**
+ * Checks that `lsp_table_set` aborts when the key is a cons cell.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_int(1);
+    lsp_push_cons();
+    lsp_push_table();
+
+    lspt_assert_aborts(lsp_table_set());
+}
@@ -0,0 +1,121 @@
+/**
+ * Checks that vectors, and the values they refer to, are moved correctly by
+ * serial, parallel and incremental collections.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+#define LENGTH 1000
+
+
+/**
+ * Pushes a vector in which each element is a vector containing a string and
+ * its index, interleaved with garbage so that everything has to move.
+ */
+static void push_vectors(void) {
+    lsp_push_vector(LENGTH);
+    for (int i = 0; i < LENGTH; i++) {
+        lsp_push_string("garbage");
+        lsp_push_vector(4);
+        lsp_pop();
+        lsp_pop();
+
+        lsp_push_vector(2);
+
+        lsp_push_string("item");
+        lsp_push_int(0);
+        lsp_dup(2);
+        lsp_vector_set();
+
+        lsp_push_int(i);
+        lsp_push_int(1);
+        lsp_dup(2);
+        lsp_vector_set();
+
+        lsp_push_int(i);
+        lsp_dup(2);
+        lsp_vector_set();
+    }
+}
+
+static void check_vectors(void) {
+    for (int i = 0; i < LENGTH; i++) {
+        lsp_push_int(i);
+        lsp_dup(1);
+        lsp_vector_ref();
+
+        lsp_push_int(0);
+        lsp_dup(1);
+        lsp_vector_ref();
+        lspt_assert(strcmp(lsp_borrow_string(0), "item") == 0);
+        lsp_pop();
+
+        lsp_push_int(1);
+        lsp_dup(1);
+        lsp_vector_ref();
+        lspt_assert(lsp_read_int(0) == i);
+        lsp_pop();
+
+        lsp_pop();
+    }
+}
+
+static void run(lsp_vm_config_t *config, long pause_budget) {
+    lsp_vm_t *vm = lsp_vm_create(config);
+    lsp_vm_set_current(vm);
+    lsp_gc_set_pause_budget(pause_budget);
+
+    push_vectors();
+
+    // Reversing the outer vector in place leaves old vectors pointing at
+    // values that have moved, and an even number of reversals restores the
+    // original order.
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < LENGTH / 2; i++) {
+            int j = LENGTH - 1 - i;
+
+            lsp_push_string("garbage");
+            lsp_pop();
+
+            lsp_push_int(i);
+            lsp_dup(1);
+            lsp_vector_ref();
+            lsp_push_int(j);
+            lsp_dup(2);
+            lsp_vector_ref();
+
+            lsp_push_int(i);
+            lsp_dup(3);
+            lsp_vector_set();
+            lsp_push_int(j);
+            lsp_dup(2);
+            lsp_vector_set();
+        }
+
+        lsp_gc_collect_nursery();
+        if (round % 2) {
+            lsp_gc_collect();
+        }
+    }
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+    check_vectors();
+
+    lsp_vm_destroy(vm);
+}
+
+
+int main(void) {
+    lsp_vm_config_t serial = {0};
+    lsp_vm_config_t parallel = {
+        .gc_threads = 4,
+    };
+
+    run(&serial, 0);
+    run(&parallel, 0);
+    run(&serial, 1);
+
+    return 0;
+}
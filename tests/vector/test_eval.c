@@ -0,0 +1,30 @@
+/**
+ * Checks that the vector builtins can be called from lisp code.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_string(
+        "((lambda (v)"
+        "   (begin"
+        "     (vector-set! v 0 10)"
+        "     (vector-ref (vector-map car (vector (cons (vector-ref v 0) 0)))"
+        "                 (- (vector-length v) 3))))"
+        " (vector 1 2 3))"
+    );
+    lsp_parse();
+    lsp_car();
+
+    lsp_push_default_env();
+    lsp_eval();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+    lspt_assert(lsp_read_int(0) == 10);
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+/**
+ * Checks that `lsp_push_vector_from_ints` copies each value into the vector in
+ * order.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_int_t values[] = {5, -3, LSP_INT_MIN, LSP_INT_MAX};
+    lsp_push_vector_from_ints(values, 4);
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    lsp_dup(0);
+    lsp_vector_length();
+    lspt_assert(lsp_read_int(0) == 4);
+    lsp_pop();
+
+    for (int i = 0; i < 4; i++) {
+        lsp_push_int(i);
+        lsp_dup(1);
+        lsp_vector_ref();
+        lspt_assert(lsp_read_int(0) == values[i]);
+        lsp_pop();
+    }
+
+    return 0;
+}
@@ -0,0 +1,39 @@
+/**
+ * Checks that `lsp_vector_map` applies a function to each element of a vector,
+ * preserving their order.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    // #((1 . 10) (2 . 20) (3 . 30))
+    for (int i = 3; i > 0; i--) {
+        lsp_push_int(10 * i);
+        lsp_push_int(i);
+        lsp_cons();
+    }
+    lsp_vector();
+
+    lsp_push_op(lsp_cdr);
+    lsp_vector_map();
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    lsp_dup(0);
+    lsp_vector_length();
+    lspt_assert(lsp_read_int(0) == 3);
+    lsp_pop();
+
+    for (int i = 0; i < 3; i++) {
+        lsp_push_int(i);
+        lsp_dup(1);
+        lsp_vector_ref();
+        lspt_assert(lsp_read_int(0) == 10 * (i + 1));
+        lsp_pop();
+    }
+
+    return 0;
+}
@@ -0,0 +1,17 @@
+/**
+ * Checks that `lsp_vector_ref` aborts when the index is past the end of the
+ * vector.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_int(2);
+    lsp_push_vector(2);
+
+    lspt_assert_aborts(lsp_vector_ref());
+}
@@ -0,0 +1,38 @@
+/**
+ * Checks that `lsp_push_vector` creates a vector of nulls of the requested
+ * length.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_vector(3);
+    lspt_assert(lsp_is_vector(0));
+    lspt_assert(!lsp_is_cons(0));
+
+    lsp_dup(0);
+    lsp_vector_length();
+    lspt_assert(lsp_read_int(0) == 3);
+    lsp_pop();
+
+    for (int i = 0; i < 3; i++) {
+        lsp_push_int(i);
+        lsp_dup(1);
+        lsp_vector_ref();
+        lspt_assert(lsp_is_null(0));
+        lsp_pop();
+    }
+
+    lsp_push_vector(0);
+    lsp_vector_length();
+    lspt_assert(lsp_read_int(0) == 0);
+    lsp_pop();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+/**
+ * Checks that `lsp_vector_set` replaces a single element, and pops all of its
+ * arguments.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_int_t values[] = {1, 2, 3};
+    lsp_push_vector_from_ints(values, 3);
+
+    lsp_push_string("replaced");
+    lsp_push_int(1);
+    lsp_dup(2);
+    lsp_vector_set();
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    lsp_push_int(0);
+    lsp_dup(1);
+    lsp_vector_ref();
+    lspt_assert(lsp_read_int(0) == 1);
+    lsp_pop();
+
+    lsp_push_int(1);
+    lsp_dup(1);
+    lsp_vector_ref();
+    lspt_assert(strcmp(lsp_borrow_string(0), "replaced") == 0);
+    lsp_pop();
+
+    lsp_push_int(2);
+    lsp_dup(1);
+    lsp_vector_ref();
+    lspt_assert(lsp_read_int(0) == 3);
+    lsp_pop();
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+/**
+ * Checks that `lsp_vector` collects the current frame into a vector, starting
+ * from the top of the stack.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_push_int(3);
+    lsp_push_string("two");
+    lsp_push_int(1);
+
+    lsp_vector();
+    lspt_assert(lsp_stats_frame_size() == 1);
+    lspt_assert(lsp_is_vector(0));
+
+    lsp_push_int(0);
+    lsp_dup(1);
+    lsp_vector_ref();
+    lspt_assert(lsp_read_int(0) == 1);
+    lsp_pop();
+
+    lsp_push_int(1);
+    lsp_dup(1);
+    lsp_vector_ref();
+    lspt_assert(strcmp(lsp_borrow_string(0), "two") == 0);
+    lsp_pop();
+
+    lsp_push_int(2);
+    lsp_dup(1);
+    lsp_vector_ref();
+    lspt_assert(lsp_read_int(0) == 3);
+    lsp_pop();
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+/**
+ * Checks that young values stored in an old vector survive nursery collections
+ * even if nothing else refers to them.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    // Promote a vector into the old generation.
+    lsp_push_vector(2);
+    lsp_gc_collect();
+
+    // Garbage allocated before the young values will force them to move.
+    for (int i = 0; i < 100; i++) {
+        lsp_push_string("garbage");
+        lsp_pop();
+        lsp_push_cons();
+        lsp_pop();
+    }
+
+    lsp_push_string("first");
+    lsp_push_int(0);
+    lsp_dup(2);
+    lsp_vector_set();
+
+    lsp_push_null();
+    lsp_push_int(7);
+    lsp_cons();
+    lsp_push_int(1);
+    lsp_dup(2);
+    lsp_vector_set();
+
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    lsp_gc_collect_nursery();
+
+    // A second nursery collection checks that the values were promoted.
+    lsp_push_cons();
+    lsp_pop();
+    lsp_gc_collect_nursery();
+
+    lsp_push_int(0);
+    lsp_dup(1);
+    lsp_vector_ref();
+    lspt_assert(strcmp(lsp_borrow_string(0), "first") == 0);
+    lsp_pop();
+
+    lsp_push_int(1);
+    lsp_dup(1);
+    lsp_vector_ref();
+    lsp_car();
+    lspt_assert(lsp_read_int(0) == 7);
+    lsp_pop();
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+/**
+ * Checks that allocations are counted for each heap, and that immediates are
+ * not counted at all.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    size_t cons_allocations = lsp_stats_cons_allocations();
+    size_t data_allocations = lsp_stats_data_allocations();
+
+    lsp_push_int(1);
+    lsp_push_symbol("one");
+    lspt_assert(lsp_stats_cons_allocations() == cons_allocations);
+    lspt_assert(lsp_stats_data_allocations() == data_allocations);
+
+    lsp_cons();
+    lspt_assert(lsp_stats_cons_allocations() == cons_allocations + 1);
+    lspt_assert(lsp_stats_data_allocations() == data_allocations);
+
+    lsp_push_string("one");
+    lsp_push_string("two");
+    lspt_assert(lsp_stats_cons_allocations() == cons_allocations + 1);
+    lspt_assert(lsp_stats_data_allocations() == data_allocations + 2);
+
+    // Counts are cumulative, so collecting does not reset them.
+    lsp_pop();
+    lsp_gc_collect();
+    lspt_assert(lsp_stats_data_allocations() == data_allocations + 2);
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+/**
+ * Checks that the VM counts collections and allocations, and records how long
+ * each phase of collection takes.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_vm_stats_t stats;
+    lsp_stats_get(&stats);
+    lspt_assert(stats.collections == 0);
+    lspt_assert(stats.nursery_collections == 0);
+    lspt_assert(stats.mark_ns == 0);
+
+    lsp_push_null();
+    for (int i = 0; i < 1000; i++) {
+        lsp_push_string("garbage");
+        lsp_pop();
+        lsp_push_int(i);
+        lsp_cons();
+    }
+
+    lsp_gc_collect_nursery();
+    lsp_gc_collect();
+
+    lsp_stats_get(&stats);
+    lspt_assert(stats.collections == 1);
+    lspt_assert(stats.nursery_collections == 1);
+    lspt_assert(stats.cons_allocations == 1000);
+    lspt_assert(stats.data_allocations == 1000);
+    lspt_assert(stats.data_bytes_allocated >= 1000 * 16);
+    lspt_assert(stats.stack_high_water == 2);
+
+    // The list survives, and the garbage strings do not.
+    lspt_assert(stats.live_cells >= 1000);
+    lspt_assert(stats.live_words < 1000);
+
+    lspt_assert(stats.mark_ns > 0);
+    lspt_assert(stats.cache_ns > 0);
+    lspt_assert(stats.compact_ns > 0);
+    lspt_assert(stats.rewrite_ns > 0);
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+/**
+ * Checks that `(vm-stats)` returns an association list of integers.
+ */
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+int main(void) {
+    lsp_vm_init();
+
+    lsp_gc_collect();
+
+    lsp_push_string("(vm-stats)");
+    lsp_parse();
+    lsp_car();
+    lsp_push_default_env();
+    lsp_eval();
+    lspt_assert(lsp_stats_frame_size() == 1);
+
+    // The first entry is the number of full collections.
+    lsp_dup(0);
+    lsp_car();
+    lsp_dup(0);
+    lsp_car();
+    lspt_assert(strcmp(lsp_borrow_symbol(0), "collections") == 0);
+    lsp_pop();
+    lsp_cdr();
+    lspt_assert(lsp_read_int(0) == 1);
+    lsp_pop();
+
+    // Timings are in nanoseconds, so even a collection of an almost empty
+    // heap should register.
+    int count = 0;
+    lsp_int_t mark_ns = -1;
+    while (!lsp_is_null(0)) {
+        lsp_dup(0);
+        lsp_car();
+        lsp_dup(0);
+        lsp_car();
+        bool is_mark = strcmp(lsp_borrow_symbol(0), "mark-ns") == 0;
+        lsp_pop();
+        lsp_cdr();
+        lspt_assert(lsp_is_int(0));
+        if (is_mark) {
+            mark_ns = lsp_read_int(0);
+        }
+        lsp_pop();
+        lsp_cdr();
+        count++;
+    }
+    lspt_assert(count == 12);
+    lspt_assert(mark_ns > 0);
+
+    return 0;
+}
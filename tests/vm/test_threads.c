@@ -0,0 +1,81 @@
+/**
+ * Checks that separate threads can each run their own VM at the same time.
+ */
+#include <pthread.h>
+
+#include "lsp.h"
+
+#include "lspt.h"
+
+
+#define NTHREADS 4
+
+
+static void *run(void *arg) {
+    int seed = *(int *) arg;
+
+    lsp_vm_config_t config = {
+        .gc_threads = 2,
+    };
+    lsp_vm_t *vm = lsp_vm_create(&config);
+    lspt_assert(lsp_vm_get_current() == NULL);
+    lsp_vm_set_current(vm);
+    lspt_assert(lsp_vm_get_current() == vm);
+
+    lsp_push_null();
+    for (int i = 0; i < 50000; i++) {
+        // Garbage between the live cells so that collections move them.
+        lsp_push_string("garbage");
+        lsp_pop();
+
+        lsp_push_int(seed + i);
+        lsp_cons();
+        if (i % 10000 == 0) {
+            lsp_gc_collect();
+        }
+    }
+    lsp_gc_collect();
+
+    lsp_push_symbol("thread");
+    lsp_pop();
+
+    for (int i = 50000 - 1; i >= 0; i--) {
+        lspt_assert(lsp_is_cons(0));
+        lsp_dup(0);
+        lsp_car();
+        lspt_assert(lsp_read_int(0) == seed + i);
+        lsp_pop();
+        lsp_cdr();
+    }
+    lspt_assert(lsp_is_null(0));
+
+    lsp_vm_destroy(vm);
+    lspt_assert(lsp_vm_get_current() == NULL);
+    return NULL;
+}
+
+
+int main(void) {
+    // The main thread keeps a VM of its own, which the others must not
+    // disturb.
+    lsp_vm_init();
+    lsp_push_int(42);
+    lsp_vm_t *main_vm = lsp_vm_get_current();
+
+    pthread_t threads[NTHREADS];
+    int seeds[NTHREADS];
+    for (int i = 0; i < NTHREADS; i++) {
+        seeds[i] = i * 1000000;
+        lspt_assert(pthread_create(&threads[i], NULL, run, &seeds[i]) == 0);
+    }
+    for (int i = 0; i < NTHREADS; i++) {
+        lspt_assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    lspt_assert(lsp_vm_get_current() == main_vm);
+    lspt_assert(lsp_stats_frame_size() == 1);
+    lspt_assert(lsp_read_int(0) == 42);
+
+    lsp_vm_destroy(main_vm);
+    return 0;
+}